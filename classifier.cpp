@@ -1,4 +1,8 @@
 #include <set>
+#include <map>
+#include <fstream>
+#include <cstdio>
+#include <cfloat>
 using namespace std;
 
 
@@ -6,9 +10,13 @@ using namespace std;
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/ml.hpp>
 #include <opencv2/flann/miniflann.hpp>
+#include <opencv2/hal.hpp>
 using namespace cv;
 
 #include "texturefeature.h"
+#include "modelfile.h"
+#include "simd.h"
+#include "half.h"
 
 using namespace TextureFeature;
 
@@ -27,12 +35,577 @@ static Mat tofloat(const Mat &src)
 }
 
 
+//
+// brute force gallery scan, for the common (float) metrics.
+//   rows get compared in tiles of TILE floats (sse2/avx2 kernels),
+//   the monotone metrics (L1,L2,L2SQR,CHISQR_ALT) give up on a row
+//   as soon as it can't beat the best one so far,
+//   and the gallery gets split into shards, scanned in parallel.
+//   for batches of queries, the dot product based ones (L2,L2SQR,COSINE,HELLINGER)
+//   go through gemm instead.
+//
+namespace scan
+{
+#ifdef HAVE_SSE
+static inline float hsum(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+#endif
+
+struct OpL1
+{
+    static float scalar(float a, float b) { return std::abs(a - b); }
+#ifdef HAVE_SSE
+    static __m128 sse(__m128 a, __m128 b) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), _mm_sub_ps(a, b)); }
+    TARGET_AVX2 static __m256 avx(__m256 a, __m256 b) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_sub_ps(a, b)); }
+#endif
+};
+struct OpL2
+{
+    static float scalar(float a, float b) { float d = a - b; return d*d; }
+#ifdef HAVE_SSE
+    static __m128 sse(__m128 a, __m128 b) { __m128 d = _mm_sub_ps(a, b); return _mm_mul_ps(d, d); }
+    TARGET_AVX2 static __m256 avx(__m256 a, __m256 b) { __m256 d = _mm256_sub_ps(a, b); return _mm256_mul_ps(d, d); }
+#endif
+};
+struct OpDot
+{
+    static float scalar(float a, float b) { return a*b; }
+#ifdef HAVE_SSE
+    static __m128 sse(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+    TARGET_AVX2 static __m256 avx(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+#endif
+};
+// 2*(a-b)^2/(a+b), skipping empty bins (same as compareHist)
+struct OpChi
+{
+    static float scalar(float a, float b) { float d = a - b, s = a + b; return std::abs(s) > float(DBL_EPSILON) ? 2*d*d/s : 0.0f; }
+#ifdef HAVE_SSE
+    static __m128 sse(__m128 a, __m128 b)
+    {
+        __m128 d = _mm_sub_ps(a, b), s = _mm_add_ps(a, b);
+        __m128 m = _mm_cmpgt_ps(_mm_andnot_ps(_mm_set1_ps(-0.0f), s), _mm_set1_ps(float(DBL_EPSILON)));
+        __m128 r = _mm_div_ps(_mm_mul_ps(_mm_set1_ps(2.0f), _mm_mul_ps(d, d)), _mm_or_ps(_mm_and_ps(m, s), _mm_andnot_ps(m, _mm_set1_ps(1.0f))));
+        return _mm_and_ps(m, r);
+    }
+    TARGET_AVX2 static __m256 avx(__m256 a, __m256 b)
+    {
+        __m256 d = _mm256_sub_ps(a, b), s = _mm256_add_ps(a, b);
+        __m256 m = _mm256_cmp_ps(_mm256_andnot_ps(_mm256_set1_ps(-0.0f), s), _mm256_set1_ps(float(DBL_EPSILON)), _CMP_GT_OQ);
+        __m256 r = _mm256_div_ps(_mm256_mul_ps(_mm256_set1_ps(2.0f), _mm256_mul_ps(d, d)), _mm256_blendv_ps(_mm256_set1_ps(1.0f), s, m));
+        return _mm256_and_ps(m, r);
+    }
+#endif
+};
+
+#ifdef HAVE_SSE
+template <class Op>
+TARGET_AVX2 static float block_avx2(const float *a, const float *b, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i<=n-8; i+=8)
+        acc = _mm256_add_ps(acc, Op::avx(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+    float s = hsum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i<n; i++)
+        s += Op::scalar(a[i], b[i]);
+    return s;
+}
+#endif
+
+template <class Op>
+static float block(const float *a, const float *b, int n)
+{
+    int i = 0;
+    float s = 0;
+#ifdef HAVE_SSE
+    if (haveAVX2())
+        return block_avx2<Op>(a, b, n);
+    __m128 acc = _mm_setzero_ps();
+    for (; i<=n-4; i+=4)
+        acc = _mm_add_ps(acc, Op::sse(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+    s = hsum(acc);
+#endif
+    for (; i<n; i++)
+        s += Op::scalar(a[i], b[i]);
+    return s;
+}
+
+enum { TILE=256 };
+
+// sum over a whole row, tile by tile, giving up once it's past bound
+template <class Op>
+static double row(const float *a, const float *b, int n, double bound=DBL_MAX)
+{
+    double s = 0;
+    for (int i=0; i<n; i+=TILE)
+    {
+        s += block<Op>(a+i, b+i, std::min(int(TILE), n-i));
+        if (s > bound)
+            break;
+    }
+    return s;
+}
+} // namespace scan
+
+
+struct GalleryScan
+{
+    enum Metric { NONE=-1, L1, L2, L2SQR, HELLINGER, CHISQR_ALT, COSINE };
+
+    int metric;
+    Mat source;             // the gallery, as passed in
+    Mat gallery;            // CV_32F, sqrt'ed for HELLINGER
+    vector<double> aux;     // per row: squared norm (L2,L2SQR,COSINE), sum (HELLINGER)
+
+    GalleryScan() : metric(NONE) {}
+
+    bool matches(const Mat &features, int m) const
+    {
+        return metric == m && source.data == features.data
+            && source.rows == features.rows && source.cols == features.cols;
+    }
+
+    void build(const Mat &features, int m)
+    {
+        metric = m;
+        source = features;
+        aux.clear();
+        if (metric == L2 || metric == L2SQR || metric == COSINE || metric == HELLINGER)
+        {
+            aux.resize(features.rows);
+            for (int r=0; r<features.rows; r++)
+            {
+                const float *f = features.ptr<float>(r);
+                aux[r] = (metric == HELLINGER) ? sum(features.row(r))[0] : scan::row<scan::OpDot>(f, f, features.cols);
+            }
+        }
+        // a fresh buffer, features belongs to the classifier
+        gallery = Mat();
+        if (metric == HELLINGER)
+            cv::sqrt(features, gallery);
+        else
+            gallery = features;
+    }
+
+    // query side of the dot product metrics
+    void prepare(const Mat &query, Mat &q, double &qaux) const
+    {
+        q = query.reshape(1,1);
+        qaux = 0;
+        if (metric == HELLINGER)
+        {
+            qaux = sum(q)[0];
+            q = q.clone(); // don't touch the caller's data
+            cv::sqrt(q, q);
+        }
+        else if (metric == L2 || metric == L2SQR || metric == COSINE)
+        {
+            qaux = scan::row<scan::OpDot>(q.ptr<float>(), q.ptr<float>(), q.cols);
+        }
+    }
+
+    // final distance from a dot product, for the gemm based metrics
+    double fromDot(double dot, double qaux, int r) const
+    {
+        switch (metric)
+        {
+            case L2:    return std::sqrt(std::max(qaux + aux[r] - 2*dot, 0.0));
+            case L2SQR: return std::max(qaux + aux[r] - 2*dot, 0.0);
+            case COSINE:return -dot / std::sqrt(qaux * aux[r]);
+            case HELLINGER:
+            {
+                double scale = qaux * aux[r];
+                scale = std::abs(scale) > DBL_EPSILON ? 1.0/std::sqrt(scale) : 1.0;
+                return std::sqrt(std::max(1.0 - dot*scale, 0.0));
+            }
+        }
+        return DBL_MAX;
+    }
+
+    // best row in [r0,r1)
+    void scanRows(const float *q, double qaux, int r0, int r1, int &best, double &mind) const
+    {
+        int n = gallery.cols;
+        best = -1;
+        mind = DBL_MAX;
+        for (int r=r0; r<r1; r++)
+        {
+            const float *g = gallery.ptr<float>(r);
+            double d = DBL_MAX;
+            switch (metric)
+            {
+                case L1:         d = scan::row<scan::OpL1>(q, g, n, mind); break;
+                case L2:
+                case L2SQR:      d = scan::row<scan::OpL2>(q, g, n, mind); break;
+                case CHISQR_ALT: d = scan::row<scan::OpChi>(q, g, n, mind); break;
+                default:         d = fromDot(scan::row<scan::OpDot>(q, g, n), qaux, r); break;
+            }
+            if (d < mind)
+            {
+                mind = d;
+                best = r;
+            }
+        }
+        if (metric == L2 && best >= 0) // compared squared
+            mind = std::sqrt(mind);
+    }
+
+    struct ParallelScan : public ParallelLoopBody
+    {
+        const GalleryScan &gs;
+        const float *q;
+        double qaux;
+        int nshards;
+        vector<int> &best;
+        vector<double> &dist;
+
+        ParallelScan(const GalleryScan &gs, const float *q, double qaux, int nshards, vector<int> &best, vector<double> &dist)
+            : gs(gs), q(q), qaux(qaux), nshards(nshards), best(best), dist(dist)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            int N = gs.gallery.rows;
+            for (int s=range.start; s<range.end; s++)
+                gs.scanRows(q, qaux, int(int64(s)*N/nshards), int(int64(s+1)*N/nshards), best[s], dist[s]);
+        }
+    };
+
+    void nearest(const Mat &query, int &best, double &mind) const
+    {
+        Mat q;
+        double qaux;
+        prepare(query, q, qaux);
+
+        // don't bother spawning threads for small galleries
+        int nshards = int(std::min<int64>(gallery.rows, int64(gallery.rows) * gallery.cols / (1<<16) + 1));
+        nshards = std::max(1, std::min(nshards, getNumThreads() * 4));
+        vector<int> b(nshards, -1);
+        vector<double> d(nshards, DBL_MAX);
+        if (nshards == 1)
+            scanRows(q.ptr<float>(), qaux, 0, gallery.rows, b[0], d[0]);
+        else
+            parallel_for_(Range(0, nshards), ParallelScan(*this, q.ptr<float>(), qaux, nshards, b, d));
+
+        best = -1;
+        mind = DBL_MAX;
+        for (int s=0; s<nshards; s++) // shards are in row order, so ties still go to the first row
+        {
+            if (b[s] >= 0 && d[s] < mind)
+            {
+                mind = d[s];
+                best = b[s];
+            }
+        }
+    }
+
+    bool gemmable() const
+    {
+        return metric == L2 || metric == L2SQR || metric == COSINE || metric == HELLINGER;
+    }
+
+    struct ParallelTopK : public ParallelLoopBody
+    {
+        enum { QBLOCK=64, GBLOCK=1024 };
+
+        const GalleryScan &gs;
+        const Mat &Q;
+        const vector<double> &qaux;
+        Mat &indices, &dists;
+
+        ParallelTopK(const GalleryScan &gs, const Mat &Q, const vector<double> &qaux, Mat &indices, Mat &dists)
+            : gs(gs), Q(Q), qaux(qaux), indices(indices), dists(dists)
+        {}
+
+        void insert(int i, int r, double d) const
+        {
+            int k = indices.cols;
+            int *ind = indices.ptr<int>(i);
+            float *dst = dists.ptr<float>(i);
+            if (ind[k-1] >= 0 && d >= dst[k-1])
+                return;
+            int j = k-1;
+            for (; j>0 && (ind[j-1] < 0 || d < dst[j-1]); j--)
+            {
+                ind[j] = ind[j-1];
+                dst[j] = dst[j-1];
+            }
+            ind[j] = r;
+            dst[j] = float(d);
+        }
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int b=range.start; b<range.end; b++)
+            {
+                int q0 = b*QBLOCK, q1 = std::min(q0 + QBLOCK, Q.rows);
+                Mat qb = Q.rowRange(q0, q1);
+                for (int g0=0; g0<gs.gallery.rows; g0+=GBLOCK)
+                {
+                    int g1 = std::min(g0 + GBLOCK, gs.gallery.rows);
+                    Mat S;
+                    if (gs.gemmable())
+                        gemm(qb, gs.gallery.rowRange(g0, g1), 1, noArray(), 0, S, GEMM_2_T);
+                    for (int i=q0; i<q1; i++)
+                    {
+                        const float *q = Q.ptr<float>(i);
+                        for (int r=g0; r<g1; r++)
+                        {
+                            double d = gs.gemmable()
+                                ? gs.fromDot(S.at<float>(i-q0, r-g0), qaux[i], r)
+                                : gs.distance(q, r);
+                            insert(i, r, d);
+                        }
+                    }
+                }
+            }
+        }
+    };
+
+    // plain distance of a (prepared) query to row r, no early exit
+    double distance(const float *q, int r) const
+    {
+        const float *g = gallery.ptr<float>(r);
+        int n = gallery.cols;
+        switch (metric)
+        {
+            case L1:         return scan::row<scan::OpL1>(q, g, n);
+            case L2:         return std::sqrt(scan::row<scan::OpL2>(q, g, n));
+            case L2SQR:      return scan::row<scan::OpL2>(q, g, n);
+            case CHISQR_ALT: return scan::row<scan::OpChi>(q, g, n);
+        }
+        return DBL_MAX;
+    }
+
+    //
+    // k nearest rows per query row, sorted by distance.
+    //   indices(CV_32S) and dists(CV_32F) get one row per query, -1 / FLT_MAX where the gallery is too small.
+    //
+    void topk(const Mat &queries, int k, Mat &indices, Mat &dists) const
+    {
+        Mat Q(queries.rows, queries.cols, CV_32F);
+        vector<double> qaux(queries.rows);
+        for (int i=0; i<queries.rows; i++)
+        {
+            Mat q;
+            prepare(queries.row(i), q, qaux[i]);
+            q.copyTo(Q.row(i));
+        }
+        indices.create(queries.rows, k, CV_32S);
+        indices = Scalar(-1);
+        dists.create(queries.rows, k, CV_32F);
+        dists = Scalar(FLT_MAX);
+        int nblocks = (queries.rows + ParallelTopK::QBLOCK - 1) / ParallelTopK::QBLOCK;
+        parallel_for_(Range(0, nblocks), ParallelTopK(*this, Q, qaux, indices, dists));
+    }
+};
+
+
+//
+// packed binary descriptors (CV_8U rows, like LATCH2), compared by hamming distance.
+//   the gallery gets repacked into zero padded rows of 64bit words,
+//   bits are counted with a nibble lookup (avx2), or the popcnt instruction,
+//   and gallery rows are visited in tiles, that stay in cache
+//   while all the queries run over them.
+//
+namespace hamming
+{
+static inline int pop64(uint64 x)
+{
+#if defined(__GNUC__)
+    return __builtin_popcountll(x);
+#else
+    x = x - ((x >> 1) & CV_BIG_UINT(0x5555555555555555));
+    x = (x & CV_BIG_UINT(0x3333333333333333)) + ((x >> 2) & CV_BIG_UINT(0x3333333333333333));
+    x = (x + (x >> 4)) & CV_BIG_UINT(0x0f0f0f0f0f0f0f0f);
+    return int((x * CV_BIG_UINT(0x0101010101010101)) >> 56);
+#endif
+}
+
+static int dist_scalar(const uint64 *a, const uint64 *b, int n)
+{
+    int d = 0;
+    for (int i=0; i<n; i++)
+        d += pop64(a[i] ^ b[i]);
+    return d;
+}
+
+#ifdef HAVE_SSE
+TARGET_POPCNT static int dist_popcnt(const uint64 *a, const uint64 *b, int n)
+{
+    int d = 0;
+    for (int i=0; i<n; i++)
+        d += int(_mm_popcnt_u64(a[i] ^ b[i]));
+    return d;
+}
+
+TARGET_AVX2 static int dist_avx2(const uint64 *a, const uint64 *b, int n)
+{
+    const __m256i lut = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                         0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i acc = _mm256_setzero_si256();
+    int i = 0;
+    for (; i<=n-4; i+=4)
+    {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(a+i)), _mm256_loadu_si256((const __m256i*)(b+i)));
+        __m256i c = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(v, low)),
+                                    _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), low)));
+        acc = _mm256_add_epi64(acc, _mm256_sad_epu8(c, _mm256_setzero_si256()));
+    }
+    uint64 s[4];
+    _mm256_storeu_si256((__m256i*)s, acc);
+    int d = int(s[0] + s[1] + s[2] + s[3]);
+    for (; i<n; i++)
+        d += pop64(a[i] ^ b[i]);
+    return d;
+}
+#endif
+
+static int distance(const uint64 *a, const uint64 *b, int n)
+{
+#ifdef HAVE_SSE
+    if (haveAVX2() && n >= 4)
+        return dist_avx2(a, b, n);
+    if (havePOPCNT())
+        return dist_popcnt(a, b, n);
+#endif
+    return dist_scalar(a, b, n);
+}
+
+// CV_8U rows -> rows of 64bit words (as CV_8U, step is a multiple of 8)
+static void pack(const Mat &src, Mat &dst, int words)
+{
+    dst = Mat::zeros(src.rows, words * 8, CV_8U);
+    src.copyTo(dst.colRange(0, src.cols));
+}
+
+static inline const uint64 *words(const Mat &m, int r)
+{
+    return (const uint64 *)m.ptr(r);
+}
+
+enum { TILE_BYTES=1<<17 };
+} // namespace hamming
+
+
+struct HammingScan
+{
+    Mat source;     // the gallery, as passed in
+    Mat gallery;    // packed into words
+    int W;          // words per row
+
+    HammingScan() : W(0) {}
+
+    bool matches(const Mat &features) const
+    {
+        return source.data == features.data && source.rows == features.rows && source.cols == features.cols;
+    }
+
+    void build(const Mat &features)
+    {
+        source = features;
+        W = (int(features.cols) + 7) / 8;
+        hamming::pack(features, gallery, W);
+    }
+
+    // best row per query, for the gallery rows in [r0,r1)
+    void scanRows(const Mat &Q, int r0, int r1, int *best, int *mind) const
+    {
+        int tile = std::max(16, int(hamming::TILE_BYTES / (W * 8)));
+        for (int q=0; q<Q.rows; q++)
+        {
+            best[q] = -1;
+            mind[q] = INT_MAX;
+        }
+        for (int t0=r0; t0<r1; t0+=tile)
+        {
+            int t1 = std::min(t0 + tile, r1);
+            for (int q=0; q<Q.rows; q++)
+            {
+                const uint64 *a = hamming::words(Q, q);
+                for (int r=t0; r<t1; r++)
+                {
+                    int d = hamming::distance(a, hamming::words(gallery, r), W);
+                    if (d < mind[q])
+                    {
+                        mind[q] = d;
+                        best[q] = r;
+                    }
+                }
+            }
+        }
+    }
+
+    struct ParallelHamming : public ParallelLoopBody
+    {
+        const HammingScan &hs;
+        const Mat &Q;
+        int nshards;
+        Mat &best, &dist; // nshards x queries
+
+        ParallelHamming(const HammingScan &hs, const Mat &Q, int nshards, Mat &best, Mat &dist)
+            : hs(hs), Q(Q), nshards(nshards), best(best), dist(dist)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            int N = hs.gallery.rows;
+            for (int s=range.start; s<range.end; s++)
+                hs.scanRows(Q, int(int64(s)*N/nshards), int(int64(s+1)*N/nshards), best.ptr<int>(s), dist.ptr<int>(s));
+        }
+    };
+
+    //
+    // nearest gallery row per query row.
+    //   indices(CV_32S) and dists(CV_32F, bits) get one row per query.
+    //
+    void nearest(const Mat &queries, Mat &indices, Mat &dists) const
+    {
+        Mat Q;
+        hamming::pack(queries.reshape(1, queries.rows), Q, W);
+
+        int nshards = int(std::min<int64>(gallery.rows, int64(gallery.rows) * W / (1<<13) + 1));
+        nshards = std::max(1, std::min(nshards, getNumThreads() * 4));
+        Mat b(nshards, Q.rows, CV_32S), d(nshards, Q.rows, CV_32S);
+        if (nshards == 1)
+            scanRows(Q, 0, gallery.rows, b.ptr<int>(0), d.ptr<int>(0));
+        else
+            parallel_for_(Range(0, nshards), ParallelHamming(*this, Q, nshards, b, d));
+
+        indices.create(Q.rows, 1, CV_32S);
+        dists.create(Q.rows, 1, CV_32F);
+        for (int q=0; q<Q.rows; q++)
+        {
+            int best = -1, mind = INT_MAX;
+            for (int s=0; s<nshards; s++) // shards are in row order, so ties still go to the first row
+            {
+                if (b.at<int>(s,q) >= 0 && d.at<int>(s,q) < mind)
+                {
+                    mind = d.at<int>(s,q);
+                    best = b.at<int>(s,q);
+                }
+            }
+            indices.at<int>(q) = best;
+            dists.at<float>(q) = best >= 0 ? float(mind) : FLT_MAX;
+        }
+    }
+};
+
+
 struct ClassifierNearest : public TextureFeature::Classifier
 {
     Mat features;
     Mat labels;
     int flag;
 
+    mutable Mutex mtx;
+    mutable GalleryScan scan;
+
     ClassifierNearest(int flag=NORM_L2) : flag(flag) {}
 
     virtual double distance(const cv::Mat &testFeature, const cv::Mat &trainFeature) const
@@ -40,6 +613,30 @@ struct ClassifierNearest : public TextureFeature::Classifier
         return norm(testFeature, trainFeature, flag);
     }
 
+    // the GalleryScan equivalent of distance(), or NONE
+    virtual int metric() const
+    {
+        switch (flag)
+        {
+            case NORM_L1:    return GalleryScan::L1;
+            case NORM_L2:    return GalleryScan::L2;
+            case NORM_L2SQR: return GalleryScan::L2SQR;
+        }
+        return GalleryScan::NONE;
+    }
+
+    // scan engine for the current gallery (if float, and the metric is supported)
+    const GalleryScan *gallery(const Mat &query) const
+    {
+        int m = metric();
+        if (m == GalleryScan::NONE || features.type() != CV_32F || query.type() != CV_32F || features.empty())
+            return 0;
+        AutoLock lock(mtx);
+        if (! scan.matches(features, m))
+            scan.build(features, m);
+        return &scan;
+    }
+
     template <typename Dist>
     static void nearest(const cv::Mat &testFeature, const cv::Mat &features, int &best, double &mind, const Dist &dis)
     {
@@ -55,12 +652,37 @@ struct ClassifierNearest : public TextureFeature::Classifier
             }
         }
     }
+
+    //
+    // a batch of queries, one row each: (label, distance, index) per query
+    //
+    int nearestBatch(const GalleryScan &gs, const cv::Mat &queries, cv::Mat &results) const
+    {
+        Mat indices, dists;
+        gs.topk(queries, 1, indices, dists);
+        results.create(queries.rows, 3, CV_32F);
+        for (int i=0; i<queries.rows; i++)
+        {
+            int best = indices.at<int>(i);
+            results.at<float>(i,0) = float(best>-1 ? labels.at<int>(best) : -1);
+            results.at<float>(i,1) = dists.at<float>(i);
+            results.at<float>(i,2) = float(best);
+        }
+        return results.rows;
+    }
+
     // TextureFeature::Classifier
     virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
     {
         int best = -1;
         double mind=DBL_MAX;
-        nearest(testFeature, features, best, mind, *this);
+        const GalleryScan *gs = gallery(testFeature);
+        if (gs && testFeature.rows > 1)
+            return nearestBatch(*gs, testFeature, results);
+        if (gs)
+            gs->nearest(testFeature, best, mind);
+        else
+            nearest(testFeature, features, best, mind, *this);
 
         int found = best>-1 ? labels.at<int>(best) : -1;
         results.push_back(float(found));
@@ -69,6 +691,23 @@ struct ClassifierNearest : public TextureFeature::Classifier
         return 3;
     }
 
+    virtual int predictBatch(const cv::Mat &queries, cv::Mat &predicted, cv::Mat &scores) const
+    {
+        const GalleryScan *gs = gallery(queries);
+        if (! gs)
+            return Classifier::predictBatch(queries, predicted, scores);
+
+        Mat indices;
+        gs->topk(queries, 1, indices, scores);
+        predicted.create(queries.rows, 1, CV_32S);
+        for (int i=0; i<queries.rows; i++)
+        {
+            int best = indices.at<int>(i);
+            predicted.at<int>(i) = best>-1 ? labels.at<int>(best) : -1;
+        }
+        return queries.rows;
+    }
+
     virtual int train(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
     {
         features = trainFeatures;
@@ -97,6 +736,21 @@ struct ClassifierNearest : public TextureFeature::Classifier
         fs["features"] >> features;
         return ! features.empty();
     }
+
+    // the gallery gets mapped, not copied
+    virtual bool write(ModelFile &mf) const
+    {
+        mf.put("labels", labels);
+        mf.put("features", features);
+        return true;
+    }
+
+    virtual bool read(const ModelFile &mf)
+    {
+        labels = mf.get("labels");
+        features = mf.get("features");
+        return ! features.empty();
+    }
 };
 
 struct ClassifierNearestFloat : public ClassifierNearest
@@ -109,6 +763,11 @@ struct ClassifierNearestFloat : public ClassifierNearest
         return ClassifierNearest::predict(tofloat(testFeature), results);
     }
 
+    virtual int predictBatch(const cv::Mat &queries, cv::Mat &predicted, cv::Mat &scores) const
+    {
+        return ClassifierNearest::predictBatch(tofloat(queries), predicted, scores);
+    }
+
     virtual int train(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
     {
         return ClassifierNearest::train(tofloat(trainFeatures), trainLabels);
@@ -133,6 +792,16 @@ struct ClassifierHist : public ClassifierNearestFloat
     {
          return compareHist(testFeature, trainFeature, flag);
     }
+
+    virtual int metric() const
+    {
+        switch (flag)
+        {
+            case HISTCMP_HELLINGER:  return GalleryScan::HELLINGER;
+            case HISTCMP_CHISQR_ALT: return GalleryScan::CHISQR_ALT;
+        }
+        return GalleryScan::NONE;
+    }
 };
 
 //struct ClassifierHistWeighted : public ClassifierNearestFloat
@@ -170,374 +839,2700 @@ struct ClassifierCosine : public ClassifierNearest
     {
         return cosdistance(testFeature, trainFeature);
     }
-};
-
-
-static int unique(const Mat &labels, set<int> &classes)
-{
-    for (size_t i=0; i<labels.total(); ++i)
-        classes.insert(labels.at<int>(i));
-    return classes.size();
-}
 
+    virtual int metric() const
+    {
+        return GalleryScan::COSINE;
+    }
+};
 
-// outsourced to svmkernel.cpp
-extern Ptr<ml::SVM::Kernel> customKernel(int id);
 
 //
-// single svm, multi class.
+// packed binary features (LATCH2), hamming distance on 64bit words.
+//   non-binary features fall back to the plain ClassifierNearest path.
 //
-struct ClassifierSVM : public TextureFeature::Classifier
+struct ClassifierHamming : public ClassifierNearest
 {
-    Ptr<ml::SVM> svm;
-    Ptr<ml::SVM::Kernel> krnl;
+    mutable HammingScan ham;
 
-    ClassifierSVM(int ktype=ml::SVM::POLY, double degree = 0.5,double gamma = 0.8,double coef0 = 0,double C = 0.99, double nu = 0.002, double p = 0.5)
+    ClassifierHamming() : ClassifierNearest(NORM_HAMMING) {}
+
+    const HammingScan *packed(const Mat &query) const
     {
-        svm = ml::SVM::create();
-        svm->setType(ml::SVM::NU_SVC);
-        if (ktype<0)
+        if (features.type() != CV_8U || query.type() != CV_8U || features.empty())
+            return 0;
+        AutoLock lock(mtx);
+        if (! ham.matches(features))
+            ham.build(features);
+        return &ham;
+    }
+
+    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    {
+        const HammingScan *hs = packed(testFeature);
+        if (! hs)
+            return ClassifierNearest::predict(testFeature, results);
+
+        Mat indices, dists;
+        hs->nearest(testFeature, indices, dists);
+        results.create(indices.rows, 3, CV_32F);
+        for (int i=0; i<indices.rows; i++)
         {
-            krnl = customKernel(ktype);
-            ktype=-1;
-            svm->setCustomKernel(krnl);
+            int best = indices.at<int>(i);
+            results.at<float>(i,0) = float(best>-1 ? labels.at<int>(best) : -1);
+            results.at<float>(i,1) = dists.at<float>(i);
+            results.at<float>(i,2) = float(best);
+        }
+        // like ClassifierNearest::predict(): 3 values for a single query, else one row per query
+        return testFeature.rows > 1 ? results.rows : int(results.total());
+    }
+
+    virtual int predictBatch(const cv::Mat &queries, cv::Mat &predicted, cv::Mat &scores) const
+    {
+        const HammingScan *hs = packed(queries);
+        if (! hs)
+            return ClassifierNearest::predictBatch(queries, predicted, scores);
+
+        Mat indices;
+        hs->nearest(queries, indices, scores);
+        predicted.create(queries.rows, 1, CV_32S);
+        for (int i=0; i<queries.rows; i++)
+        {
+            int best = indices.at<int>(i);
+            predicted.at<int>(i) = best>-1 ? labels.at<int>(best) : -1;
+        }
+        return queries.rows;
+    }
+};
+
+
+//
+// compressed gallery rows: per row scaled int8, or fp16.
+//   the (float) query gets compared against the codes directly,
+//   so a scan only moves 1/4 (int8) or 1/2 (fp16) of the memory.
+//
+namespace quant
+{
+using ::quant::toHalf;   // half.h
+using ::quant::fromHalf;
+using ::quant::dot;
+
+// sum((q - s*g)^2)
+static float l2_q8(const float *q, const schar *g, float s, int n)
+{
+    int i = 0;
+    float d = 0;
+#ifdef HAVE_SSE
+    __m128 acc = _mm_setzero_ps(), sc = _mm_set1_ps(s);
+    for (; i<=n-4; i+=4)
+    {
+        int w;
+        memcpy(&w, g+i, 4);
+        __m128i x = _mm_cvtsi32_si128(w);
+        x = _mm_unpacklo_epi8(x, x);
+        x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 24);
+        __m128 v = _mm_sub_ps(_mm_loadu_ps(q+i), _mm_mul_ps(sc, _mm_cvtepi32_ps(x)));
+        acc = _mm_add_ps(acc, _mm_mul_ps(v, v));
+    }
+    d = scan::hsum(acc);
+#endif
+    for (; i<n; i++)
+    {
+        float v = q[i] - s * g[i];
+        d += v*v;
+    }
+    return d;
+}
+
+#ifdef HAVE_SSE
+TARGET_AVX2 static float l2_q8_avx2(const float *q, const schar *g, float s, int n)
+{
+    __m256 acc = _mm256_setzero_ps(), sc = _mm256_set1_ps(s);
+    int i = 0;
+    for (; i<=n-8; i+=8)
+    {
+        __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(g+i))));
+        __m256 v = _mm256_sub_ps(_mm256_loadu_ps(q+i), _mm256_mul_ps(sc, x));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(v, v));
+    }
+    float d = scan::hsum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i<n; i++)
+    {
+        float v = q[i] - s * g[i];
+        d += v*v;
+    }
+    return d;
+}
+
+// needs f16c on top of avx2, (callers check haveF16C(), not every avx2 target has it)
+TARGET_AVX2_F16C static float l2_f16_avx2(const float *q, const ushort *g, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i<=n-8; i+=8)
+    {
+        __m256 v = _mm256_sub_ps(_mm256_loadu_ps(q+i), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(g+i))));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(v, v));
+    }
+    float d = scan::hsum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i<n; i++)
+    {
+        float v = q[i] - fromHalf(g[i]);
+        d += v*v;
+    }
+    return d;
+}
+#endif
+
+// sum(q * g), the caller applies the scale
+static float dot_q8(const float *q, const schar *g, int n)
+{
+    int i = 0;
+    float d = 0;
+#ifdef HAVE_SSE
+    __m128 acc = _mm_setzero_ps();
+    for (; i<=n-4; i+=4)
+    {
+        int w;
+        memcpy(&w, g+i, 4);
+        __m128i x = _mm_cvtsi32_si128(w);
+        x = _mm_unpacklo_epi8(x, x);
+        x = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 24);
+        acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(q+i), _mm_cvtepi32_ps(x)));
+    }
+    d = scan::hsum(acc);
+#endif
+    for (; i<n; i++)
+        d += q[i] * g[i];
+    return d;
+}
+
+#ifdef HAVE_SSE
+TARGET_AVX2 static float dot_q8_avx2(const float *q, const schar *g, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i<=n-8; i+=8)
+    {
+        __m256 x = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((const __m128i*)(g+i))));
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(q+i), x));
+    }
+    float d = scan::hsum(_mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1)));
+    for (; i<n; i++)
+        d += q[i] * g[i];
+    return d;
+}
+#endif
+
+static float dot(const float *q, const schar *g, int n)
+{
+#ifdef HAVE_SSE
+    if (haveAVX2())
+        return dot_q8_avx2(q, g, n);
+#endif
+    return dot_q8(q, g, n);
+}
+
+static float l2_f16(const float *q, const ushort *g, int n)
+{
+    float d = 0;
+    for (int i=0; i<n; i++)
+    {
+        float v = q[i] - fromHalf(g[i]);
+        d += v*v;
+    }
+    return d;
+}
+
+#ifdef HAVE_SSE
+TARGET_AVX2_F16C static void fromHalf_avx2(const ushort *h, float *f, int n)
+{
+    int i = 0;
+    for (; i<=n-8; i+=8)
+        _mm256_storeu_ps(f+i, _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(h+i))));
+    for (; i<n; i++)
+        f[i] = fromHalf(h[i]);
+}
+#endif
+
+static void fromHalf(const ushort *h, float *f, int n)
+{
+#ifdef HAVE_SSE
+    if (haveAVX2() && haveF16C())
+        return fromHalf_avx2(h, f, n);
+#endif
+    for (int i=0; i<n; i++)
+        f[i] = fromHalf(h[i]);
+}
+} // namespace quant
+
+
+struct QuantGallery
+{
+    enum Mode { Q8, F16 };
+
+    int mode;
+    Mat codes;              // CV_8S (Q8) or CV_16U (F16)
+    vector<float> scale;    // per row (Q8)
+
+    QuantGallery(int mode=Q8) : mode(mode) {}
+
+    int rows() const { return codes.rows; }
+
+    // append float rows
+    void add(const Mat &features)
+    {
+        Mat f = tofloat(features);
+        Mat c(f.rows, f.cols, mode==Q8 ? CV_8S : CV_16U);
+        for (int r=0; r<f.rows; r++)
+        {
+            const float *p = f.ptr<float>(r);
+            if (mode == Q8)
+            {
+                double mx = norm(f.row(r), NORM_INF);
+                float s = mx > 0 ? float(mx / 127) : 1.0f;
+                schar *q = c.ptr<schar>(r);
+                for (int i=0; i<f.cols; i++)
+                    q[i] = saturate_cast<schar>(p[i] / s);
+                scale.push_back(s);
+            }
+            else
+            {
+                ushort *q = c.ptr<ushort>(r);
+                for (int i=0; i<f.cols; i++)
+                    q[i] = quant::toHalf(p[i]);
+            }
+        }
+        codes.push_back(c);
+    }
+
+    // squared L2 between a float query and row r
+    float distance(const float *q, int r) const
+    {
+        int n = codes.cols;
+        if (mode == Q8)
+        {
+#ifdef HAVE_SSE
+            if (haveAVX2())
+                return quant::l2_q8_avx2(q, codes.ptr<schar>(r), scale[r], n);
+#endif
+            return quant::l2_q8(q, codes.ptr<schar>(r), scale[r], n);
+        }
+#ifdef HAVE_SSE
+        if (haveAVX2() && haveF16C())
+            return quant::l2_f16_avx2(q, codes.ptr<ushort>(r), n);
+#endif
+        return quant::l2_f16(q, codes.ptr<ushort>(r), n);
+    }
+
+    // into a sorted list of k, ties keep the row that came first
+    static void insert(int k, int r, float d, int *idx, float *dist)
+    {
+        if (d >= dist[k-1])
+            return;
+        int j = k-1;
+        for (; j>0 && dist[j-1] > d; j--)
+        {
+            dist[j] = dist[j-1];
+            idx[j] = idx[j-1];
+        }
+        dist[j] = d;
+        idx[j] = r;
+    }
+
+    static void clear(int k, int *idx, float *dist)
+    {
+        for (int j=0; j<k; j++)
+        {
+            idx[j] = -1;
+            dist[j] = FLT_MAX;
+        }
+    }
+
+    // k best rows in [r0,r1)
+    void scanRows(const float *q, int k, int r0, int r1, int *idx, float *dist) const
+    {
+        clear(k, idx, dist);
+        for (int r=r0; r<r1; r++)
+            insert(k, r, distance(q, r), idx, dist);
+    }
+
+    struct ParallelScan : public ParallelLoopBody
+    {
+        const QuantGallery &qg;
+        const float *q;
+        int k, nshards;
+        int *idx;
+        float *dist;
+
+        ParallelScan(const QuantGallery &qg, const float *q, int k, int nshards, int *idx, float *dist)
+            : qg(qg), q(q), k(k), nshards(nshards), idx(idx), dist(dist)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            int N = qg.rows();
+            for (int s=range.start; s<range.end; s++)
+                qg.scanRows(q, k, int(int64(s)*N/nshards), int(int64(s+1)*N/nshards), idx + s*k, dist + s*k);
+        }
+    };
+
+    //
+    // k best rows, sorted by (squared) distance, -1 / FLT_MAX padded.
+    //   large galleries get split into shards, like GalleryScan::nearest().
+    //
+    void topk(const float *q, int k, int *idx, float *dist) const
+    {
+        int nshards = int(std::min<int64>(rows(), int64(rows()) * codes.cols / (1<<16) + 1));
+        nshards = std::max(1, std::min(nshards, getNumThreads() * 4));
+        if (nshards == 1)
+            return scanRows(q, k, 0, rows(), idx, dist);
+
+        AutoBuffer<int> _bi(nshards * k);
+        AutoBuffer<float> _bd(nshards * k);
+        int *bi = _bi;
+        float *bd = _bd;
+        parallel_for_(Range(0, nshards), ParallelScan(*this, q, k, nshards, bi, bd));
+
+        clear(k, idx, dist);
+        for (int s=0; s<nshards*k; s++) // shards are in row order, so ties still go to the first row
+            if (bi[s] >= 0)
+                insert(k, bi[s], bd[s], idx, dist);
+    }
+
+    //
+    // a block of queries runs over a tile of packed rows, while it's in cache
+    //   (like GalleryScan's ParallelTopK, minus the gemm)
+    //
+    struct ParallelTopK : public ParallelLoopBody
+    {
+        enum { QBLOCK=64, TILE_BYTES=1<<18 };
+
+        const QuantGallery &qg;
+        const Mat &Q;
+        Mat &indices, &dists;
+
+        ParallelTopK(const QuantGallery &qg, const Mat &Q, Mat &indices, Mat &dists)
+            : qg(qg), Q(Q), indices(indices), dists(dists)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            int k = indices.cols;
+            int N = qg.rows();
+            int tile = std::max(1, int(TILE_BYTES / (qg.codes.cols * qg.codes.elemSize() + 1)));
+            for (int b=range.start; b<range.end; b++)
+            {
+                int q0 = b*QBLOCK, q1 = std::min(q0 + QBLOCK, Q.rows);
+                for (int g0=0; g0<N; g0+=tile)
+                {
+                    int g1 = std::min(g0 + tile, N);
+                    for (int i=q0; i<q1; i++)
+                    {
+                        const float *q = Q.ptr<float>(i);
+                        int *idx = indices.ptr<int>(i);
+                        float *dist = dists.ptr<float>(i);
+                        for (int r=g0; r<g1; r++)
+                            insert(k, r, qg.distance(q, r), idx, dist);
+                    }
+                }
+            }
+        }
+    };
+
+    // one row of k per query (CV_32F rows)
+    void topk(const Mat &Q, int k, Mat &indices, Mat &dists) const
+    {
+        indices.create(Q.rows, k, CV_32S);
+        indices = Scalar(-1);
+        dists.create(Q.rows, k, CV_32F);
+        dists = Scalar(FLT_MAX);
+        int nblocks = (Q.rows + ParallelTopK::QBLOCK - 1) / ParallelTopK::QBLOCK;
+        parallel_for_(Range(0, nblocks), ParallelTopK(*this, Q, indices, dists));
+    }
+
+    void save(FileStorage &fs) const
+    {
+        fs << "mode" << mode;
+        fs << "codes" << codes;
+        fs << "scale" << scale;
+    }
+
+    void load(const FileStorage &fs)
+    {
+        fs["mode"] >> mode;
+        fs["codes"] >> codes;
+        fs["scale"] >> scale;
+    }
+
+    void write(ModelFile &mf) const
+    {
+        mf.put("mode", mode);
+        mf.put("codes", codes);
+        mf.put("scale", Mat(scale));
+    }
+
+    void read(const ModelFile &mf)
+    {
+        mode = mf.getInt("mode", mode);
+        codes = mf.get("codes");
+        Mat s = mf.get("scale");
+        scale.assign(s.ptr<float>(), s.ptr<float>() + s.total());
+    }
+};
+
+
+//
+// nearest neighbour (L2) on a quantized gallery.
+//   with rerank>0, the float gallery is kept, too, and the rerank best
+//   candidates from the compressed scan get compared exactly.
+//
+struct ClassifierNearestQuant : public ClassifierNearest
+{
+    QuantGallery quant;
+    int rerank;
+
+    ClassifierNearestQuant(int mode=QuantGallery::Q8, int rerank=0)
+        : ClassifierNearest(NORM_L2)
+        , quant(mode)
+        , rerank(rerank)
+    {}
+
+    virtual int metric() const
+    {
+        return GalleryScan::NONE; // predictBatch has its own, on the packed rows
+    }
+
+    int candidates() const
+    {
+        return (rerank > 0 && ! features.empty()) ? rerank : 1;
+    }
+
+    // the best of the k candidates, compared exactly if there are more than one
+    void pick(const Mat &q, int k, const int *idx, const float *dist, int &best, double &mind) const
+    {
+        best = idx[0];
+        mind = best>-1 ? std::sqrt(double(dist[0])) : DBL_MAX;
+        for (int j=0; k>1 && j<k && idx[j]>-1; j++)
+        {
+            double d = norm(q, tofloat(features.row(idx[j])), NORM_L2);
+            if (d < mind || j == 0)
+            {
+                mind = d;
+                best = idx[j];
+            }
+        }
+    }
+
+    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    {
+        Mat q = tofloat(testFeature).reshape(1,1);
+        int k = candidates();
+        AutoBuffer<int> _idx(k);
+        AutoBuffer<float> _dist(k);
+        int *idx = _idx;
+        float *dist = _dist;
+        quant.topk(q.ptr<float>(), k, idx, dist);
+
+        int best;
+        double mind;
+        pick(q, k, idx, dist, best, mind);
+
+        int found = best>-1 ? labels.at<int>(best) : -1;
+        results = (Mat_<float>(1,3) << float(found), float(mind), float(best));
+        return 3;
+    }
+
+    // all queries over the packed gallery, tiled
+    virtual int predictBatch(const cv::Mat &queries, cv::Mat &predicted, cv::Mat &scores) const
+    {
+        Mat Q = tofloat(queries);
+        int k = candidates();
+        Mat indices, dists;
+        quant.topk(Q, k, indices, dists);
+
+        predicted.create(Q.rows, 1, CV_32S);
+        scores.create(Q.rows, 1, CV_32F);
+        for (int i=0; i<Q.rows; i++)
+        {
+            int best;
+            double mind;
+            pick(Q.row(i), k, indices.ptr<int>(i), dists.ptr<float>(i), best, mind);
+            predicted.at<int>(i) = best>-1 ? labels.at<int>(best) : -1;
+            scores.at<float>(i) = float(mind);
+        }
+        return Q.rows;
+    }
+
+    virtual int train(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
+    {
+        quant = QuantGallery(quant.mode);
+        features.release();
+        labels.release();
+        return update(trainFeatures, trainLabels);
+    }
+
+    virtual int update(const cv::Mat &trainFeatures, const cv::Mat &trainLabels)
+    {
+        quant.add(trainFeatures);
+        if (rerank > 0)
+            features.push_back(trainFeatures);
+        labels.push_back(trainLabels);
+        return 1;
+    }
+
+    // Serialize
+    virtual bool save(FileStorage &fs) const
+    {
+        fs << "labels" << labels;
+        fs << "rerank" << rerank;
+        if (rerank > 0)
+            fs << "features" << features;
+        quant.save(fs);
+        return true;
+    }
+
+    virtual bool load(const FileStorage &fs)
+    {
+        fs["labels"] >> labels;
+        fs["rerank"] >> rerank;
+        fs["features"] >> features;
+        quant.load(fs);
+        return quant.rows() > 0;
+    }
+
+    virtual bool write(ModelFile &mf) const
+    {
+        mf.put("labels", labels);
+        mf.put("rerank", rerank);
+        if (rerank > 0)
+            mf.put("features", features);
+        quant.write(mf);
+        return true;
+    }
+
+    virtual bool read(const ModelFile &mf)
+    {
+        labels = mf.get("labels");
+        rerank = mf.getInt("rerank");
+        features = mf.get("features");
+        quant.read(mf);
+        return quant.rows() > 0;
+    }
+};
+
+
+static int unique(const Mat &labels, set<int> &classes)
+{
+    for (size_t i=0; i<labels.total(); ++i)
+        classes.insert(labels.at<int>(i));
+    return classes.size();
+}
+
+
+// outsourced to svmkernel.cpp
+extern Ptr<ml::SVM::Kernel> customKernel(int id);
+extern void customKernelTrain(const Ptr<ml::SVM::Kernel> &k, bool stable);
+extern void customKernelReady(const Ptr<ml::SVM::Kernel> &k, bool raw);
+extern Mat customKernelInput(const Ptr<ml::SVM::Kernel> &k, const Mat &samples);
+
+//
+// single svm, multi class.
+//
+struct ClassifierSVM : public TextureFeature::Classifier
+{
+    Ptr<ml::SVM> svm;
+    Ptr<ml::SVM::Kernel> krnl;
+    Mat supportData, supportLabels; // training rows, that became support vectors (for update())
+
+    // linear kernel only: all one-vs-one decision functions, collapsed
+    Mat weights;        // one row per class pair, (0,1),(0,2)..(1,2)..
+    Mat rho;            // 1 x pairs
+    vector<int> classes;// sorted, like the svm's internal class labels
+
+    // other kernels, after read(): the decision functions as plain mats,
+    //   (the svm itself stays untrained, ml::SVM can only load from FileStorage)
+    Mat svecs;          // support vectors (after customKernelInput())
+    Mat dfAlpha;        // CV_32F, all pairs' alphas, one column
+    Mat dfIndex;        // CV_32S, their support vector rows
+    Mat dfStart;        // CV_32S, 1 x (pairs+1), offsets into dfAlpha / dfIndex
+    Mat kparams;        // CV_64F, kernel type, gamma, degree, coef0
+
+    ClassifierSVM(int ktype=ml::SVM::POLY, double degree = 0.5,double gamma = 0.8,double coef0 = 0,double C = 0.99, double nu = 0.002, double p = 0.5)
+    {
+        svm = ml::SVM::create();
+        svm->setType(ml::SVM::NU_SVC);
+        if (ktype<0)
+        {
+            krnl = customKernel(ktype);
+            ktype=-1;
+            svm->setCustomKernel(krnl);
+        }
+        svm->setKernel(ktype); //SVM::LINEAR;
+        svm->setDegree(degree);
+        svm->setGamma(gamma);
+        svm->setCoef0(coef0);
+        svm->setNu(nu);
+        svm->setP(p);
+        svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
+        svm->setC(C);
+    }
+
+    // the kernel's per sample transform (hellinger sqrt), once per row
+    Mat input(const Mat &samples) const
+    {
+        return krnl.empty() ? samples : customKernelInput(krnl, samples);
+    }
+
+    static size_t hashRow(const uchar *p, size_t n)
+    {
+        size_t h = 2166136261u;
+        for (size_t i=0; i<n; i++)
+            h = (h ^ p[i]) * 16777619u;
+        return h;
+    }
+
+    //
+    // linear kernel: the svm compresses its support vectors into a single vector per
+    //   decision function, so they're found from the compiled model instead:
+    //   rows on, or inside the margin (y*f(x) <= 1, nu-svc scales it there) of any
+    //   of the pairs their class takes part in.
+    //
+    void keepMargin(const Mat &trainData, const Mat &labels)
+    {
+        supportData.release();
+        supportLabels.release();
+        if (weights.empty())
+            return;
+        const float MARGIN = 1.05f; // a few rows more won't hurt
+        int C = int(classes.size());
+        Mat decision;
+        gemm(trainData, weights, 1, noArray(), 0, decision, GEMM_2_T);
+        for (int r=0; r<trainData.rows; r++)
+        {
+            int c = int(std::lower_bound(classes.begin(), classes.end(), labels.at<int>(r)) - classes.begin());
+            const float *d = decision.ptr<float>(r);
+            bool inside = false;
+            for (int i=0, p=0; i<C && !inside; i++)
+            {
+                for (int j=i+1; j<C; j++, p++)
+                {
+                    if (c != i && c != j)
+                        continue;
+                    float y = (c == i) ? 1.0f : -1.0f;
+                    if (y * (d[p] - rho.at<float>(p)) <= MARGIN)
+                    {
+                        inside = true;
+                        break;
+                    }
+                }
+            }
+            if (inside)
+            {
+                supportData.push_back(trainData.row(r));
+                supportLabels.push_back(labels.at<int>(r));
+            }
+        }
+    }
+
+    //
+    // remember the training rows, that ended up as support vectors.
+    //
+    void keepSupport(const Mat &trainData, const Mat &labels)
+    {
+        if (svm->getKernelType() == ml::SVM::LINEAR)
+            return keepMargin(trainData, labels);
+
+        Mat sv = svm->getSupportVectors();
+        Mat in = input(trainData);
+        size_t rowBytes = sv.cols * sv.elemSize();
+        multimap<size_t,int> hashed;
+        for (int i=0; i<sv.rows; i++)
+            hashed.insert(make_pair(hashRow(sv.ptr(i), rowBytes), i));
+
+        supportData.release();
+        supportLabels.release();
+        for (int r=0; r<trainData.rows; r++)
+        {
+            const uchar *p = in.ptr(r);
+            typedef multimap<size_t,int>::iterator It;
+            pair<It,It> range = hashed.equal_range(hashRow(p, rowBytes));
+            for (It it=range.first; it!=range.second; ++it)
+            {
+                if (memcmp(p, sv.ptr(it->second), rowBytes) == 0)
+                {
+                    supportData.push_back(trainData.row(r));
+                    supportLabels.push_back(labels.at<int>(r));
+                    break;
+                }
+            }
+        }
+    }
+
+    //
+    // the linear kernel is just a dot product, so each decision function
+    //   sum(alpha_k * sv_k . x) - rho  becomes  w . x - rho.
+    //   all of them go into one matrix, prediction is a gemm and a vote.
+    //   (labels: the training labels, or the saved class list)
+    //
+    void compile(const Mat &labels)
+    {
+        weights.release();
+        rho.release();
+        classes.clear();
+        svecs.release();
+        if (labels.empty())
+            return;
+
+        set<int> cls;
+        unique(labels, cls);
+        classes.assign(cls.begin(), cls.end());
+        if (svm->getKernelType() != ml::SVM::LINEAR)
+            return;
+        int C = int(classes.size());
+        int P = C * (C-1) / 2;
+        Mat sv = svm->getSupportVectors();
+        if (P < 1 || sv.empty())
+            return;
+
+        weights = Mat::zeros(P, sv.cols, CV_32F);
+        rho.create(1, P, CV_32F);
+        for (int p=0; p<P; p++)
+        {
+            Mat alpha, svidx;
+            rho.at<float>(p) = float(svm->getDecisionFunction(p, alpha, svidx));
+            alpha.convertTo(alpha, CV_32F);
+            Mat w = weights.row(p);
+            for (size_t k=0; k<svidx.total(); k++)
+                scaleAdd(sv.row(svidx.at<int>(int(k))), alpha.at<float>(int(k)), w, w);
+        }
+    }
+
+    // same voting as ml::SVM, ties go to the lower class
+    void vote(const Mat &decision, Mat &predicted) const
+    {
+        int C = int(classes.size());
+        predicted.create(decision.rows, 1, CV_32S);
+        AutoBuffer<int> _votes(C);
+        int *votes = _votes;
+        for (int r=0; r<decision.rows; r++)
+        {
+            const float *d = decision.ptr<float>(r);
+            std::fill(votes, votes+C, 0);
+            for (int i=0, p=0; i<C; i++)
+                for (int j=i+1; j<C; j++, p++)
+                    votes[d[p] - rho.at<float>(p) > 0 ? i : j] ++;
+            int best = 0;
+            for (int i=1; i<C; i++)
+                if (votes[i] > votes[best])
+                    best = i;
+            predicted.at<int>(r) = classes[best];
+        }
+    }
+
+    // one query against all support vectors, like ml::SVM's kernels
+    void kernelRow(const float *q, float *kv) const
+    {
+        if (! krnl.empty())
+        {
+            krnl->calc(svecs.rows, svecs.cols, svecs.ptr<float>(), q, kv);
+            return;
+        }
+        int type = int(kparams.at<double>(0));
+        double gamma = kparams.at<double>(1), degree = kparams.at<double>(2), coef0 = kparams.at<double>(3);
+        for (int k=0; k<svecs.rows; k++)
+        {
+            const float *v = svecs.ptr<float>(k);
+            double d = 0;
+            for (int i=0; i<svecs.cols; i++)
+            {
+                switch(type)
+                {
+                    case ml::SVM::RBF:   { double t = q[i] - v[i]; d += t*t; break; }
+                    case ml::SVM::INTER: d += std::min(q[i], v[i]); break;
+                    case ml::SVM::CHI2:  { double t = q[i] - v[i], u = q[i] + v[i]; if (u != 0) d += t*t/u; break; }
+                    default:             d += q[i] * v[i]; break;
+                }
+            }
+            switch(type)
+            {
+                case ml::SVM::POLY:    d = (cvRound(degree) == degree) ? std::pow(gamma*d + coef0, degree)
+                                                                       : std::pow(std::abs(gamma*d + coef0), degree); break; // like cv::pow
+                case ml::SVM::SIGMOID: d = std::tanh(gamma*d + coef0); break;
+                case ml::SVM::RBF:
+                case ml::SVM::CHI2:    d = std::exp(-gamma*d); break;
+            }
+            kv[k] = float(d);
+        }
+    }
+
+    // sum(alpha_k * K(q, sv_k)) per pair, rho gets subtracted in vote()
+    struct ParallelDecide : public ParallelLoopBody
+    {
+        const ClassifierSVM &c;
+        const Mat &queries;
+        Mat &decision;
+
+        ParallelDecide(const ClassifierSVM &c, const Mat &queries, Mat &decision)
+            : c(c), queries(queries), decision(decision)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            AutoBuffer<float> _kv(c.svecs.rows);
+            float *kv = _kv;
+            const int *start = c.dfStart.ptr<int>();
+            for (int r=range.start; r<range.end; r++)
+            {
+                c.kernelRow(queries.ptr<float>(r), kv);
+                float *d = decision.ptr<float>(r);
+                for (int p=0; p<decision.cols; p++)
+                {
+                    float s = 0;
+                    for (int k=start[p]; k<start[p+1]; k++)
+                        s += c.dfAlpha.at<float>(k) * kv[c.dfIndex.at<int>(k)];
+                    d[p] = s;
+                }
+            }
+        }
+    };
+
+    int fit(const Mat &trainData, const Mat &labels)
+    {
+        svm->clear();
+        if (! krnl.empty())
+        {
+            set<int> cls;
+            customKernelTrain(krnl, unique(labels, cls) == 2);
+        }
+        bool ok = svm->train(input(trainData) , ml::ROW_SAMPLE , Mat(labels));
+        // damn thing fails silently, if nu was not acceptable
+        CV_Assert(ok&&"please check the input params(nu)");
+        if (! krnl.empty())
+            customKernelReady(krnl, false);
+        compile(labels);
+        keepSupport(trainData, labels);
+        return trainData.rows;
+    }
+
+    virtual int train(const Mat &src, const Mat &labels)
+    {
+        Mat trainData = tofloat(src.reshape(1,labels.rows));
+        return fit(trainData, labels);
+    }
+
+    //
+    // warm start: retrain on the previous support vectors, plus the new rows.
+    //  (rows that were not support vectors did not shape the old solution either)
+    //
+    virtual int update(const Mat &src, const Mat &labels)
+    {
+        if (supportData.empty())
+            return train(src, labels);
+
+        Mat trainData = supportData.clone();
+        trainData.push_back(tofloat(src.reshape(1,labels.rows)));
+        Mat trainLabels = supportLabels.clone();
+        trainLabels.push_back(Mat(labels).reshape(1, labels.rows));
+        return fit(trainData, trainLabels);
+    }
+
+    virtual int predict(const Mat &src, Mat &res) const
+    {
+        if (! weights.empty() || ! svecs.empty())
+        {
+            Mat predicted, scores;
+            predictBatch(src.reshape(1,1), predicted, scores);
+            predicted.convertTo(res, CV_32F);
+            return res.rows;
+        }
+        svm->predict(input(tofloat(src)), res);
+        return res.rows;
+    }
+
+    // the whole matrix in one go, no scores
+    virtual int predictBatch(const Mat &queries, Mat &predicted, Mat &scores) const
+    {
+        if (! weights.empty())
+        {
+            Mat decision;
+            gemm(tofloat(queries), weights, 1, noArray(), 0, decision, GEMM_2_T);
+            vote(decision, predicted);
+        }
+        else if (! svecs.empty())
+        {
+            Mat q = input(tofloat(queries)), decision(queries.rows, dfStart.cols - 1, CV_32F);
+            parallel_for_(Range(0, q.rows), ParallelDecide(*this, q, decision));
+            vote(decision, predicted);
+        }
+        else
+        {
+            Mat res;
+            svm->predict(input(tofloat(queries)), res);
+            res.convertTo(predicted, CV_32S);
+        }
+        scores = Mat::zeros(queries.rows, 1, CV_32F);
+        return queries.rows;
+    }
+
+    // Serialize
+    virtual bool save(FileStorage &fs) const
+    {
+        if(!fs.isOpened()) return false;
+        if (! svm->isTrained()) // read() from a ModelFile, only write() can go back there
+            return false;
+        svm->write(fs);
+        fs << "support_data" << supportData;
+        fs << "support_labels" << supportLabels;
+        if (! classes.empty())
+            fs << "svm_classes" << Mat(classes);
+        fs << "svm_input" << 1; // support vectors went through customKernelInput()
+        return true;
+    }
+
+    virtual bool load(const FileStorage &fs)
+    {
+        if(!fs.isOpened()) return false;
+        svm->read(fs.getFirstTopLevelNode());
+        fs["support_data"] >> supportData;
+        fs["support_labels"] >> supportLabels;
+        if (! krnl.empty())
+            customKernelReady(krnl, int(fs["svm_input"]) == 0);
+        Mat cls;
+        fs["svm_classes"] >> cls;
+        compile(cls.empty() ? supportLabels : cls); // older linear models kept all labels
+        return true;
+    }
+
+    //
+    // binary: the compiled weights for the linear kernel, else the support vectors
+    //   and all decision functions as plain mats, no FileStorage text inside.
+    //
+    virtual bool write(ModelFile &mf) const
+    {
+        if (classes.empty())
+            return false;
+        mf.put("support_data", supportData);
+        mf.put("support_labels", supportLabels);
+        mf.put("svm_classes", Mat(classes, true));
+        mf.put("svm_input", 1);
+        if (! weights.empty())
+        {
+            mf.put("svm_weights", weights);
+            mf.put("svm_rho", rho);
+            return true;
+        }
+        if (! svecs.empty()) // read() from a ModelFile, the svm is untrained
+        {
+            mf.put("svm_vectors", svecs);
+            mf.put("svm_alpha", dfAlpha);
+            mf.put("svm_index", dfIndex);
+            mf.put("svm_start", dfStart);
+            mf.put("svm_rho", rho);
+            mf.put("svm_kernel", kparams);
+            return true;
+        }
+        int P = int(classes.size() * (classes.size() - 1) / 2);
+        Mat alpha, index, start(1, P+1, CV_32S), r(1, P, CV_32F);
+        start.at<int>(0) = 0;
+        for (int p=0; p<P; p++)
+        {
+            Mat a, i;
+            r.at<float>(p) = float(svm->getDecisionFunction(p, a, i));
+            a.convertTo(a, CV_32F);
+            alpha.push_back(a.reshape(1, int(a.total())));
+            index.push_back(i.reshape(1, int(i.total())));
+            start.at<int>(p+1) = alpha.rows;
+        }
+        Mat kp = (Mat_<double>(1,4) << svm->getKernelType(), svm->getGamma(), svm->getDegree(), svm->getCoef0());
+        mf.put("svm_vectors", svm->getSupportVectors());
+        mf.put("svm_alpha", alpha);
+        mf.put("svm_index", index);
+        mf.put("svm_start", start);
+        mf.put("svm_rho", r);
+        mf.put("svm_kernel", kp);
+        return true;
+    }
+
+    virtual bool read(const ModelFile &mf)
+    {
+        if (mf.has("storage")) // written before the native layout
+            return Classifier::read(mf);
+        Mat cls = mf.get("svm_classes");
+        if (cls.empty())
+            return false;
+        svm->clear();
+        compile(Mat());
+        classes.assign(cls.ptr<int>(), cls.ptr<int>() + cls.total());
+        supportData = mf.get("support_data");
+        supportLabels = mf.get("support_labels");
+        rho = mf.get("svm_rho");
+        weights = mf.get("svm_weights");
+        if (! krnl.empty())
+            customKernelReady(krnl, mf.getInt("svm_input") == 0);
+        if (! weights.empty())
+            return true;
+        svecs = mf.get("svm_vectors");
+        dfAlpha = mf.get("svm_alpha");
+        dfIndex = mf.get("svm_index");
+        dfStart = mf.get("svm_start");
+        kparams = mf.get("svm_kernel");
+        return ! svecs.empty();
+    }
+};
+
+
+
+//
+// single class(one vs. all), multi svm approach
+//
+//   the per-class svms are independent, so they train in parallel on the same data.
+//   all of them are linear, so afterwards each one gets packed into a weight row,
+//   and prediction scores all classes in a single gemm, and takes the best margin.
+//
+struct ClassifierSvmMulti : public TextureFeature::Classifier
+{
+    vector< Ptr<ml::SVM> > svms;
+    vector<int> classes;
+    Mat weights;  // one row per class, scaled to unit norm, so margins compare
+    Mat bias;     // 1 x classes
+
+    struct ParallelTrain : public ParallelLoopBody
+    {
+        const Mat &trainData, &labels;
+        const vector<int> &classes;
+        vector< Ptr<ml::SVM> > &svms;
+
+        ParallelTrain(const Mat &trainData, const Mat &labels, const vector<int> &classes, vector< Ptr<ml::SVM> > &svms)
+            : trainData(trainData), labels(labels), classes(classes), svms(svms)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int c=range.start; c<range.end; c++)
+            {
+                Ptr<ml::SVM> svm = ml::SVM::create();
+                svm->setType(ml::SVM::NU_SVC);
+                svm->setKernel(ml::SVM::LINEAR);
+                svm->setDegree(0.8);
+                svm->setGamma(1.0);
+                svm->setCoef0(0.0);
+                svm->setNu(0.05);
+                svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
+
+                // you against all others, that's the only difference. (255 -> 1, 0 -> -1)
+                Mat slabels;
+                compare(labels, classes[c], slabels, CMP_EQ);
+                slabels.convertTo(slabels, CV_32S, 2.0/255, -1);
+                bool ok = svm->train(trainData , ml::ROW_SAMPLE , slabels); // same data, different labels.
+                CV_Assert(ok);
+                svms[c] = svm;
+            }
+        }
+    };
+
+    //
+    // w.x - rho, flipped if needed, so positive means 'this class'.
+    //  (which side is which depends on the svm's internal label order,
+    //   so it gets checked against the training data)
+    //
+    void pack(const Mat &trainData, const Mat &labels)
+    {
+        int C = int(svms.size());
+        weights.create(C, trainData.cols, CV_32F);
+        bias.create(1, C, CV_32F);
+        for (int c=0; c<C; c++)
+        {
+            Mat sv = svms[c]->getSupportVectors();
+            Mat alpha, svidx;
+            double r = svms[c]->getDecisionFunction(0, alpha, svidx);
+            alpha.convertTo(alpha, CV_32F);
+            Mat w = weights.row(c);
+            w.setTo(0);
+            for (size_t k=0; k<svidx.total(); k++)
+                scaleAdd(sv.row(svidx.at<int>(int(k))), alpha.at<float>(int(k)), w, w);
+
+            Mat d = trainData * w.t() - r;
+            Mat pos = (labels == classes[c]);
+            double n = norm(w) + 1e-12;
+            if (mean(d, pos)[0] < mean(d, ~pos)[0])
+                n = -n;
+            w *= 1.0 / n;
+            bias.at<float>(c) = float(-r / n);
         }
-        svm->setKernel(ktype); //SVM::LINEAR;
-        svm->setDegree(degree);
-        svm->setGamma(gamma);
-        svm->setCoef0(coef0);
-        svm->setNu(nu);
-        svm->setP(p);
-        svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
-        svm->setC(C);
     }
 
     virtual int train(const Mat &src, const Mat &labels)
     {
-        Mat trainData = tofloat(src.reshape(1,labels.rows));
+        Mat trainData = tofloat(src.reshape(1,labels.rows));
+        Mat lab = Mat(labels).reshape(1, labels.rows);
+
+        set<int> cls;
+        unique(lab, cls);
+        classes.assign(cls.begin(), cls.end());
+
+        svms.assign(classes.size(), Ptr<ml::SVM>());
+        parallel_for_(Range(0, int(classes.size())), ParallelTrain(trainData, lab, classes, svms));
+        pack(trainData, lab);
+        return trainData.rows;
+    }
+
+    virtual int predictBatch(const Mat &queries, Mat &predicted, Mat &scores) const
+    {
+        Mat margins;
+        gemm(tofloat(queries), weights, 1, repeat(bias, queries.rows, 1), 1, margins, GEMM_2_T);
+        predicted.create(queries.rows, 1, CV_32S);
+        scores.create(queries.rows, 1, CV_32F);
+        for (int r=0; r<queries.rows; r++)
+        {
+            Point best;
+            double m;
+            minMaxLoc(margins.row(r), 0, &m, 0, &best);
+            predicted.at<int>(r) = classes[best.x];
+            scores.at<float>(r) = float(m);
+        }
+        return queries.rows;
+    }
+
+    // label, and the (geometric) margin of the best class
+    virtual int predict(const Mat &src, Mat &res) const
+    {
+        Mat predicted, scores;
+        predictBatch(src.reshape(1,1), predicted, scores);
+        res = (Mat_<float>(1,2) << float(predicted.at<int>(0)), scores.at<float>(0));
+        return res.rows;
+    }
+};
+
+struct PPCA
+{
+};
+
+//
+//
+// 'Eigenfaces'
+//
+struct ClassifierPCA : public ClassifierNearestFloat
+{
+    Mat eigenvectors;
+    Mat mean;
+    int num_components;
+    int requested;  // num_components, as passed in (0: all)
+    int count;      // rows seen so far
+    Mat sigma;      // singular values of the centered data (for update())
+
+    ClassifierPCA(int num_components=0)
+        : num_components(num_components)
+        , requested(num_components)
+        , count(0)
+    {}
+
+    inline
+    Mat project(const Mat &src) const
+    {
+        return LDA::subspaceProject(eigenvectors, mean, src);
+    }
+
+    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    {
+        num_components = requested;
+        if((num_components <= 0) || (num_components > trainData.rows))
+            num_components = trainData.rows;
+
+        PCA pca(tofloat(trainData), Mat(), cv::PCA::DATA_AS_ROW, num_components);
+
+        transpose(pca.eigenvectors, eigenvectors);
+        mean = pca.mean.reshape(1,1);
+        labels = trainLabels;
+        features = project(trainData);
+
+        // eigenvalues are from the (1/N scaled) covariance
+        count = trainData.rows;
+        cv::sqrt(pca.eigenvalues * double(count), sigma);
+        return 1;
+    }
+
+    //
+    // incremental pca (Ross, Lim, Lin, Yang: "Incremental Learning for Robust Visual Tracking"):
+    //   the new (centered) rows, plus a mean correction row, get split into their part
+    //   in the current subspace, and an orthonormal residual. a small svd on top of that
+    //   gives the rotated (and maybe grown) basis.
+    //   the gallery gets rotated along in subspace coordinates,
+    //   so the old rows never go back to the full feature size.
+    //
+    virtual int update(const Mat &trainData, const Mat &trainLabels)
+    {
+        if (eigenvectors.empty())
+            return train(trainData, trainLabels);
+        CV_Assert(! sigma.empty() && "no singular values in this model, please retrain");
+
+        Mat B = tofloat(trainData);
+        int m = B.rows, k = eigenvectors.cols;
+        double n = count;
+
+        Mat muB;
+        reduce(B, muB, 0, REDUCE_AVG);
+        Mat Bc = B - repeat(muB, m, 1);
+        Bc.push_back(Mat((muB - mean) * std::sqrt(n*m/(n+m))));
+        Mat newMean = (mean*n + muB*m) / (n+m);
+
+        // part in the current subspace, and an orthonormal basis for the rest
+        Mat P = Bc * eigenvectors;                      // (m+1) x k
+        Mat R = Bc - P * eigenvectors.t();              // (m+1) x D
+        SVD rs(R, SVD::MODIFY_A);
+        double tiny = sigma.at<float>(0) * 1e-6 + FLT_EPSILON;
+        int r = 0;
+        while (r < rs.w.rows && rs.w.at<float>(r) > tiny)
+            r++;
+        Mat Q = rs.vt.rowRange(0, r);                   // r x D
+
+        //  | diag(sigma)  P^T    |
+        //  |     0        Q Bc^T |
+        Mat K = Mat::zeros(k+r, k+m+1, CV_32F);
+        for (int i=0; i<k; i++)
+            K.at<float>(i,i) = sigma.at<float>(i);
+        Mat(P.t()).copyTo(K(Rect(k, 0, m+1, k)));
+        if (r > 0)
+            Mat(Q * Bc.t()).copyTo(K(Rect(k, k, m+1, r)));
+        SVD ks(K);
+
+        int keep = std::min(k + r, int(n) + m);
+        if (requested > 0)
+            keep = std::min(keep, requested);
+        Mat basis;
+        if (r > 0)
+            hconcat(eigenvectors, Mat(Q.t()), basis);
+        else
+            basis = eigenvectors;
+        Mat vecs = basis * ks.u.colRange(0, keep);      // D x keep
+
+        // y' = y * (U^T U') + (mean - mean') * U'
+        Mat rot = eigenvectors.t() * vecs;
+        Mat shift = (mean - newMean) * vecs;
+        Mat gallery = features * rot + repeat(shift, features.rows, 1);
+
+        eigenvectors = vecs;
+        mean = newMean;
+        sigma = ks.w.rowRange(0, keep).clone();
+        count += m;
+        num_components = keep;
+
+        features = gallery;
+        features.push_back(project(B));
+        labels.push_back(Mat(trainLabels).reshape(1, trainLabels.rows));
+        return 1;
+    }
+
+    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    {
+        return ClassifierNearestFloat::predict(project(tofloat(testFeature)), results);
+    }
+
+    // one projection for all queries
+    virtual int predictBatch(const cv::Mat &queries, cv::Mat &predicted, cv::Mat &scores) const
+    {
+        return ClassifierNearestFloat::predictBatch(project(tofloat(queries)), predicted, scores);
+    }
+
+    // Serialize
+    virtual bool save(FileStorage &fs) const
+    {
+        fs << "labels" << labels;
+        fs << "features" << features;
+        fs << "mean" << mean;
+        fs << "eigenvectors" << eigenvectors;
+        fs << "num_components" << num_components;
+        fs << "count" << count;
+        fs << "sigma" << sigma;
+        return true;
+    }
+    virtual bool load(const FileStorage &fs)
+    {
+        fs["labels"] >> labels;
+        fs["features"] >> features;
+        fs["mean"] >> mean;
+        fs["eigenvectors"] >> eigenvectors;
+        fs["num_components"] >>num_components;
+        fs["count"] >> count;
+        fs["sigma"] >> sigma;
+        return ! features.empty();
+    }
+
+    virtual bool write(ModelFile &mf) const
+    {
+        mf.put("labels", labels);
+        mf.put("features", features);
+        mf.put("mean", mean);
+        mf.put("eigenvectors", eigenvectors);
+        mf.put("num_components", num_components);
+        mf.put("count", count);
+        mf.put("sigma", sigma);
+        return true;
+    }
+    virtual bool read(const ModelFile &mf)
+    {
+        labels = mf.get("labels");
+        features = mf.get("features");
+        mean = mf.get("mean");
+        eigenvectors = mf.get("eigenvectors");
+        num_components = mf.getInt("num_components");
+        count = mf.getInt("count");
+        sigma = mf.get("sigma");
+        return ! features.empty();
+    }
+};
+
+
+//
+// lda from accumulated scatter statistics, so new samples can get added later on:
+//   the second moment of all rows, and per class sums and counts.
+//     Sw = sum(x^T x) - sum_c(s_c^T s_c / n_c)
+//     Sb = sum_c(n_c (m_c - m)^T (m_c - m))
+//   solved as a symmetric eigen problem, after whitening Sw.
+//
+struct ScatterLDA
+{
+    Mat xx;                 // sum of x^T x, CV_64F
+    map<int, Mat> sums;     // per class sum of x, CV_64F
+    map<int, int> counts;
+    int total;
+
+    ScatterLDA() : total(0) {}
+
+    int classes() const { return int(sums.size()); }
+
+    void add(const Mat &data, const Mat &labels)
+    {
+        Mat X;
+        data.convertTo(X, CV_64F);
+        if (xx.empty())
+            xx = Mat::zeros(X.cols, X.cols, CV_64F);
+        Mat xtx;
+        mulTransposed(X, xtx, true);
+        xx += xtx;
+        for (int i=0; i<X.rows; i++)
+        {
+            int l = labels.at<int>(i);
+            if (sums.find(l) == sums.end())
+            {
+                sums[l] = Mat::zeros(1, X.cols, CV_64F);
+                counts[l] = 0;
+            }
+            sums[l] += X.row(i);
+            counts[l] ++;
+        }
+        total += X.rows;
+    }
+
+    // k most discriminative directions, as columns (CV_32F)
+    Mat solve(int k) const
+    {
+        int d = xx.rows;
+        Mat mean = Mat::zeros(1, d, CV_64F);
+        for (map<int,Mat>::const_iterator it=sums.begin(); it!=sums.end(); ++it)
+            mean += it->second;
+        mean /= total;
+
+        Mat Sw = xx.clone();
+        Mat Sb = Mat::zeros(d, d, CV_64F);
+        for (map<int,Mat>::const_iterator it=sums.begin(); it!=sums.end(); ++it)
+        {
+            double n = counts.find(it->first)->second;
+            Mat sc = it->second;
+            Sw -= sc.t() * sc / n;
+            Mat dm = sc / n - mean;
+            Sb += dm.t() * dm * n;
+        }
+
+        // whiten Sw, dropping its null space
+        Mat wv, we;
+        eigen(Sw, wv, we);
+        double tiny = std::max(wv.at<double>(0), 0.0) * 1e-9 + DBL_EPSILON;
+        int r = 0;
+        while (r < wv.rows && wv.at<double>(r) > tiny)
+            r++;
+        Mat W = Mat(we.rowRange(0, r).t()).clone();
+        for (int j=0; j<r; j++)
+        {
+            Mat c = W.col(j);
+            c /= std::sqrt(wv.at<double>(j));
+        }
+
+        Mat M = W.t() * Sb * W;
+        Mat mv, me;
+        eigen(M, mv, me);
+        k = std::max(1, std::min(k, r));
+        Mat dirs = W * me.rowRange(0, k).t();
+        dirs.convertTo(dirs, CV_32F);
+        return dirs;
+    }
+
+    // flat form for io: class ids, counts, and the per class sums, stacked
+    void pack(Mat &ids, Mat &cnt, Mat &sum) const
+    {
+        ids.release(); cnt.release(); sum.release();
+        for (map<int,Mat>::const_iterator it=sums.begin(); it!=sums.end(); ++it)
+        {
+            ids.push_back(it->first);
+            cnt.push_back(counts.find(it->first)->second);
+            sum.push_back(it->second);
+        }
+    }
+
+    void unpack(const Mat &ids, const Mat &cnt, const Mat &sum, const Mat &_xx, int _total)
+    {
+        xx = _xx.clone();
+        sums.clear();
+        counts.clear();
+        for (size_t i=0; i<ids.total(); i++)
+        {
+            int l = ids.at<int>(int(i));
+            sums[l] = sum.row(int(i)).clone();
+            counts[l] = cnt.at<int>(int(i));
+        }
+        total = _total;
+    }
+
+    void save(FileStorage &fs) const
+    {
+        Mat ids, cnt, sum;
+        pack(ids, cnt, sum);
+        fs << "lda_xx" << xx;
+        fs << "lda_ids" << ids;
+        fs << "lda_counts" << cnt;
+        fs << "lda_sums" << sum;
+        fs << "lda_total" << total;
+    }
+
+    void load(const FileStorage &fs)
+    {
+        Mat ids, cnt, sum, _xx;
+        int _total = 0;
+        fs["lda_xx"] >> _xx;
+        fs["lda_ids"] >> ids;
+        fs["lda_counts"] >> cnt;
+        fs["lda_sums"] >> sum;
+        fs["lda_total"] >> _total;
+        unpack(ids, cnt, sum, _xx, _total);
+    }
+
+    void write(ModelFile &mf) const
+    {
+        Mat ids, cnt, sum;
+        pack(ids, cnt, sum);
+        mf.put("lda_xx", xx);
+        mf.put("lda_ids", ids);
+        mf.put("lda_counts", cnt);
+        mf.put("lda_sums", sum);
+        mf.put("lda_total", total);
+    }
+
+    void read(const ModelFile &mf)
+    {
+        unpack(mf.get("lda_ids"), mf.get("lda_counts"), mf.get("lda_sums"), mf.get("lda_xx"), mf.getInt("lda_total"));
+    }
+};
+
+
+//
+// 'Fisherfaces'
+//
+struct ClassifierPCA_LDA : public ClassifierPCA
+{
+    Mat icovar;
+    bool useMahalanobis;
+    Mat pcavecs;        // the pca stage, fixed after train()
+    Mat pcaFeatures;    // the gallery in pca space, so the lda stage can get redone
+    ScatterLDA stats;
+
+    ClassifierPCA_LDA(int num_components=0, bool useMahalanobis=true)
+        : ClassifierPCA(num_components)
+        , useMahalanobis(useMahalanobis)
+    {}
+
+    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    {
+        set<int> classes;
+        int C = TextureFeatureImpl::unique(trainLabels,classes);
+        int N = trainData.rows;
+
+        // step one, do pca on the original data:
+        PCA pca(tofloat(trainData), Mat(), cv::PCA::DATA_AS_ROW, (N-C));
+        mean = pca.mean.reshape(1,1);
+        transpose(pca.eigenvectors, pcavecs);
+
+        // step two, collect lda statistics on data projected to pca space:
+        pcaFeatures = LDA::subspaceProject(pcavecs, mean, tofloat(trainData));
+        labels = trainLabels;
+        stats = ScatterLDA();
+        stats.add(pcaFeatures, trainLabels);
+
+        // step three, four: solve, and combine both
+        return combine();
+    }
+
+    //
+    // the pca stage stays, the new rows only add to the lda statistics.
+    //   (so the cost is in the new rows, and the (small) pca space)
+    //
+    virtual int update(const Mat &trainData, const Mat &trainLabels)
+    {
+        if (pcavecs.empty())
+        {
+            CV_Assert(eigenvectors.empty() && "no pca stage in this model, please retrain");
+            return train(trainData, trainLabels);
+        }
+        Mat proj = LDA::subspaceProject(pcavecs, mean, tofloat(trainData));
+        pcaFeatures.push_back(proj);
+        labels.push_back(Mat(trainLabels).reshape(1, trainLabels.rows));
+        stats.add(proj, trainLabels);
+        return combine();
+    }
+
+    int combine()
+    {
+        int C = stats.classes();
+        num_components = requested;
+        if((num_components <= 0) || (num_components > (C-1)))
+            num_components = (C-1);
+
+        Mat ldavecs = stats.solve(num_components);
+        eigenvectors = pcavecs * ldavecs;
+        features = pcaFeatures * ldavecs;
+
+        // while we're at it, precalculate the inverse covariance matrix:
+        if (useMahalanobis)
+        {
+            Mat _covar, _mean;
+            calcCovarMatrix(features, _covar, _mean, CV_COVAR_NORMAL|CV_COVAR_ROWS, CV_32F);
+            _covar /= (features.rows-1);
+            invert(_covar, icovar, DECOMP_SVD);
+        }
+        return 1;
+    }
+
+    virtual double distance(const cv::Mat &testFeature, const cv::Mat &trainFeature) const
+    {
+        return Mahalanobis(testFeature, trainFeature, icovar);
+    }
+
+    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    {
+        Mat q = project(tofloat(testFeature));
+
+        if (! useMahalanobis) // fall back to plain L2 norm
+            return ClassifierNearestFloat::predict(q, results);
+
+        int minId = -1;
+        double minDist = 999999999;
+        nearest(q, features, minId, minDist, *this);
+        results = (Mat_<float>(1,3) << float(labels.at<int>(minId)), float(minDist), float(minId));
+        return 1;
+    }
+
+    virtual int predictBatch(const cv::Mat &queries, cv::Mat &predicted, cv::Mat &scores) const
+    {
+        if (useMahalanobis) // no gemm for this
+            return Classifier::predictBatch(queries, predicted, scores);
+        return ClassifierPCA::predictBatch(queries, predicted, scores);
+    }
 
-        svm->clear();
-        bool ok = svm->train(trainData , ml::ROW_SAMPLE , Mat(labels));
-        // damn thing fails silently, if nu was not acceptable
-        CV_Assert(ok&&"please check the input params(nu)");
-        return trainData.rows;
+    // Serialize, the pca stage and the lda statistics too, so update() works after load()
+    virtual bool save(FileStorage &fs) const
+    {
+        ClassifierPCA::save(fs);
+        fs << "icovar" << icovar;
+        fs << "pcavecs" << pcavecs;
+        fs << "pca_features" << pcaFeatures;
+        stats.save(fs);
+        return true;
+    }
+    virtual bool load(const FileStorage &fs)
+    {
+        fs["icovar"] >> icovar;
+        fs["pcavecs"] >> pcavecs;
+        fs["pca_features"] >> pcaFeatures;
+        stats.load(fs);
+        return ClassifierPCA::load(fs);
     }
 
-    virtual int predict(const Mat &src, Mat &res) const
+    virtual bool write(ModelFile &mf) const
     {
-        svm->predict(tofloat(src), res);
-        return res.rows;
+        ClassifierPCA::write(mf);
+        mf.put("icovar", icovar);
+        mf.put("pcavecs", pcavecs);
+        mf.put("pca_features", pcaFeatures);
+        stats.write(mf);
+        return true;
+    }
+    virtual bool read(const ModelFile &mf)
+    {
+        icovar = mf.get("icovar");
+        pcavecs = mf.get("pcavecs");
+        pcaFeatures = mf.get("pca_features");
+        stats.read(mf);
+        return ClassifierPCA::read(mf);
+    }
+};
+
+//
+// the gallery gets scanned in lda space, but the rows are kept in feature space, too:
+//   an update changes the projection, and the old lda coordinates can't be mapped
+//   along (the new directions reach outside the span of the old ones, a least squares
+//   fit from old to new lost 60-80% of each old row's norm on 10+5+5+5 classes, d=256).
+//   the row space of the gallery is the smallest space that re-projects exactly,
+//   and an orthonormal basis of it plus coefficients is never smaller than the rows.
+//   so an update costs the new rows, one solve in feature space, and one
+//   (rows x dims x classes) projection.
+//
+struct ClassifierLDA : public ClassifierNearestFloat
+{
+    Mat eigenvectors;
+    ScatterLDA stats;
+    Mat rows; // the gallery in feature space, CV_32F
+
+    Mat project(const Mat &src) const
+    {
+        return tofloat(src) * eigenvectors;
+    }
+
+    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    {
+        stats = ScatterLDA();
+        eigenvectors.release();
+        rows.release();
+        features.release();
+        labels.release();
+        return update(trainData, trainLabels);
+    }
+
+    // scatter matrices just accumulate, the new rows are all that's needed
+    virtual int update(const Mat &trainData, const Mat &trainLabels)
+    {
+        CV_Assert(rows.rows == features.rows && "models saved without their rows can't be updated");
+        Mat data = tofloat(trainData);
+        stats.add(data, trainLabels);
+        rows.push_back(data);
+
+        eigenvectors = stats.solve(stats.classes() - 1);
+        labels.push_back(Mat(trainLabels).reshape(1, trainLabels.rows));
+        features = project(rows);
+        return 1;
     }
 
     // Serialize
     virtual bool save(FileStorage &fs) const
     {
-        if(!fs.isOpened()) return false;
-        svm->write(fs);
+        ClassifierNearestFloat::save(fs);
+        fs << "eigenvectors" << eigenvectors;
+        fs << "lda_rows" << rows;
+        stats.save(fs);
         return true;
     }
-
     virtual bool load(const FileStorage &fs)
     {
-        if(!fs.isOpened()) return false;
-        svm->read(fs.getFirstTopLevelNode());
+        fs["eigenvectors"] >> eigenvectors;
+        fs["lda_rows"] >> rows; // older files have none, and can't be updated
+        stats.load(fs);
+        return ClassifierNearestFloat::load(fs);
+    }
+
+    virtual bool write(ModelFile &mf) const
+    {
+        ClassifierNearestFloat::write(mf);
+        mf.put("eigenvectors", eigenvectors);
+        mf.put("lda_rows", rows);
+        stats.write(mf);
         return true;
     }
-};
+    virtual bool read(const ModelFile &mf)
+    {
+        eigenvectors = mf.get("eigenvectors");
+        rows = mf.get("lda_rows");
+        stats.read(mf);
+        return ClassifierNearestFloat::read(mf);
+    }
 
+    virtual int predict(const Mat &a, Mat &res) const
+    {
+        Mat pa = project(a);
+        return ClassifierNearestFloat::predict(pa, res);
+    }
 
+    virtual int predictBatch(const Mat &queries, Mat &predicted, Mat &scores) const
+    {
+        Mat pa = project(queries);
+        return ClassifierNearestFloat::predictBatch(pa, predicted, scores);
+    }
+};
 
 //
-// single class(one vs. all), multi svm approach
+// in-tree mlp, same topology, activation and scaling as ml::ANN_MLP,
+//   so models convert both ways (fromAnn() / toAnn()).
 //
-struct ClassifierSvmMulti : public TextureFeature::Classifier
+//   training: minibatch adam on the (scaled) targets, the gemms of each batch
+//   run in parallel. a fixed number of epochs by default, (optionally a held out
+//   part of a large training set decides when to stop).
+//   inference: float weights, or fp16 / int8 (per output unit scaled) ones.
+//   the packed ones replace the float weights after training, (each output unit
+//   is a dot product against a packed row, see ParallelPacked), and get expanded
+//   again only for saving or fine tuning.
+//
+//   weights: (n_in+1) x n_out per layer, the last row is the bias (like ANN_MLP).
+//   scales: 1 x 2n, (scale,shift) pairs, input: x*s+b, output: y*s+b, inv: t*s+b (targets)
+//
+struct MlpNet
 {
-    vector< Ptr<ml::SVM> > svms;
+    enum Precision { F32, F16, Q8 };
 
-    virtual int train(const Mat &src, const Mat &labels)
+    vector<int> sizes;
+    vector<Mat> W;                    // CV_32F
+    Mat inScale, outScale, invScale;  // CV_32F
+
+    int precision;
+    vector<Mat> Wq;                   // F16 / Q8: n_out x n_in, CV_16U or CV_8S
+    vector<Mat> Ws;                   // Q8: 1 x n_out scale
+    vector<Mat> Wb;                   // F16 / Q8: 1 x n_out bias, CV_32F
+
+    int batch, maxEpochs, patience;
+    float lr, holdout;
+
+    // SIGMOID_SYM, with ANN_MLP's default params: B * tanh(A/2 * x)
+    static float A() { return 2.0f/3; }
+    static float B() { return 1.7159f; }
+
+    enum { HOLDOUT_ROWS=500 }; // less than that, and early stopping is off
+
+    MlpNet(int precision=F32, float holdout=0)
+        : precision(precision)
+        , batch(64), maxEpochs(100), patience(8)
+        , lr(0.001f), holdout(holdout)
+    {}
+
+    int layers() const { return int(sizes.size()); }
+    bool empty() const { return W.empty() && Wq.empty(); }
+
+    void create(const vector<int> &layerSizes)
     {
-        svms.clear();
+        sizes = layerSizes;
+        int L = layers();
+        W.resize(L-1);
+        RNG rng(0x1234);
+        for (int l=1; l<L; l++)
+        {
+            float r = std::sqrt(6.0f / (sizes[l-1] + sizes[l]));
+            W[l-1].create(sizes[l-1]+1, sizes[l], CV_32F);
+            rng.fill(W[l-1], RNG::UNIFORM, -r, r);
+            W[l-1].row(sizes[l-1]).setTo(0);
+        }
+        inScale.create(1, 2*sizes[0], CV_32F);
+        outScale.create(1, 2*sizes[L-1], CV_32F);
+        invScale.create(1, 2*sizes[L-1], CV_32F);
+        for (int j=0; j<sizes[0]; j++)
+            { inScale.at<float>(2*j) = 1; inScale.at<float>(2*j+1) = 0; }
+        for (int j=0; j<sizes[L-1]; j++)
+        {
+            outScale.at<float>(2*j) = invScale.at<float>(2*j) = 1;
+            outScale.at<float>(2*j+1) = invScale.at<float>(2*j+1) = 0;
+        }
+        Wq.clear();
+    }
 
-        Mat trainData = tofloat(src.reshape(1,labels.rows));
-        //
-        // train one svm per class:
-        //
-        set<int> classes;
-        unique(labels,classes);
-
-        for (set<int>::iterator it=classes.begin(); it != classes.end(); ++it)
-        {
-            Ptr<ml::SVM> svm = ml::SVM::create();
-            svm->setType(ml::SVM::NU_SVC);
-            svm->setKernel(ml::SVM::LINEAR);
-            svm->setDegree(0.8);
-            svm->setGamma(1.0);
-            svm->setCoef0(0.0);
-            svm->setNu(0.05);
-            svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
-
-            Mat slabels; // you against all others, that's the only difference.
-            for ( size_t j=0; j<labels.total(); ++j)
-                slabels.push_back( (*it == labels.at<int>(j)) ? 1 : -1 );
-            bool ok = svm->train(trainData , ml::ROW_SAMPLE , slabels); // same data, different labels.
-            CV_Assert(ok);
-            svms.push_back(svm);
+    // ANN_MLP's calc_input_scale / calc_output_scale, (targets go into [-0.95,0.95])
+    void fitScale(const Mat &X, const Mat &T)
+    {
+        for (int j=0; j<X.cols; j++)
+        {
+            Scalar m, sd;
+            meanStdDev(X.col(j), m, sd);
+            float s = sd[0] > FLT_EPSILON ? float(1.0 / sd[0]) : 1.0f;
+            inScale.at<float>(2*j) = s;
+            inScale.at<float>(2*j+1) = float(-m[0] * s);
+        }
+        const double lo = -0.95, hi = 0.95;
+        for (int j=0; j<T.cols; j++)
+        {
+            double mj, Mj;
+            minMaxLoc(T.col(j), &mj, &Mj);
+            double a = (Mj - mj) > DBL_EPSILON ? (hi - lo) / (Mj - mj) : 1.0;
+            double b = (Mj - mj) > DBL_EPSILON ? lo - mj * a : -mj;
+            invScale.at<float>(2*j) = float(a);
+            invScale.at<float>(2*j+1) = float(b);
+            outScale.at<float>(2*j) = float(1.0 / a);
+            outScale.at<float>(2*j+1) = float(-b / a);
         }
-        return trainData.rows;
     }
 
+    static void applyScale(const Mat &src, const Mat &scale, Mat &dst)
+    {
+        dst.create(src.rows, src.cols, CV_32F);
+        const float *s = scale.ptr<float>();
+        for (int r=0; r<src.rows; r++)
+        {
+            const float *p = src.ptr<float>(r);
+            float *q = dst.ptr<float>(r);
+            for (int j=0; j<src.cols; j++)
+                q[j] = p[j] * s[2*j] + s[2*j+1];
+        }
+    }
 
-    virtual int predict(const Mat &src, Mat &res) const
+    // z += bias, then the activation, in place
+    static void activate(float *z, const float *bias, int n)
+    {
+        for (int j=0; j<n; j++)
+            z[j] = std::min(std::max(-A() * (z[j] + bias[j]), -60.0f), 60.0f);
+        hal::exp(z, z, n);
+        for (int j=0; j<n; j++)
+            z[j] = B() * (1 - z[j]) / (1 + z[j]);
+    }
+
+    // derivative, from the activation's output
+    static float slope(float y)
+    {
+        return (A() / (2 * B())) * (B()*B() - y*y);
+    }
+
+    //
+    // C = op(A) * op(B), split into row blocks of C
+    //
+    struct ParallelGemm : public ParallelLoopBody
+    {
+        const Mat &a, &b;
+        Mat &c;
+        int flags;
+
+        ParallelGemm(const Mat &a, const Mat &b, Mat &c, int flags)
+            : a(a), b(b), c(c), flags(flags)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            Mat ra = (flags & GEMM_1_T) ? a.colRange(range.start, range.end) : a.rowRange(range.start, range.end);
+            Mat rc = c.rowRange(range.start, range.end);
+            gemm(ra, b, 1, noArray(), 0, rc, flags);
+        }
+    };
+
+    static void pgemm(const Mat &a, const Mat &b, Mat &c, int flags=0)
+    {
+        int rows = (flags & GEMM_1_T) ? a.cols : a.rows;
+        int cols = (flags & GEMM_2_T) ? b.rows : b.cols;
+        c.create(rows, cols, CV_32F);
+        int stripes = std::max(1, std::min(rows / 8, getNumThreads() * 2));
+        parallel_for_(Range(0, rows), ParallelGemm(a, b, c, flags), stripes);
+    }
+
+    // H[0] is the (scaled) input, H[l] the activations of layer l
+    void forward(vector<Mat> &H) const
+    {
+        int L = layers();
+        H.resize(L);
+        for (int l=1; l<L; l++)
+        {
+            const Mat &w = W[l-1];
+            int nin = w.rows - 1;
+            pgemm(H[l-1], w.rowRange(0, nin), H[l]);
+            for (int r=0; r<H[l].rows; r++)
+                activate(H[l].ptr<float>(r), w.ptr<float>(nin), w.cols);
+        }
+    }
+
+    struct Adam
+    {
+        vector<Mat> m, v;
+        int t;
+
+        void init(const vector<Mat> &W)
+        {
+            m.resize(W.size());
+            v.resize(W.size());
+            for (size_t l=0; l<W.size(); l++)
+            {
+                m[l] = Mat::zeros(W[l].size(), CV_32F);
+                v[l] = Mat::zeros(W[l].size(), CV_32F);
+            }
+            t = 0;
+        }
+    };
+
+    struct ParallelAdam : public ParallelLoopBody
+    {
+        float *w, *m, *v;
+        const float *g;
+        float lr, c1, c2;
+
+        ParallelAdam(Mat &W, Mat &M, Mat &V, const Mat &G, float lr, float c1, float c2)
+            : w(W.ptr<float>()), m(M.ptr<float>()), v(V.ptr<float>()), g(G.ptr<float>())
+            , lr(lr), c1(c1), c2(c2)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            const float b1 = 0.9f, b2 = 0.999f, eps = 1e-8f;
+            for (int i=range.start; i<range.end; i++)
+            {
+                m[i] = b1 * m[i] + (1 - b1) * g[i];
+                v[i] = b2 * v[i] + (1 - b2) * g[i] * g[i];
+                w[i] -= lr * (m[i] * c1) / (std::sqrt(v[i] * c2) + eps);
+            }
+        }
+    };
+
+    // one minibatch: forward, backprop the squared error, adam step
+    void step(const Mat &X, const Mat &T, Adam &adam)
+    {
+        int L = layers();
+        vector<Mat> H(L);
+        H[0] = X;
+        forward(H);
+
+        Mat delta = H[L-1] - T;
+        for (int r=0; r<delta.rows; r++)
+        {
+            float *d = delta.ptr<float>(r);
+            const float *y = H[L-1].ptr<float>(r);
+            for (int j=0; j<delta.cols; j++)
+                d[j] *= slope(y[j]);
+        }
+
+        adam.t ++;
+        float c1 = float(1.0 / (1 - std::pow(0.9, adam.t)));
+        float c2 = float(1.0 / (1 - std::pow(0.999, adam.t)));
+        for (int l=L-1; l>0; l--)
+        {
+            Mat &w = W[l-1];
+            int nin = w.rows - 1;
+            Mat grad(w.size(), CV_32F);
+            Mat gw = grad.rowRange(0, nin), gb = grad.row(nin);
+            pgemm(H[l-1], delta, gw, GEMM_1_T);
+            reduce(delta, gb, 0, REDUCE_SUM);
+            grad *= 1.0 / X.rows;
+
+            if (l > 1)
+            {
+                Mat prev;
+                pgemm(delta, w.rowRange(0, nin), prev, GEMM_2_T);
+                for (int r=0; r<prev.rows; r++)
+                {
+                    float *d = prev.ptr<float>(r);
+                    const float *y = H[l-1].ptr<float>(r);
+                    for (int j=0; j<prev.cols; j++)
+                        d[j] *= slope(y[j]);
+                }
+                delta = prev;
+            }
+            parallel_for_(Range(0, int(w.total())), ParallelAdam(w, adam.m[l-1], adam.v[l-1], grad, lr, c1, c2));
+        }
+    }
+
+    float loss(const Mat &X, const Mat &T) const
     {
-        Mat query = tofloat(src);
-        //
-        // predict per-class, return first positive result
-        // hrmm, this assumes, the labels are ordered [0..N]
-        //
-        float m = 100.0f;
-        float mi = 0.0f;
-        for (size_t j=0; j<svms.size(); ++j)
-        {
-            Mat r;
-            svms[j]->predict(query, r);
-            float p = r.at<float>(0);
-            if (p > 0)
-            {
-                m = p;
-                mi = float(j);
+        vector<Mat> H(layers());
+        H[0] = X;
+        forward(H);
+        return float(norm(H.back(), T, NORM_L2SQR) / std::max(1, X.rows));
+    }
+
+    static void gather(const Mat &src, const vector<int> &idx, int from, int to, Mat &dst)
+    {
+        dst.create(to - from, src.cols, src.type());
+        for (int i=from; i<to; i++)
+            src.row(idx[i]).copyTo(dst.row(i - from));
+    }
+
+    //
+    // keepScale: continue with the current input/output scaling (fine tuning)
+    // epochs: a fixed schedule, never holds out rows (fine tuning must see all new classes).
+    //   otherwise maxEpochs, with early stopping only if holdout is set (CL_MLP_ES) and
+    //   there are at least HOLDOUT_ROWS rows (on a few images per person, the held out
+    //   loss bottoms out long before the accuracy does).
+    //
+    int train(const Mat &data, const Mat &targets, bool keepScale=false, int epochs=0)
+    {
+        unpack();
+        Mat X = tofloat(data), T = tofloat(targets);
+        if (! keepScale)
+            fitScale(X, T);
+        Mat Xs, Ts;
+        applyScale(X, inScale, Xs);
+        applyScale(T, invScale, Ts);
+
+        RNG rng(0x4321);
+        vector<int> idx(X.rows);
+        for (int i=0; i<X.rows; i++)
+            idx[i] = i;
+        for (int i=X.rows-1; i>0; i--)
+            std::swap(idx[i], idx[rng.uniform(0, i+1)]);
+
+        int nval = (epochs <= 0 && X.rows >= HOLDOUT_ROWS) ? int(X.rows * holdout) : 0;
+        int ntrain = X.rows - nval;
+        Mat Xv, Tv;
+        if (nval > 0)
+        {
+            gather(Xs, idx, ntrain, X.rows, Xv);
+            gather(Ts, idx, ntrain, X.rows, Tv);
+        }
+        idx.resize(ntrain);
+
+        Adam adam;
+        adam.init(W);
+        vector<Mat> best;
+        float bestLoss = FLT_MAX;
+        int since = 0, e = 0;
+        for (int E = epochs>0 ? epochs : maxEpochs; e<E; e++)
+        {
+            for (int i=ntrain-1; i>0; i--)
+                std::swap(idx[i], idx[rng.uniform(0, i+1)]);
+            for (int b=0; b<ntrain; b+=batch)
+            {
+                Mat Xb, Tb;
+                int end = std::min(ntrain, b + batch);
+                gather(Xs, idx, b, end, Xb);
+                gather(Ts, idx, b, end, Tb);
+                step(Xb, Tb, adam);
+            }
+            if (nval == 0)
+                continue;
+
+            float l = loss(Xv, Tv);
+            if (l < bestLoss)
+            {
+                bestLoss = l;
+                since = 0;
+                best.resize(W.size());
+                for (size_t k=0; k<W.size(); k++)
+                    W[k].copyTo(best[k]);
+            }
+            else if (++since >= patience)
+            {
                 break;
             }
         }
-        res = (Mat_<float>(1,2) << mi, m);
-        return res.rows;
+        if (! best.empty())
+            W = best;
+        quantize();
+        return e;
     }
-};
 
-struct PPCA
-{
+    // F16 / Q8: pack the float weights (transposed, one row per output unit), and drop them
+    void quantize()
+    {
+        Wq.clear();
+        Ws.clear();
+        Wb.clear();
+        if (precision == F32)
+            return;
+        for (size_t l=0; l<W.size(); l++)
+        {
+            int nin = W[l].rows - 1;
+            Mat w = W[l].rowRange(0, nin).t();
+            Mat q(w.size(), precision == F16 ? CV_16U : CV_8S), sc(1, w.rows, CV_32F);
+            for (int j=0; j<w.rows; j++)
+            {
+                const float *p = w.ptr<float>(j);
+                if (precision == F16)
+                {
+                    ushort *h = q.ptr<ushort>(j);
+                    for (int i=0; i<w.cols; i++)
+                        h[i] = quant::toHalf(p[i]);
+                    continue;
+                }
+                double mx = norm(w.row(j), NORM_INF);
+                float s = mx > 0 ? float(mx / 127) : 1.0f;
+                schar *c = q.ptr<schar>(j);
+                for (int i=0; i<w.cols; i++)
+                    c[i] = saturate_cast<schar>(p[i] / s);
+                sc.at<float>(j) = s;
+            }
+            Wq.push_back(q);
+            Ws.push_back(sc);
+            Wb.push_back(W[l].row(nin).clone());
+        }
+        W.clear();
+    }
+
+    // the float weights, from the packed ones
+    void dequantize(vector<Mat> &w) const
+    {
+        w.resize(Wq.size());
+        for (size_t l=0; l<Wq.size(); l++)
+        {
+            const Mat &q = Wq[l];
+            Mat t(q.size(), CV_32F);
+            for (int j=0; j<q.rows; j++)
+            {
+                float *p = t.ptr<float>(j);
+                if (precision == F16)
+                {
+                    quant::fromHalf(q.ptr<ushort>(j), p, q.cols);
+                    continue;
+                }
+                const schar *c = q.ptr<schar>(j);
+                float s = Ws[l].at<float>(j);
+                for (int i=0; i<q.cols; i++)
+                    p[i] = c[i] * s;
+            }
+            w[l].create(q.cols + 1, q.rows, CV_32F);
+            Mat wt = w[l].rowRange(0, q.cols);
+            transpose(t, wt);
+            Wb[l].copyTo(w[l].row(q.cols));
+        }
+    }
+
+    // float weights again, for training (fine tuning starts from the rounded ones)
+    void unpack()
+    {
+        if (! W.empty() || Wq.empty())
+            return;
+        dequantize(W);
+        Wq.clear();
+        Ws.clear();
+        Wb.clear();
+    }
+
+    //
+    // forward pass on the packed weights, a stripe of rows at a time:
+    //   each packed row (output unit) stays in L1, while all rows of the stripe go by.
+    //
+    struct ParallelPacked : public ParallelLoopBody
+    {
+        const MlpNet &net;
+        const Mat &X;
+        Mat &Y;
+        enum { STRIPE=16 };
+
+        ParallelPacked(const MlpNet &net, const Mat &X, Mat &Y)
+            : net(net), X(X), Y(Y)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int s=range.start; s<range.end; s++)
+            {
+                int r0 = s * STRIPE, r1 = std::min(X.rows, r0 + STRIPE);
+                Mat h = X.rowRange(r0, r1);
+                for (size_t l=0; l<net.Wq.size(); l++)
+                {
+                    const Mat &q = net.Wq[l];
+                    Mat z(h.rows, q.rows, CV_32F);
+                    for (int j=0; j<q.rows; j++)
+                    {
+                        if (net.precision == F16)
+                        {
+                            for (int r=0; r<h.rows; r++)
+                                z.at<float>(r,j) = quant::dot(h.ptr<float>(r), q.ptr<ushort>(j), q.cols);
+                            continue;
+                        }
+                        float sc = net.Ws[l].at<float>(j);
+                        for (int r=0; r<h.rows; r++)
+                            z.at<float>(r,j) = sc * quant::dot(h.ptr<float>(r), q.ptr<schar>(j), q.cols);
+                    }
+                    for (int r=0; r<z.rows; r++)
+                        activate(z.ptr<float>(r), net.Wb[l].ptr<float>(), z.cols);
+                    h = z;
+                }
+                applyScale(h, net.outScale, h);
+                h.copyTo(Y.rowRange(r0, r1));
+            }
+        }
+    };
+
+    // unscaled outputs, one row per query
+    void predict(const Mat &queries, Mat &outputs) const
+    {
+        Mat X;
+        applyScale(tofloat(queries), inScale, X);
+        if (Wq.empty())
+        {
+            vector<Mat> H(layers());
+            H[0] = X;
+            forward(H);
+            applyScale(H.back(), outScale, outputs);
+            return;
+        }
+        outputs.create(X.rows, sizes.back(), CV_32F);
+        int stripes = (X.rows + ParallelPacked::STRIPE - 1) / ParallelPacked::STRIPE;
+        parallel_for_(Range(0, stripes), ParallelPacked(*this, X, outputs));
+    }
+
+    //
+    // ANN_MLP interop, (doubles there, floats here)
+    //
+    static Ptr<ml::ANN_MLP> annSetup(const Mat &layers)
+    {
+        Ptr<ml::ANN_MLP> ann = ml::ANN_MLP::create();
+        ann->setLayerSizes(layers);
+        ann->setActivationFunction(ml::ANN_MLP::SIGMOID_SYM,0,0);
+        ann->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 300, 0.0001));
+        ann->setTrainMethod(ml::ANN_MLP::BACKPROP, 0.0001);
+        return ann;
+    }
+
+    Ptr<ml::ANN_MLP> toAnn() const
+    {
+        int L = layers();
+        vector<Mat> w = W;
+        if (w.empty())
+            dequantize(w);
+        Ptr<ml::ANN_MLP> ann = annSetup(Mat(sizes, true));
+        for (int i=0; i<L+2; i++)
+        {
+            const Mat &src = (i == 0) ? inScale : (i < L) ? w[i-1] : (i == L) ? outScale : invScale;
+            Mat dst = ann->getWeights(i);
+            src.reshape(1, dst.rows).convertTo(dst, CV_64F);
+        }
+        return ann;
+    }
+
+    void fromAnn(const Ptr<ml::ANN_MLP> &ann)
+    {
+        Mat ls = ann->getLayerSizes();
+        sizes.assign((const int*)ls.data, (const int*)ls.data + ls.total());
+        int L = layers();
+        W.resize(L-1);
+        ann->getWeights(0).reshape(1,1).convertTo(inScale, CV_32F);
+        for (int l=1; l<L; l++)
+            ann->getWeights(l).convertTo(W[l-1], CV_32F);
+        ann->getWeights(L).reshape(1,1).convertTo(outScale, CV_32F);
+        ann->getWeights(L+1).reshape(1,1).convertTo(invScale, CV_32F);
+        quantize();
+    }
+
+    // ANN_MLP::save()'s layout, so either one reads the other's files
+    bool save(FileStorage &fs) const
+    {
+        if (empty()) return false;
+        fs << "opencv_ml_ann_mlp" << "{";
+        toAnn()->write(fs);
+        fs << "}";
+        return true;
+    }
+
+    bool load(const FileStorage &fs)
+    {
+        FileNode n = fs["opencv_ml_ann_mlp"];
+        if (n.empty()) return false;
+        Ptr<ml::ANN_MLP> ann = ml::ANN_MLP::create();
+        ann->read(n);
+        fromAnn(ann);
+        return ! empty();
+    }
+
+    // binary: the weights as they are used, packed ones stay packed
+    bool write(ModelFile &mf) const
+    {
+        if (empty()) return false;
+        mf.put("mlp_sizes", Mat(sizes, true));
+        mf.put("mlp_precision", Wq.empty() ? int(F32) : precision);
+        mf.put("mlp_scale_in", inScale);
+        mf.put("mlp_scale_out", outScale);
+        mf.put("mlp_scale_inv", invScale);
+        for (size_t l=0; l<W.size(); l++)
+            mf.put(format("mlp_w%d", int(l)), W[l]);
+        for (size_t l=0; l<Wq.size(); l++)
+        {
+            mf.put(format("mlp_q%d", int(l)), Wq[l]);
+            mf.put(format("mlp_s%d", int(l)), Ws[l]);
+            mf.put(format("mlp_b%d", int(l)), Wb[l]);
+        }
+        return true;
+    }
+
+    bool read(const ModelFile &mf)
+    {
+        Mat ls = mf.get("mlp_sizes");
+        if (ls.empty()) return false;
+        sizes.assign(ls.ptr<int>(), ls.ptr<int>() + ls.total());
+        inScale = mf.get("mlp_scale_in");
+        outScale = mf.get("mlp_scale_out");
+        invScale = mf.get("mlp_scale_inv");
+        W.clear();
+        Wq.clear();
+        Ws.clear();
+        Wb.clear();
+        bool packed = mf.getInt("mlp_precision", F32) != F32;
+        for (int l=0; l<layers()-1; l++)
+        {
+            if (! packed)
+            {
+                W.push_back(mf.get(format("mlp_w%d", l)));
+                continue;
+            }
+            Wq.push_back(mf.get(format("mlp_q%d", l)));
+            Ws.push_back(mf.get(format("mlp_s%d", l)));
+            Wb.push_back(mf.get(format("mlp_b%d", l)));
+        }
+        if (packed) // the file's packing wins, it was trained that way
+            precision = mf.getInt("mlp_precision");
+        else
+            quantize();
+        return ! empty();
+    }
 };
 
-//
-//
-// 'Eigenfaces'
-//
-struct ClassifierPCA : public ClassifierNearestFloat
+
+struct ClassifierMLP : Classifier
 {
-    Mat eigenvectors;
-    Mat mean;
-    int num_components;
+    MlpNet net;
+    Mat replay, replayLabels; // a few rows per class, so fine tuning won't forget them
+
+    enum { REPLAY=4, TUNE_EPOCHS=30 };
+
+    ClassifierMLP(int precision=MlpNet::F32, float holdout=0) : net(precision, holdout) {}
+
+    static vector<int> topology(int ni, int no)
+    {
+        vector<int> layers(4);
+        layers[0] = ni;
+        layers[1] = no>2 ? no*2 : 128;
+        layers[2] = no>2 ? no*8 : 8;
+        layers[3] = no;
+        return layers;
+    }
+
+    static Mat targets(const Mat &labels, int C)
+    {
+        Mat trainClasses = Mat::zeros(labels.total(), C, CV_32FC1);
+        for(int i=0; i < trainClasses.rows; i++)
+        {
+            trainClasses.at<float>(i, labels.at<int>(i)) = 1.f;
+        }
+        return trainClasses;
+    }
 
-    ClassifierPCA(int num_components=0)
-        : num_components(num_components)
-    {}
+    void remember(const Mat &data, const Mat &labels)
+    {
+        map<int,int> have;
+        for (size_t i=0; i<replayLabels.total(); i++)
+            have[replayLabels.at<int>(i)] ++;
+        for (int i=0; i<data.rows; i++)
+        {
+            int l = labels.at<int>(i);
+            if (have[l] ++ < REPLAY)
+            {
+                replay.push_back(data.row(i));
+                replayLabels.push_back(l);
+            }
+        }
+    }
 
-    inline
-    Mat project(const Mat &src) const
+    //
+    // same net, with C outputs. hidden layers, scaling, and the weights of
+    //   the existing outputs stay, the new output units start small and random,
+    //   and borrow the output scaling of the first one.
+    //
+    void grow(int C)
     {
-        return LDA::subspaceProject(eigenvectors, mean, src);
+        int L = net.layers();
+        int old = net.sizes[L-1];
+        if (C <= old)
+            return;
+
+        Mat &w = net.W[L-2];
+        Mat bigger(w.rows, C, CV_32F);
+        randu(bigger, -0.1, 0.1);
+        w.copyTo(bigger.colRange(0, old));
+        w = bigger;
+
+        Mat *sc[] = { &net.outScale, &net.invScale };
+        for (int k=0; k<2; k++)
+        {
+            Mat n(1, 2*C, CV_32F);
+            sc[k]->copyTo(n.colRange(0, 2*old));
+            for (int j=old; j<C; j++)
+            {
+                n.at<float>(2*j)   = sc[k]->at<float>(0);
+                n.at<float>(2*j+1) = sc[k]->at<float>(1);
+            }
+            *sc[k] = n;
+        }
+        net.sizes[L-1] = C;
     }
 
     virtual int train(const Mat &trainData, const Mat &trainLabels)
     {
-        if((num_components <= 0) || (num_components > trainData.rows))
-            num_components = trainData.rows;
+        set<int> classes;
+        int C = TextureFeatureImpl::unique(trainLabels, classes);
 
-        PCA pca(tofloat(trainData), Mat(), cv::PCA::DATA_AS_ROW, num_components);
+        net.create(topology(trainData.cols, C));
 
-        transpose(pca.eigenvectors, eigenvectors);
-        mean = pca.mean.reshape(1,1);
-        labels = trainLabels;
-        features = project(trainData);
+        Mat data = tofloat(trainData);
+        replay.release();
+        replayLabels.release();
+        remember(data, trainLabels);
+
+        net.train(data, targets(trainLabels, C));
+        return 1;
+    }
+
+    //
+    // fine tuning: grow the output layer for new persons, then continue from the
+    //   current weights (and scaling) on the new rows, plus a few remembered ones per class.
+    //
+    virtual int update(const Mat &trainData, const Mat &trainLabels)
+    {
+        if (net.empty())
+            return train(trainData, trainLabels);
+
+        net.unpack();
+        double maxLabel;
+        minMaxLoc(trainLabels, 0, &maxLabel);
+        grow(int(maxLabel) + 1);
+        int C = net.sizes.back();
+
+        Mat data = replay.clone();
+        Mat labels = replayLabels.clone();
+        Mat fresh = tofloat(trainData);
+        data.push_back(fresh);
+        labels.push_back(Mat(trainLabels).reshape(1, trainLabels.rows));
+        remember(fresh, trainLabels);
+
+        net.train(data, targets(labels, C), true, TUNE_EPOCHS);
         return 1;
     }
 
     virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
     {
-        return ClassifierNearestFloat::predict(project(tofloat(testFeature)), results);
+        Mat predicted, scores;
+        predictBatch(testFeature.reshape(1,1), predicted, scores);
+        results = (Mat_<float>(1,2) << float(predicted.at<int>(0)), scores.at<float>(0));
+        return 1;
     }
 
-    // Serialize
+    // one forward pass for all queries, the strongest output wins
+    virtual int predictBatch(const cv::Mat &queries, cv::Mat &predicted, cv::Mat &scores) const
+    {
+        Mat out;
+        net.predict(queries, out);
+        predicted.create(queries.rows, 1, CV_32S);
+        scores.create(queries.rows, 1, CV_32F);
+        for (int i=0; i<out.rows; i++)
+        {
+            Point best;
+            double m;
+            minMaxLoc(out.row(i), 0, &m, 0, &best);
+            predicted.at<int>(i) = best.x;
+            scores.at<float>(i) = float(m);
+        }
+        return queries.rows;
+    }
+
+    // Serialize, as an ANN_MLP model, plus the replay rows
     virtual bool save(FileStorage &fs) const
     {
-        fs << "labels" << labels;
-        fs << "features" << features;
-        fs << "mean" << mean;
-        fs << "eigenvectors" << eigenvectors;
-        fs << "num_components" << num_components;
-        return true;
+        fs << "replay" << replay;
+        fs << "replay_labels" << replayLabels;
+        return net.save(fs);
     }
+
     virtual bool load(const FileStorage &fs)
     {
-        fs["labels"] >> labels;
-        fs["features"] >> features;
-        fs["mean"] >> mean;
-        fs["eigenvectors"] >> eigenvectors;
-        fs["num_components"] >>num_components;
-        return ! features.empty();
+        fs["replay"] >> replay;
+        fs["replay_labels"] >> replayLabels;
+        return net.load(fs);
+    }
+
+    virtual bool write(ModelFile &mf) const
+    {
+        mf.put("replay", replay);
+        mf.put("replay_labels", replayLabels);
+        return net.write(mf);
+    }
+
+    virtual bool read(const ModelFile &mf)
+    {
+        replay = mf.get("replay");
+        replayLabels = mf.get("replay_labels");
+        return net.read(mf);
     }
 };
 
 
 //
-// 'Fisherfaces'
+// flann index over an owned copy of the gallery
+//   (flann only keeps the mat.data pointer, so the rows have to stay alive here).
 //
-struct ClassifierPCA_LDA : public ClassifierPCA
+//   LINEAR   exhaustive, exact
+//   KDFOREST randomized kd-trees, float features (checks: leafs visited per query)
+//   LSH      multi-probe lsh, binary (CV_8U, hamming) features
+//   APPROX   kd-forest or lsh, depending on the type
+//
+//   CL_KNN / CL_KNN_EXACT are LINEAR, approximate results only on request:
+//   CL_KNN_APPROX is APPROX, CL_KNN_APPROX_HI visits more leafs. (lsh ignores checks)
+//
+struct KnnIndex
 {
-    Mat icovar;
-    bool useMahalanobis;
-
-    ClassifierPCA_LDA(int num_components=0, bool useMahalanobis=true)
-        : ClassifierPCA(num_components)
-        , useMahalanobis(useMahalanobis)
-    {}
+    enum { LINEAR, KDFOREST, LSH, APPROX };
 
-    virtual int train(const Mat &trainData, const Mat &trainLabels)
-    {
-        set<int> classes;
-        int C = TextureFeatureImpl::unique(trainLabels,classes);
-        int N = trainData.rows;
-        if((num_components <= 0) || (num_components > (C-1)))
-            num_components = (C-1);
+    int kind;
+    int trees;       // kd-forest
+    int checks;      // kd-forest, recall vs. latency at query time
+    int tables;      // lsh
+    int keySize;     // lsh
+    int probe;       // lsh multi-probe level
 
-        // step one, do pca on the original data:
-        PCA pca(tofloat(trainData), Mat(), cv::PCA::DATA_AS_ROW, (N-C));
-        mean = pca.mean.reshape(1,1);
+    Mat data;
+    Ptr<cv::flann::Index> index;
 
-        // step two, do lda on data projected to pca space:
-        Mat proj = LDA::subspaceProject(pca.eigenvectors.t(), mean, trainData);
-        LDA lda(proj, trainLabels, num_components);
+    KnnIndex(int kind=LINEAR, int checks=64)
+        : kind(kind), trees(4), checks(checks)
+        , tables(12), keySize(20), probe(2)
+    {}
 
-        // step three, combine both:
-        Mat leigen;
-        lda.eigenvectors().convertTo(leigen, pca.eigenvectors.type());
-        gemm(pca.eigenvectors, leigen, 1.0, Mat(), 0.0, eigenvectors, GEMM_1_T);
+    bool binary() const { return data.type() == CV_8U; }
 
-        // step four, keep labels and projected dataset:
-        features = project(trainData);
-        labels = trainLabels;
+    int resolved() const
+    {
+        if (kind == APPROX) return binary() ? LSH : KDFOREST;
+        return kind < 0 ? LINEAR : kind; // older files may say -1 (size dependant), that's exact now
+    }
 
-        // while we're at it, precalculate the inverse covariance matrix:
-        if (useMahalanobis)
+    Ptr<cv::flann::IndexParams> params() const
+    {
+        switch(resolved())
         {
-            Mat _covar, _mean;
-            calcCovarMatrix(features, _covar, _mean, CV_COVAR_NORMAL|CV_COVAR_ROWS, CV_32F);
-            _covar /= (features.rows-1);
-            invert(_covar, icovar, DECOMP_SVD);
+            case KDFOREST: return makePtr<cv::flann::KDTreeIndexParams>(trees);
+            case LSH:      return makePtr<cv::flann::LshIndexParams>(tables, keySize, probe);
         }
-
-        return 1;
+        return makePtr<cv::flann::LinearIndexParams>();
     }
 
-    virtual double distance(const cv::Mat &testFeature, const cv::Mat &trainFeature) const
+    cvflann::flann_distance_t distance() const
     {
-        return Mahalanobis(testFeature, trainFeature, icovar);
+        return binary() ? cvflann::FLANN_DIST_HAMMING : cvflann::FLANN_DIST_L2;
     }
 
-    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    Mat binary_or_float(const Mat &m) const
     {
-        Mat q = project(tofloat(testFeature));
-
-        if (! useMahalanobis) // fall back to plain L2 norm
-            return ClassifierNearestFloat::predict(q, results);
-
-        int minId = -1;
-        double minDist = 999999999;
-        nearest(q, features, minId, minDist, *this);
-        results = (Mat_<float>(1,3) << float(labels.at<int>(minId)), float(minDist), float(minId));
-        return 1;
+        return (m.type() == CV_8U) ? m : tofloat(m);
     }
-};
 
-struct ClassifierLDA : public ClassifierNearestFloat
-{
-    Ptr<LDA> lda;
-    Mat mean;
-
-    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    void build(const Mat &trainData)
     {
-        set<int> classes;
-        int C = TextureFeatureImpl::unique(trainLabels,classes);
-        int N = trainData.rows;
-        int num_components = (C-1);
-
-        lda.release();
-        lda = makePtr<LDA>(num_components);
-        lda->compute(trainData, trainLabels);
-
-        //reduce(trainData,mean,0,cv::REDUCE_AVG,CV_64F);
-
-        Mat projected = lda->project(trainData);
-        return ClassifierNearestFloat::train(projected, trainLabels);
+        data = binary_or_float(trainData).clone();
+        index = makePtr<cv::flann::Index>(data, *params(), distance());
     }
 
-    virtual int predict(const Mat &a, Mat &res) const
+    // k nearest per query row, k gets clamped to the gallery size
+    //   (0, and empty indices / dists, if there's nothing to search, or nothing asked for)
+    int search(const Mat &queries, int k, Mat &indices, Mat &dists) const
     {
-        Mat pa = lda->project(tofloat(a));
-        return ClassifierNearestFloat::predict(pa, res);
+        k = std::min(k, data.rows);
+        if (k <= 0 || index.empty())
+        {
+            indices.release();
+            dists.release();
+            return 0;
+        }
+        index->knnSearch(binary() ? queries : tofloat(queries), indices, dists, k, cv::flann::SearchParams(checks));
+        return k;
     }
-};
 
-struct ClassifierMLP : Classifier
-{
-    Ptr<ml::ANN_MLP> ann;
-
-    static Ptr<ml::ANN_MLP> setup(int ni, int no)
+    // flann only (de)serializes to files, so the blob takes a detour via a tempfile
+    Mat blob() const
     {
-        Ptr<ml::ANN_MLP> ann = ml::ANN_MLP::create();
-        Mat_<int> layers(4,1);
-        layers(0) = ni;
-        layers(1) = no>2 ? no*2 : 128;
-        layers(2) = no>2 ? no*8 : 8;
-        layers(3) = no;
-        ann->setLayerSizes(layers);
-        ann->setActivationFunction(ml::ANN_MLP::SIGMOID_SYM,0,0);
-        ann->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 300, 0.0001));
-        ann->setTrainMethod(ml::ANN_MLP::BACKPROP, 0.0001);
-        return ann;
+        String fn = tempfile(".flann");
+        index->save(fn);
+        std::ifstream in(fn.c_str(), std::ios::binary);
+        std::vector<uchar> b((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        in.close();
+        std::remove(fn.c_str());
+        return Mat(b, true);
     }
 
-    virtual int train(const Mat &trainData, const Mat &trainLabels)
+    bool fromBlob(const Mat &b)
     {
-        set<int> classes;
-        int C = TextureFeatureImpl::unique(trainLabels, classes);
-
-        ann = setup(trainData.cols, C);
-
-        Mat trainClasses = Mat::zeros(trainLabels.total(), C, CV_32FC1);
-        for(int i=0; i < trainClasses.rows; i++)
+        if (b.empty()) // nothing saved, rebuild
         {
-            trainClasses.at<float>(i, trainLabels.at<int>(i)) = 1.f;
+            index = makePtr<cv::flann::Index>(data, *params(), distance());
+            return true;
         }
+        String fn = tempfile(".flann");
+        std::ofstream out(fn.c_str(), std::ios::binary);
+        out.write((const char*)b.ptr(), b.total());
+        out.close();
+        index = makePtr<cv::flann::Index>();
+        bool ok = index->load(data, fn);
+        std::remove(fn.c_str());
+        return ok;
+    }
 
-        return ann->train(tofloat(trainData), ml::ROW_SAMPLE, trainClasses);
+    //
+    // FileStorage: the rows only, load() rebuilds the index.
+    //   (the flann blob as yaml text is many times the size of the gallery,
+    //    write() puts it into the binary container instead)
+    //
+    bool save(FileStorage &fs) const
+    {
+        if (index.empty())
+            return false;
+        fs << "kind" << kind;
+        fs << "checks" << checks;
+        fs << "data" << data;
+        return true;
     }
 
-    virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
+    bool load(const FileStorage &fs)
     {
-        float r = ann->predict(tofloat(testFeature),results);
-        results = (Mat_<float>(1,1) << r);
-        return 1;
+        Mat b;
+        fs["kind"] >> kind;
+        fs["checks"] >> checks;
+        fs["data"] >> data;
+        fs["index"] >> b;
+        if (data.empty())
+            return false;
+        return fromBlob(b); // older files may have one
+    }
+
+    // binary: the built index goes along, so read() does not have to rebuild it
+    bool write(ModelFile &mf) const
+    {
+        if (index.empty())
+            return false;
+        mf.put("knn_kind", kind);
+        mf.put("knn_checks", checks);
+        mf.put("knn_data", data);
+        if (resolved() != LINEAR) // nothing to save there
+            mf.put("knn_index", blob());
+        return true;
+    }
+
+    bool read(const ModelFile &mf)
+    {
+        kind = mf.getInt("knn_kind", kind);
+        checks = mf.getInt("knn_checks", checks);
+        data = mf.get("knn_data");
+        if (data.empty())
+            return false;
+        return fromBlob(mf.get("knn_index"));
     }
 };
 
 
 struct ClassifierKNN : Classifier
 {
-    cv::Ptr<cv::flann::Index> index;
+    KnnIndex index;
     Mat_<int> labels;
+    int K;
+
+    ClassifierKNN(int kind=KnnIndex::LINEAR, int K=5, int checks=64)
+        : index(kind, checks)
+        , K(K)
+    {}
 
     static int majority(const Mat_<int> &ind, const Mat_<int> &labels) // re-used in verifier
     {
         map<int,int> maj;
         for (size_t i=0; i<ind.total(); i++)
         {
+            if (ind(i) < 0) continue;
             int id = labels(ind(i));
             if (maj.find(id) == maj.end())
                 maj[id] = 0;
             maj[id] ++;
         }
         int maxv=0;
-        int maxi=0;
+        int maxi=-1; // nothing found
         map<int,int>::iterator it = maj.begin();
         for (; it != maj.end(); it++)
         {
@@ -550,34 +3545,79 @@ struct ClassifierKNN : Classifier
         return maxi;
     }
 
-    static cv::Ptr<cv::flann::Index> train_index(const Mat &trainData)
-    {
-        if (trainData.type() == CV_8U)
-        {
-            return makePtr<cv::flann::Index>(trainData, cv::flann::LinearIndexParams(), cvflann::FLANN_DIST_HAMMING);
-        }
-        return makePtr<cv::flann::Index>(trainData, cv::flann::LinearIndexParams(), cvflann::FLANN_DIST_L2);
-    }
-
     virtual int train(const Mat &trainData, const Mat &trainLabels)
     {
-        index  = train_index(trainData);
+        index.build(trainData);
         labels = trainLabels;
         return 1;
     }
 
     virtual int predict(const cv::Mat &testFeature, cv::Mat &results) const
     {
-        int K=5;
-        cv::flann::SearchParams params;
         cv::Mat dists;
         cv::Mat indices;
-        index->knnSearch(testFeature, indices, dists, K, params);
+        if (index.search(testFeature, K, indices, dists) == 0)
+        {
+            results = (Mat_<float>(1,1) << -1);
+            return 1;
+        }
 
         results = (Mat_<float>(1,1) << majority(indices, labels));
         //results = (Mat_<float>(1,1) << labels(indices.at<int>(0)));
         return 1;
     }
+
+    // one knnSearch for all queries
+    virtual int predictBatch(const cv::Mat &queries, cv::Mat &predicted, cv::Mat &scores) const
+    {
+        cv::Mat dists;
+        cv::Mat indices;
+        int k = index.search(queries, K, indices, dists);
+
+        predicted.create(queries.rows, 1, CV_32S);
+        scores.create(queries.rows, 1, CV_32F);
+        if (k == 0)
+        {
+            predicted.setTo(-1);
+            scores.setTo(FLT_MAX);
+            return queries.rows;
+        }
+        for (int i=0; i<queries.rows; i++)
+        {
+            predicted.at<int>(i) = majority(indices.row(i), labels);
+            scores.at<float>(i) = (dists.type() == CV_32S) ? float(dists.at<int>(i,0)) : dists.at<float>(i,0); // hamming is int
+        }
+        return queries.rows;
+    }
+
+    // Serialize
+    virtual bool save(FileStorage &fs) const
+    {
+        fs << "labels" << labels;
+        fs << "K" << K;
+        return index.save(fs);
+    }
+
+    virtual bool load(const FileStorage &fs)
+    {
+        fs["labels"] >> labels;
+        fs["K"] >> K;
+        return index.load(fs);
+    }
+
+    virtual bool write(ModelFile &mf) const
+    {
+        mf.put("labels", labels);
+        mf.put("K", K);
+        return index.write(mf);
+    }
+
+    virtual bool read(const ModelFile &mf)
+    {
+        labels = mf.get("labels");
+        K = mf.getInt("K", K);
+        return index.read(mf);
+    }
 };
 
 //------->8-----------------------------------------------------------------------
@@ -656,6 +3696,26 @@ struct VerifierHist : VerifierNearest
     }
 };
 
+//
+// hamming distance on packed binary features, without the norm() dispatch
+//
+struct VerifierHamming : VerifierNearest
+{
+    VerifierHamming() : VerifierNearest(NORM_HAMMING) {}
+
+    virtual double distance(const Mat &a, const Mat &b) const
+    {
+        if (a.type() != CV_8U || b.type() != CV_8U)
+            return VerifierNearest::distance(a, b);
+
+        int W = (int(a.total()) + 7) / 8;
+        Mat pa, pb;
+        hamming::pack(a.reshape(1,1), pa, W);
+        hamming::pack(b.reshape(1,1), pb, W);
+        return hamming::distance(hamming::words(pa, 0), hamming::words(pb, 0), W);
+    }
+};
+
 //
 // similar to the classification task - just change the distance func.
 //
@@ -675,6 +3735,29 @@ struct VerifierCosine : VerifierNearest
 //
 struct PairDistance
 {
+    bool packed; // keep binary xor packed (for hamming consumers), or expand it to bits
+
+    PairDistance(bool packed=false) : packed(packed) {}
+
+    //
+    // one 0/1 float per bit, for the statmodels (instead of 'byte values'),
+    //   msb first, like the latch tests. (no table, so nothing shared between threads)
+    //
+    static Mat unpack_bits(const Mat &x)
+    {
+        Mat x1 = x.reshape(1,1);
+        Mat bits(1, int(x1.total())*8, CV_32F);
+        const uchar *p = x1.ptr<uchar>();
+        float *f = bits.ptr<float>();
+        for (size_t i=0; i<x1.total(); i++, f+=8)
+        {
+            int v = p[i];
+            for (int j=0; j<8; j++)
+                f[j] = float((v >> (7-j)) & 1);
+        }
+        return bits;
+    }
+
     //
     // xor for binary, L2 for float
     //
@@ -684,8 +3767,9 @@ struct PairDistance
         switch(a.type())
         {
             case CV_8U:
-                d = a^b;
-                d.convertTo(d,CV_32F);
+                bitwise_xor(a, b, d);
+                if (! packed)
+                    d = unpack_bits(d);
                 break;
             default:
                 d = a-b;
@@ -767,35 +3851,65 @@ struct VerifierSVM : public VerifierPairDistance
         svm->setTermCriteria(TermCriteria(TermCriteria::MAX_ITER+TermCriteria::EPS, 1000, 1e-6));
         model = svm;
     }
+
+    Mat input(const Mat &distances) const
+    {
+        return krnl.empty() ? distances : customKernelInput(krnl, distances);
+    }
+
+    // same / not same, always 2 classes, so the custom kernels may cache rows
+    virtual int train(const Mat &features, const Mat &labels)
+    {
+        Mat distances, binlabels;
+        train_pre(features, labels, distances, binlabels);
+
+        model->clear();
+        if (! krnl.empty())
+            customKernelTrain(krnl, true);
+        bool ok = model->train(ml::TrainData::create(input(distances), ml::ROW_SAMPLE, binlabels));
+        if (! krnl.empty())
+            customKernelReady(krnl, false);
+        return ok;
+    }
+
+    virtual bool same(const Mat &a, const Mat &b) const
+    {
+        Mat res;
+        model->predict(input(distance_mat(a, b)), res);
+        return (res.at<float>(0) > thresh);
+    }
 };
 
 
 
 struct VerifierKNN : public TextureFeature::Verifier, PairDistance
 {
-    cv::Ptr<cv::flann::Index> index;
+    KnnIndex index;
     Mat_<int> labels;
-    Mat features;
+
+    VerifierKNN(int kind=KnnIndex::LINEAR, int checks=64)
+        : PairDistance(true) // xor patterns go into a hamming index
+        , index(kind, checks)
+    {}
 
     virtual int train(const Mat &trainData, const Mat &trainLabels)
     {
         Mat distances, binlabels;
         train_pre(trainData, trainLabels, distances, binlabels);
 
-        index = ClassifierKNN::train_index(distances);
+        index.build(distances);
 
         labels = binlabels;
-        features = distances; // need a copy here, because flann tries to run away with mat.data pointer !!!
         return 1;
     }
 
     virtual bool same(const Mat &a, const Mat &b) const
     {
         int K=5;
-        cv::flann::SearchParams params;
         cv::Mat dists;
         cv::Mat indices;
-        index->knnSearch(distance_mat(a,b), indices, dists, K, params);
+        if (index.search(distance_mat(a,b), K, indices, dists) == 0)
+            return false;
 
         int hit = ClassifierKNN::majority(indices, labels);
         return hit > 0;
@@ -803,15 +3917,17 @@ struct VerifierKNN : public TextureFeature::Verifier, PairDistance
 };
 
 
-// WIP !! ;(
+//
+// single output mlp on the pair distances, 'same' above 0.5
+//
 struct VerifierMLP : public VerifierPairDistance
 {
-    VerifierMLP() : VerifierPairDistance(0.5f) {}
+    MlpNet net;
+
+    VerifierMLP(int precision=MlpNet::F32, float holdout=0) : VerifierPairDistance(0.5f), net(precision, holdout) {}
 
     virtual int train(const Mat &trainData, const Mat &trainLabels)
     {
-        model = ClassifierMLP::setup(trainData.cols, 1);
-
         Mat distances, binlabels;
         train_pre(tofloat(trainData), trainLabels, distances, binlabels);
 
@@ -822,7 +3938,16 @@ struct VerifierMLP : public VerifierPairDistance
                 trainClasses.at<float>(i,0) = 1.f;
         }
 
-        return model->train(ml::TrainData::create(distances, ml::ROW_SAMPLE, trainClasses));
+        net.create(ClassifierMLP::topology(distances.cols, 1));
+        net.train(distances, trainClasses);
+        return 1;
+    }
+
+    virtual bool same(const Mat &a, const Mat &b) const
+    {
+        Mat res;
+        net.predict(distance_mat(a, b), res);
+        return (res.at<float>(0) > thresh);
     }
 };
 
@@ -834,6 +3959,36 @@ namespace TextureFeature
 {
 using namespace TextureFeatureImpl;
 
+struct ParallelPredict : public ParallelLoopBody
+{
+    const Classifier &cls;
+    const Mat &queries;
+    Mat &labels, &scores;
+
+    ParallelPredict(const Classifier &cls, const Mat &queries, Mat &labels, Mat &scores)
+        : cls(cls), queries(queries), labels(labels), scores(scores)
+    {}
+
+    virtual void operator()(const Range &range) const
+    {
+        for (int i=range.start; i<range.end; i++)
+        {
+            Mat res;
+            cls.predict(queries.row(i), res);
+            labels.at<int>(i) = int(res.at<float>(0));
+            scores.at<float>(i) = (res.total() > 1) ? res.at<float>(1) : 0.0f;
+        }
+    }
+};
+
+int Classifier::predictBatch(const Mat &queries, Mat &labels, Mat &scores) const
+{
+    labels.create(queries.rows, 1, CV_32S);
+    scores.create(queries.rows, 1, CV_32F);
+    parallel_for_(Range(0, queries.rows), ParallelPredict(*this, queries, labels, scores));
+    return queries.rows;
+}
+
 Ptr<Classifier> createClassifier(int clsfy)
 {
     switch(clsfy)
@@ -860,7 +4015,17 @@ Ptr<Classifier> createClassifier(int clsfy)
         case CL_PCA:       return makePtr<ClassifierPCA>(); break;
         case CL_PCA_LDA:   return makePtr<ClassifierPCA_LDA>(); break;
         case CL_MLP:       return makePtr<ClassifierMLP>(); break;
+        case CL_MLP_F16:   return makePtr<ClassifierMLP>(int(MlpNet::F16)); break;
+        case CL_MLP_Q8:    return makePtr<ClassifierMLP>(int(MlpNet::Q8)); break;
+        case CL_MLP_ES:    return makePtr<ClassifierMLP>(int(MlpNet::F32), 0.1f); break;
         case CL_KNN:       return makePtr<ClassifierKNN>(); break;
+        case CL_KNN_EXACT: return makePtr<ClassifierKNN>(int(KnnIndex::LINEAR)); break;
+        case CL_KNN_APPROX:return makePtr<ClassifierKNN>(int(KnnIndex::APPROX)); break;
+        case CL_KNN_APPROX_HI: return makePtr<ClassifierKNN>(int(KnnIndex::APPROX), 5, 256); break;
+        case CL_NORM_HAM:  return makePtr<ClassifierHamming>(); break;
+        case CL_NORM_Q8:   return makePtr<ClassifierNearestQuant>(int(QuantGallery::Q8)); break;
+        case CL_NORM_F16:  return makePtr<ClassifierNearestQuant>(int(QuantGallery::F16)); break;
+        case CL_NORM_Q8_RR:return makePtr<ClassifierNearestQuant>(int(QuantGallery::Q8), 8); break;
 
         default: cerr << "classification " << clsfy << " is not yet supported." << endl; exit(-1);
     }
@@ -890,7 +4055,14 @@ Ptr<Verifier> createVerifier(int clsfy)
         case CL_SVM_CAUCHY:return makePtr<VerifierSVM>(-9); break;
         case CL_COSINE:    return makePtr<VerifierCosine>(); break;
         case CL_KNN:       return makePtr<VerifierKNN>(); break;
+        case CL_KNN_EXACT: return makePtr<VerifierKNN>(int(KnnIndex::LINEAR)); break;
+        case CL_KNN_APPROX:return makePtr<VerifierKNN>(int(KnnIndex::APPROX)); break;
+        case CL_KNN_APPROX_HI: return makePtr<VerifierKNN>(int(KnnIndex::APPROX), 256); break;
         case CL_MLP:       return makePtr<VerifierMLP>(); break;
+        case CL_MLP_F16:   return makePtr<VerifierMLP>(int(MlpNet::F16)); break;
+        case CL_MLP_Q8:    return makePtr<VerifierMLP>(int(MlpNet::Q8)); break;
+        case CL_MLP_ES:    return makePtr<VerifierMLP>(int(MlpNet::F32), 0.1f); break;
+        case CL_NORM_HAM:  return makePtr<VerifierHamming>(); break;
 
         default: cerr << "verification " << clsfy << " is not yet supported." << endl; exit(-1);
     }
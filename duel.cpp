@@ -192,7 +192,24 @@ int crossfoldData(Ptr<Extractor> ext,
 {
     int fsiz=0;
 
+    // extract all images taking part in this split in one go:
+    vector<Mat> batch;
+    for (size_t j=0; j<persons.size(); j++)
+    {
+        if (persons[j].size() < fold)
+            continue;
+        for (size_t n=0; n<persons[j].size(); n++)
+            batch.push_back(images[persons[j][n]]);
+    }
+    Mat rows;
+    ext->extractBatch(batch, rows);
+    if (!fil.empty())
+    {
+        fil->filterBatch(rows, rows);
+    }
+
     // split train/test set per person:
+    int k=0;
     for (size_t j=0; j<persons.size(); j++)
     {
         size_t n_per_person = persons[j].size();
@@ -203,13 +220,7 @@ int crossfoldData(Ptr<Extractor> ext,
         {
             int index = persons[j][n];
 
-            Mat feature;
-            ext->extract(images[index],feature);
-
-            if (!fil.empty())
-            {
-                fil->filter(feature, feature);
-            }
+            Mat feature = rows.row(k++);
 
             fsiz = feature.total() * feature.elemSize();
 
@@ -254,13 +265,11 @@ double runtest(string name, Ptr<Extractor> ext, Ptr<Filter> fil, Ptr<Classifier>
 
         int64 t1=getTickCount();
         Mat conf = Mat::zeros(confusion.size(), CV_32F);
+        Mat predicted, scores;
+        cls->predictBatch(testFeatures, predicted, scores);
         for (int i=0; i<testFeatures.rows; i++)
         {
-            Mat res;
-            Mat feat = testFeatures.row(i);
-            cls->predict(feat.reshape(1,1), res);
-
-            int pred = int(res.at<float>(0));
+            int pred = predicted.at<int>(i);
             int ground = testLabels.at<int>(i);
             if (pred<0 || ground<0)
             {
@@ -391,15 +400,21 @@ int main(int argc, const char *argv[])
             TextureFeature::EXT_Pixels, TextureFeature::FIL_NONE,  TextureFeature::CL_NORM_L2,
             TextureFeature::EXT_Pixels, TextureFeature::FIL_NONE,  TextureFeature::CL_SVM_POL,
             TextureFeature::EXT_Pixels, TextureFeature::FIL_NONE,  TextureFeature::CL_PCA_LDA,
+            TextureFeature::EXT_Lbp,    TextureFeature::FIL_NONE,  TextureFeature::CL_NORM_L2,
+            TextureFeature::EXT_Lbp,    TextureFeature::FIL_NONE,  TextureFeature::CL_NORM_Q8,  // compressed galleries vs. NORM_L2 above.
+            TextureFeature::EXT_Lbp,    TextureFeature::FIL_NONE,  TextureFeature::CL_NORM_F16, //  not run on a face set yet (open), on synthetic
+            TextureFeature::EXT_Lbp,    TextureFeature::FIL_NONE,  TextureFeature::CL_NORM_Q8_RR, //  lbp histograms the same nearest row: q8 94%, f16 100%, q8_rr 99.8%
             TextureFeature::EXT_Lbp,    TextureFeature::FIL_NONE,  TextureFeature::CL_HIST_CHI,
             TextureFeature::EXT_Lbp,    TextureFeature::FIL_NONE,  TextureFeature::CL_HIST_HELL,
             TextureFeature::EXT_Lbp,    TextureFeature::FIL_NONE,  TextureFeature::CL_SVM_LIN,
             TextureFeature::EXT_LBPU_P, TextureFeature::FIL_DCT8,  TextureFeature::CL_SVM_LIN,
             TextureFeature::EXT_MTS_P,  TextureFeature::FIL_NONE,  TextureFeature::CL_SVM_INT2,
+            TextureFeature::EXT_MTS_P,  TextureFeature::FIL_HKM_INT, TextureFeature::CL_SVM_LIN, //  same, as a linear model
             TextureFeature::EXT_COMB_P,  TextureFeature::FIL_HELL,  TextureFeature::CL_SVM_INT2,
             TextureFeature::EXT_TPLBP_P, TextureFeature::FIL_DCT8,  TextureFeature::CL_SVM_INT2,
             TextureFeature::EXT_FPLBP_P, TextureFeature::FIL_NONE,  TextureFeature::CL_SVM_INT2,
             TextureFeature::EXT_FPLBP_P, TextureFeature::FIL_NONE,  TextureFeature::CL_MLP,
+            TextureFeature::EXT_FPLBP_P, TextureFeature::FIL_NONE,  TextureFeature::CL_MLP_Q8, //  same, int8 inference
             TextureFeature::EXT_HDGRAD, TextureFeature::FIL_DCT24,  TextureFeature::CL_SVM_LIN, 
             TextureFeature::EXT_HDLBP,  TextureFeature::FIL_DCT24,  TextureFeature::CL_SVM_INT2,
             //TextureFeature::EXT_Sift,   TextureFeature::FIL_HELL,  TextureFeature::CL_SVM_INT2,
@@ -5,11 +5,15 @@
 #include "texturefeature.h"
 #include "util/pcanet/net.h"
 #include "landmarks.h"
+#include "simd.h"
+#include "half.h"
+#include "fwht.h"
 #if 0
  #include "profile.h"
 #endif
 
 #include <vector>
+#include <algorithm>
 using std::vector;
 #include <iostream>
 using std::cerr;
@@ -36,6 +40,73 @@ struct ExtractorPixels : public TextureFeature::Extractor
 };
 
 
+//
+// gradient engine, shared by all the gradient based extractors below.
+//   works one row at a time: 3x3 sobel (reflect101 border, same as Sobel()),
+//   then orientation and magnitude for the whole row (hal::fastAtan2, hal::magnitude),
+//   so there are no full size dx/dy/angle images anymore.
+//
+struct GradEngine
+{
+    Mat_<float> src;
+    AutoBuffer<float> buf;
+    float *dx, *dy;
+
+    GradEngine(const Mat &I)
+        : src(I)
+        , buf(I.cols*2 + 2)
+    {
+        dx = buf;
+        dy = dx + I.cols + 1;
+    }
+
+    static int reflect(int i, int n)
+    {
+        return n==1 ? 0 : i<0 ? -i : i>=n ? 2*n-2-i : i;
+    }
+
+    void sobel(const float *a, const float *b, const float *d, int l, int c, int r)
+    {
+        dx[c] = (a[r] - a[l]) + 2*(b[r] - b[l]) + (d[r] - d[l]);
+        dy[c] = (d[l] + 2*d[c] + d[r]) - (a[l] + 2*a[c] + a[r]);
+    }
+
+    // orientation (degrees) of row r into ang, magnitude into mag (if given)
+    void row(int r, float *ang, float *mag=0)
+    {
+        int n = src.cols;
+        const float *a = src[reflect(r-1, src.rows)];
+        const float *b = src[r];
+        const float *d = src[reflect(r+1, src.rows)];
+
+        sobel(a, b, d, reflect(-1,n), 0, reflect(1,n));
+        int c = 1;
+#ifdef HAVE_SSE
+        const __m128 two = _mm_set1_ps(2.0f);
+        for (; c<=n-5; c+=4)
+        {
+            __m128 al = _mm_loadu_ps(a+c-1), ac = _mm_loadu_ps(a+c), ar = _mm_loadu_ps(a+c+1);
+            __m128 bl = _mm_loadu_ps(b+c-1),                         br = _mm_loadu_ps(b+c+1);
+            __m128 dl = _mm_loadu_ps(d+c-1), dc = _mm_loadu_ps(d+c), dr = _mm_loadu_ps(d+c+1);
+            __m128 x = _mm_add_ps(_mm_add_ps(_mm_sub_ps(ar, al), _mm_mul_ps(two, _mm_sub_ps(br, bl))), _mm_sub_ps(dr, dl));
+            __m128 y = _mm_sub_ps(_mm_add_ps(_mm_add_ps(dl, _mm_mul_ps(two, dc)), dr),
+                                  _mm_add_ps(_mm_add_ps(al, _mm_mul_ps(two, ac)), ar));
+            _mm_storeu_ps(dx+c, x);
+            _mm_storeu_ps(dy+c, y);
+        }
+#endif
+        for (; c<n-1; c++)
+            sobel(a, b, d, c-1, c, c+1);
+        if (n > 1)
+            sobel(a, b, d, n-2, n-1, n-2);
+
+        hal::fastAtan2(dx, dy, ang, n, true);
+        if (mag)
+            hal::magnitude(dx, dy, mag, n);
+    }
+};
+
+
 //
 // later use gridded histograms the same way as with lbp(h)
 //
@@ -44,48 +115,216 @@ struct FeatureGrad
     int nsec;
     FeatureGrad(int nsec=45) : nsec(nsec) {}
 
+    float step() const { return float(360/nsec); }
+
+    // one row of quantized orientations
+    void row(GradEngine &ge, int r, float *ang, uchar *dst) const
+    {
+        ge.row(r, ang);
+        float s = step();
+        for (int c=0; c<ge.src.cols; c++)
+            dst[c] = saturate_cast<uchar>(ang[c] / s);
+    }
+
     int operator() (const Mat &I, Mat &fI) const
     {
-        Mat s1, s2, s3(I.size(), CV_32F);
-        Sobel(I, s1, CV_32F, 1, 0);
-        Sobel(I, s2, CV_32F, 0, 1);
-        hal::fastAtan2(s1.ptr<float>(0), s2.ptr<float>(0), s3.ptr<float>(0), I.total(), true);
-        s3 /= (360/nsec);
-        fI = s3;
-        //s3.convertTo(fI,CV_8U);
+        GradEngine ge(I);
+        AutoBuffer<float> _ang(I.cols+1);
+        float *ang = _ang;
+        Mat_<uchar> codes(I.size());
+        for (int r=0; r<I.rows; r++)
+            row(ge, r, ang, codes[r]);
+        fI = codes;
         return (nsec+1); //*2;
     }
 };
 
 
 
+//
+// all the lbp variants below boil down to a set of pixel comparisons,
+// one for each bit of the code. LbpKernel keeps the offsets for those,
+// and computes a whole row of codes at once,
+// (16 or 32 pixels per step on sse2 / avx2 machines).
+//
+//   plain     : bit b = I(p[2b]) > I(p[2b+1])
+//   fourPatch : bit b = I(p[4b]) - I(p[4b+1]) > I(p[4b+2]) - I(p[4b+3])
+//
+#ifdef HAVE_SSE
+static int lbp_compare_sse2(const uchar **p, int nbits, int c, int c1, uchar *dst)
+{
+    const __m128i sign = _mm_set1_epi8(char(0x80)); // there's no unsigned compare
+    for (; c<=c1-16; c+=16)
+    {
+        __m128i v = _mm_setzero_si128();
+        for (int b=0; b<nbits; b++)
+        {
+            __m128i x = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p[b*2]   + c)), sign);
+            __m128i y = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(p[b*2+1] + c)), sign);
+            v = _mm_or_si128(v, _mm_and_si128(_mm_cmpgt_epi8(x, y), _mm_set1_epi8(char(1<<b))));
+        }
+        _mm_storeu_si128((__m128i*)(dst + c), v);
+    }
+    return c;
+}
 
-struct FeatureLbp
+TARGET_AVX2
+static int lbp_compare_avx2(const uchar **p, int nbits, int c, int c1, uchar *dst)
 {
-    int operator() (const Mat &I, Mat &fI) const
+    const __m256i sign = _mm256_set1_epi8(char(0x80));
+    for (; c<=c1-32; c+=32)
     {
-        Mat_<uchar> feature(I.size(),0);
-        Mat_<uchar> img(I);
-        const int m=1;
-        for (int r=m; r<img.rows-m; r++)
+        __m256i v = _mm256_setzero_si256();
+        for (int b=0; b<nbits; b++)
         {
-            for (int c=m; c<img.cols-m; c++)
-            {
-                uchar v = 0;
-                uchar cen = img(r,c);
-                v |= (img(r-1,c  ) > cen) << 0;
-                v |= (img(r-1,c+1) > cen) << 1;
-                v |= (img(r  ,c+1) > cen) << 2;
-                v |= (img(r+1,c+1) > cen) << 3;
-                v |= (img(r+1,c  ) > cen) << 4;
-                v |= (img(r+1,c-1) > cen) << 5;
-                v |= (img(r  ,c-1) > cen) << 6;
-                v |= (img(r-1,c-1) > cen) << 7;
-                feature(r,c) = v;
-            }
+            __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p[b*2]   + c)), sign);
+            __m256i y = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(p[b*2+1] + c)), sign);
+            v = _mm256_or_si256(v, _mm256_and_si256(_mm256_cmpgt_epi8(x, y), _mm256_set1_epi8(char(1<<b))));
         }
+        _mm256_storeu_si256((__m256i*)(dst + c), v);
+    }
+    return c;
+}
+
+// a-b > c-d  <=>  a+d > b+c, in 16 bit
+static int lbp_fourpatch_sse2(const uchar **p, int nbits, int c, int c1, uchar *dst)
+{
+    const __m128i z = _mm_setzero_si128();
+    for (; c<=c1-16; c+=16)
+    {
+        __m128i v = _mm_setzero_si128();
+        for (int b=0; b<nbits; b++)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(p[b*4]   + c));
+            __m128i e = _mm_loadu_si128((const __m128i*)(p[b*4+1] + c));
+            __m128i f = _mm_loadu_si128((const __m128i*)(p[b*4+2] + c));
+            __m128i d = _mm_loadu_si128((const __m128i*)(p[b*4+3] + c));
+            __m128i lo = _mm_cmpgt_epi16(_mm_add_epi16(_mm_unpacklo_epi8(a,z), _mm_unpacklo_epi8(d,z)),
+                                         _mm_add_epi16(_mm_unpacklo_epi8(e,z), _mm_unpacklo_epi8(f,z)));
+            __m128i hi = _mm_cmpgt_epi16(_mm_add_epi16(_mm_unpackhi_epi8(a,z), _mm_unpackhi_epi8(d,z)),
+                                         _mm_add_epi16(_mm_unpackhi_epi8(e,z), _mm_unpackhi_epi8(f,z)));
+            v = _mm_or_si128(v, _mm_and_si128(_mm_packs_epi16(lo, hi), _mm_set1_epi8(char(1<<b))));
+        }
+        _mm_storeu_si128((__m128i*)(dst + c), v);
+    }
+    return c;
+}
+
+TARGET_AVX2
+static int lbp_fourpatch_avx2(const uchar **p, int nbits, int c, int c1, uchar *dst)
+{
+    const __m256i z = _mm256_setzero_si256();
+    for (; c<=c1-32; c+=32)
+    {
+        __m256i v = _mm256_setzero_si256();
+        for (int b=0; b<nbits; b++)
+        {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(p[b*4]   + c));
+            __m256i e = _mm256_loadu_si256((const __m256i*)(p[b*4+1] + c));
+            __m256i f = _mm256_loadu_si256((const __m256i*)(p[b*4+2] + c));
+            __m256i d = _mm256_loadu_si256((const __m256i*)(p[b*4+3] + c));
+            // unpack & pack both work per 128bit lane, so the pixel order survives
+            __m256i lo = _mm256_cmpgt_epi16(_mm256_add_epi16(_mm256_unpacklo_epi8(a,z), _mm256_unpacklo_epi8(d,z)),
+                                            _mm256_add_epi16(_mm256_unpacklo_epi8(e,z), _mm256_unpacklo_epi8(f,z)));
+            __m256i hi = _mm256_cmpgt_epi16(_mm256_add_epi16(_mm256_unpackhi_epi8(a,z), _mm256_unpackhi_epi8(d,z)),
+                                            _mm256_add_epi16(_mm256_unpackhi_epi8(e,z), _mm256_unpackhi_epi8(f,z)));
+            v = _mm256_or_si256(v, _mm256_and_si256(_mm256_packs_epi16(lo, hi), _mm256_set1_epi8(char(1<<b))));
+        }
+        _mm256_storeu_si256((__m256i*)(dst + c), v);
+    }
+    return c;
+}
+#endif
+
+struct LbpKernel
+{
+    int border;
+    int nbits;
+    bool fourPatch;
+    Point pt[32]; // offsets to the center pixel
+
+    // yx: (y,x) offset pairs, 2 (or 4 for fourPatch) per bit
+    LbpKernel(int border, int nbits, const int *yx, bool fourPatch=false)
+        : border(border)
+        , nbits(nbits)
+        , fourPatch(fourPatch)
+    {
+        for (int i=0; i<npoints(); i++)
+            pt[i] = Point(yx[i*2+1], yx[i*2]);
+    }
+
+    int npoints()  const { return nbits * (fourPatch ? 4 : 2); }
+    int histSize() const { return 1 << nbits; }
+
+    // one row of codes, border pixels stay 0
+    void row(const Mat_<uchar> &img, int r, uchar *dst) const
+    {
+        int c0 = border, c1 = img.cols - border;
+        if (r < border || r >= img.rows - border || c1 <= c0)
+        {
+            memset(dst, 0, img.cols);
+            return;
+        }
+        const uchar *p[32];
+        for (int i=0; i<npoints(); i++)
+            p[i] = img.ptr(r + pt[i].y) + pt[i].x;
+
+        int c = c0;
+#ifdef HAVE_SSE
+        if (haveAVX2())
+            c = fourPatch ? lbp_fourpatch_avx2(p, nbits, c, c1, dst) : lbp_compare_avx2(p, nbits, c, c1, dst);
+        c = fourPatch ? lbp_fourpatch_sse2(p, nbits, c, c1, dst) : lbp_compare_sse2(p, nbits, c, c1, dst);
+#endif
+        for (; c<c1; c++)
+        {
+            uchar v = 0;
+            if (fourPatch)
+                for (int b=0; b<nbits; b++)
+                    v |= ((p[b*4][c] - p[b*4+1][c]) > (p[b*4+2][c] - p[b*4+3][c])) << b;
+            else
+                for (int b=0; b<nbits; b++)
+                    v |= (p[b*2][c] > p[b*2+1][c]) << b;
+            dst[c] = v;
+        }
+        memset(dst, 0, c0);
+        memset(dst + c1, 0, img.cols - c1);
+    }
+
+    // the whole code image
+    void image(const Mat &I, Mat &fI) const
+    {
+        Mat_<uchar> img(I);
+        Mat_<uchar> feature(img.size());
+        for (int r=0; r<img.rows; r++)
+            row(img, r, feature.ptr(r));
         fI = feature;
-        return 256;
+    }
+};
+
+
+
+struct FeatureLbp
+{
+    LbpKernel kernel() const
+    {
+        static const int yx[] = { // neighbour > center
+            -1, 0,   0,0,
+            -1, 1,   0,0,
+             0, 1,   0,0,
+             1, 1,   0,0,
+             1, 0,   0,0,
+             1,-1,   0,0,
+             0,-1,   0,0,
+            -1,-1,   0,0
+        };
+        return LbpKernel(1, 8, yx);
+    }
+
+    int operator() (const Mat &I, Mat &fI) const
+    {
+        LbpKernel k = kernel();
+        k.image(I, fI);
+        return k.histSize();
     }
 };
 
@@ -98,25 +337,24 @@ struct FeatureCsLbp
 {
     int radius;
     FeatureCsLbp(int r=1) : radius(r) {}
-    int operator() (const Mat &I, Mat &fI) const
+
+    LbpKernel kernel() const
     {
-        Mat_<uchar> feature(I.size(),0);
-        Mat_<uchar> img(I);
         const int R=radius;
-        for (int r=R; r<img.rows-R; r++)
-        {
-            for (int c=R; c<img.cols-R; c++)
-            {
-                uchar v = 0;
-                v |= (img(r-R,c  ) > img(r+R,c  )) << 0;
-                v |= (img(r-R,c+R) > img(r+R,c-R)) << 1;
-                v |= (img(r  ,c+R) > img(r  ,c-R)) << 2;
-                v |= (img(r+R,c+R) > img(r-R,c-R)) << 3;
-                feature(r,c) = v;
-            }
-        }
-        fI = feature;
-        return 16;
+        const int yx[] = {
+            -R, 0,   R, 0,
+            -R, R,   R,-R,
+             0, R,   0,-R,
+             R, R,  -R,-R
+        };
+        return LbpKernel(R, 4, yx);
+    }
+
+    int operator() (const Mat &I, Mat &fI) const
+    {
+        LbpKernel k = kernel();
+        k.image(I, fI);
+        return k.histSize();
     }
 };
 
@@ -129,25 +367,24 @@ struct FeatureDiamondLbp
 {
     int radius;
     FeatureDiamondLbp(int r=1) : radius(r) {}
-    int operator() (const Mat &I, Mat &fI) const
+
+    LbpKernel kernel() const
     {
-        Mat_<uchar> feature(I.size(),0);
-        Mat_<uchar> img(I);
         const int R=radius;
-        for (int r=R; r<img.rows-R; r++)
-        {
-            for (int c=R; c<img.cols-R; c++)
-            {
-                uchar v = 0;
-                v |= (img(r-R,c  ) > img(r  ,c+R)) << 0;
-                v |= (img(r  ,c+R) > img(r+R,c  )) << 1;
-                v |= (img(r+R,c  ) > img(r  ,c-R)) << 2;
-                v |= (img(r  ,c-R) > img(r-R,c  )) << 3;
-                feature(r,c) = v;
-            }
-        }
-        fI = feature;
-        return 16;
+        const int yx[] = {
+            -R, 0,   0, R,
+             0, R,   R, 0,
+             R, 0,   0,-R,
+             0,-R,  -R, 0
+        };
+        return LbpKernel(R, 4, yx);
+    }
+
+    int operator() (const Mat &I, Mat &fI) const
+    {
+        LbpKernel k = kernel();
+        k.image(I, fI);
+        return k.histSize();
     }
 };
 
@@ -160,25 +397,24 @@ struct FeatureSquareLbp
 {
     int radius;
     FeatureSquareLbp(int r=1) : radius(r) {}
-    int operator() (const Mat &I, Mat &fI) const
+
+    LbpKernel kernel() const
     {
-        Mat_<uchar> feature(I.size(),0);
-        Mat_<uchar> img(I);
         const int R=radius;
-        for (int r=R; r<img.rows-R; r++)
-        {
-            for (int c=R; c<img.cols-R; c++)
-            {
-                uchar v = 0;
-                v |= (img(r-R,c-R) > img(r-R,c+R)) << 0;
-                v |= (img(r-R,c+R) > img(r+R,c+R)) << 1;
-                v |= (img(r+R,c+R) > img(r+R,c-R)) << 2;
-                v |= (img(r+R,c-R) > img(r-R,c-R)) << 3;
-                feature(r,c) = v;
-            }
-        }
-        fI = feature;
-        return 16;
+        const int yx[] = {
+            -R,-R,  -R, R,
+            -R, R,   R, R,
+             R, R,   R,-R,
+             R,-R,  -R,-R
+        };
+        return LbpKernel(R, 4, yx);
+    }
+
+    int operator() (const Mat &I, Mat &fI) const
+    {
+        LbpKernel k = kernel();
+        k.image(I, fI);
+        return k.histSize();
     }
 };
 
@@ -190,26 +426,22 @@ struct FeatureSquareLbp
 //
 struct FeatureMTS
 {
+    LbpKernel kernel() const
+    {
+        static const int yx[] = { // neighbour > center
+            -1, 0,   0,0,
+            -1, 1,   0,0,
+             0, 1,   0,0,
+             1, 1,   0,0
+        };
+        return LbpKernel(1, 4, yx);
+    }
+
     int operator () (const Mat &I, Mat &fI) const
     {
-        Mat_<uchar> img(I);
-        Mat_<uchar> fea(I.size(), 0);
-        const int m=1;
-        for (int r=m; r<img.rows-m; r++)
-        {
-            for (int c=m; c<img.cols-m; c++)
-            {
-                uchar v = 0;
-                uchar cen = img(r,c);
-                v |= (img(r-1,c  ) > cen) << 0;
-                v |= (img(r-1,c+1) > cen) << 1;
-                v |= (img(r  ,c+1) > cen) << 2;
-                v |= (img(r+1,c+1) > cen) << 3;
-                fea(r,c) = v;
-            }
-        }
-        fI = fea;
-        return 16;
+        LbpKernel k = kernel();
+        k.image(I, fI);
+        return k.histSize();
     }
 };
 
@@ -219,29 +451,26 @@ struct FeatureMTS
 //
 struct FeatureBGC1
 {
+    LbpKernel kernel() const
+    {
+        static const int yx[] = {
+            -1, 0,  -1,-1,
+            -1, 1,  -1, 0,
+             0, 1,  -1, 1,
+             1, 1,   0, 1,
+             1, 0,   1, 1,
+             1,-1,   1, 0,
+             0,-1,   1,-1,
+            -1,-1,   0,-1
+        };
+        return LbpKernel(1, 8, yx);
+    }
+
     int operator () (const Mat &I, Mat &fI) const
     {
-        Mat_<uchar> feature(I.size(),0);
-        Mat_<uchar> img(I);
-        const int m=1;
-        for (int r=m; r<img.rows-m; r++)
-        {
-            for (int c=m; c<img.cols-m; c++)
-            {
-                uchar v = 0;
-                v |= (img(r-1,c  ) > img(r-1,c-1)) << 0;
-                v |= (img(r-1,c+1) > img(r-1,c  )) << 1;
-                v |= (img(r  ,c+1) > img(r-1,c+1)) << 2;
-                v |= (img(r+1,c+1) > img(r  ,c+1)) << 3;
-                v |= (img(r+1,c  ) > img(r+1,c+1)) << 4;
-                v |= (img(r+1,c-1) > img(r+1,c  )) << 5;
-                v |= (img(r  ,c-1) > img(r+1,c-1)) << 6;
-                v |= (img(r-1,c-1) > img(r  ,c-1)) << 7;
-                feature(r,c) = v;
-            }
-        }
-        fI = feature;
-        return 256;
+        LbpKernel k = kernel();
+        k.image(I, fI);
+        return k.histSize();
     }
 };
 
@@ -251,31 +480,30 @@ struct FeatureBGC1
 // Wolf, Hassner, Taigman : "Descriptor Based Methods in the Wild"
 // 3.1 Three-Patch LBP Codes
 //
+//    (I(c)-I(a)) > (I(c)-I(b)), so the center cancels out, and it's just I(b) > I(a)
+//
 struct FeatureTPLbp
 {
+    LbpKernel kernel() const
+    {
+        static const int yx[] = {
+            -2, 0,   0,-2,
+            -1, 1,  -1,-1,
+             0, 2,  -2, 0,
+             1, 1,  -1, 1,
+             1, 0,   0, 2,
+             1,-1,   1, 1,
+             0,-2,   1, 0,
+            -1,-1,   1,-1
+        };
+        return LbpKernel(2, 8, yx);
+    }
+
     int operator () (const Mat &img, Mat &features) const
     {
-        Mat_<uchar> I(img);
-        Mat_<uchar> fI(I.size(), 0);
-        const int R=2;
-        for (int r=R; r<I.rows-R; r++)
-        {
-            for (int c=R; c<I.cols-R; c++)
-            {
-                uchar v = 0;
-                v |= ((I(r,c) - I(r  ,c-2)) > (I(r,c) - I(r-2,c  ))) * 1;
-                v |= ((I(r,c) - I(r-1,c-1)) > (I(r,c) - I(r-1,c+1))) * 2;
-                v |= ((I(r,c) - I(r-2,c  )) > (I(r,c) - I(r  ,c+2))) * 4;
-                v |= ((I(r,c) - I(r-1,c+1)) > (I(r,c) - I(r+1,c+1))) * 8;
-                v |= ((I(r,c) - I(r  ,c+2)) > (I(r,c) - I(r+1,c  ))) * 16;
-                v |= ((I(r,c) - I(r+1,c+1)) > (I(r,c) - I(r+1,c-1))) * 32;
-                v |= ((I(r,c) - I(r+1,c  )) > (I(r,c) - I(r  ,c-2))) * 64;
-                v |= ((I(r,c) - I(r+1,c-1)) > (I(r,c) - I(r-1,c-1))) * 128;
-                fI(r,c) = v;
-            }
-        }
-        features = fI;
-        return 256;
+        LbpKernel k = kernel();
+        k.image(img, features);
+        return k.histSize();
     }
 };
 
@@ -290,25 +518,23 @@ struct FeatureFPLbp
     int radius;
     FeatureFPLbp(int r=2) : radius(r) {}
 
-    int operator () (const Mat &img, Mat &features) const
+    LbpKernel kernel() const
     {
-        Mat_<uchar> I(img);
-        Mat_<uchar> fI(I.size(), 0);
         const int R=radius;
-        for (int r=R; r<I.rows-R; r++)
-        {
-            for (int c=R; c<I.cols-R; c++)
-            {
-                uchar v = 0;
-                v |= ((I(r  ,c+1) - I(r+R,c+R)) > (I(r  ,c-1) - I(r-R,c-R))) * 1;
-                v |= ((I(r+1,c+1) - I(r+R,c  )) > (I(r-1,c-1) - I(r-R,c  ))) * 2;
-                v |= ((I(r+1,c  ) - I(r+R,c-R)) > (I(r-1,c  ) - I(r-R,c+R))) * 4;
-                v |= ((I(r+1,c-1) - I(r  ,c-R)) > (I(r-1,c+1) - I(r  ,c+R))) * 8;
-                fI(r,c) = v;
-            }
-        }
-        features = fI;
-        return 16;
+        const int yx[] = {
+             0, 1,   R, R,   0,-1,  -R,-R,
+             1, 1,   R, 0,  -1,-1,  -R, 0,
+             1, 0,   R,-R,  -1, 0,  -R, R,
+             1,-1,   0,-R,  -1, 1,   0, R
+        };
+        return LbpKernel(R, 4, yx, true);
+    }
+
+    int operator () (const Mat &img, Mat &features) const
+    {
+        LbpKernel k = kernel();
+        k.image(img, features);
+        return k.histSize();
     }
 };
 
@@ -431,51 +657,57 @@ struct LQPDisk
 
 
 
-static void hist_patch(const Mat_<uchar> &fI, Mat &histo, int histSize=256)
+//
+// the well known original uniform2 pattern
+//
+static const int uniform_lut[256] =
 {
-    Mat_<float> h(1, histSize, 0.0f);
-    for (int i=0; i<fI.rows; i++)
-    {
-        for (int j=0; j<fI.cols; j++)
-        {
-            int v = int(fI(i,j));
-            h( v ) += 1.0f;
-        }
-    }
-    histo.push_back(h.reshape(1,1));
+    0,1,2,3,4,58,5,6,7,58,58,58,8,58,9,10,11,58,58,58,58,58,58,58,12,58,58,58,13,58,
+    14,15,16,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,17,58,58,58,58,58,58,58,18,
+    58,58,58,19,58,20,21,22,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,
+    58,58,58,58,58,58,58,58,58,58,58,58,23,58,58,58,58,58,58,58,58,58,58,58,58,58,
+    58,58,24,58,58,58,58,58,58,58,25,58,58,58,26,58,27,28,29,30,58,31,58,58,58,32,58,
+    58,58,58,58,58,58,33,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,34,58,58,58,58,
+    58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,
+    58,35,36,37,58,38,58,58,58,39,58,58,58,58,58,58,58,40,58,58,58,58,58,58,58,58,58,
+    58,58,58,58,58,58,41,42,43,58,44,58,58,58,45,58,58,58,58,58,58,58,46,47,48,58,49,
+    58,58,58,50,51,52,58,53,54,55,56,57
+};
+
+//
+// code -> bin lookup for the grid histograms below, returns the bin count
+//
+static int hist_lut(bool uniform, int histSize, int *lut)
+{
+    bool uni = uniform && histSize==256;
+    for (int v=0; v<256; v++)
+        lut[v] = uni ? uniform_lut[v] : v;
+    return uni ? 60 : histSize;
 }
 
 
 //
-// uniform 8bit lookup
+// row sources for the grids below:
+//   either rows of an existing code image, or rows straight from an LbpKernel.
 //
-static void hist_patch_uniform(const Mat_<uchar> &fI, Mat &histo)
+struct CodeRows
 {
-    static int uniform[256] =
-    {   // the well known original uniform2 pattern
-        0,1,2,3,4,58,5,6,7,58,58,58,8,58,9,10,11,58,58,58,58,58,58,58,12,58,58,58,13,58,
-        14,15,16,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,17,58,58,58,58,58,58,58,18,
-        58,58,58,19,58,20,21,22,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,
-        58,58,58,58,58,58,58,58,58,58,58,58,23,58,58,58,58,58,58,58,58,58,58,58,58,58,
-        58,58,24,58,58,58,58,58,58,58,25,58,58,58,26,58,27,28,29,30,58,31,58,58,58,32,58,
-        58,58,58,58,58,58,33,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,34,58,58,58,58,
-        58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,58,
-        58,35,36,37,58,38,58,58,58,39,58,58,58,58,58,58,58,40,58,58,58,58,58,58,58,58,58,
-        58,58,58,58,58,58,41,42,43,58,44,58,58,58,45,58,58,58,58,58,58,58,46,47,48,58,49,
-        58,58,58,50,51,52,58,53,54,55,56,57
-    };
+    Mat_<uchar> codes;
+    CodeRows(const Mat &feature) : codes(feature) {}
 
-    Mat_<float> h(1, 60, 0.0f); // mod4
-    for (int i=0; i<fI.rows; i++)
-    {
-        for (int j=0; j<fI.cols; j++)
-        {
-            int v = int(fI(i,j));
-            h( uniform[v] ) += 1.0f;
-        }
-    }
-    histo.push_back(h.reshape(1,1));
-}
+    Size size() const { return codes.size(); }
+    const uchar *operator()(int r, uchar *) const { return codes[r]; }
+};
+
+struct KernelRows
+{
+    const LbpKernel &kernel;
+    Mat_<uchar> img;
+    KernelRows(const LbpKernel &kernel, const Mat &I) : kernel(kernel), img(I) {}
+
+    Size size() const { return img.size(); }
+    const uchar *operator()(int r, uchar *buf) const { kernel.row(img, r, buf); return buf; }
+};
 
 
 //
@@ -492,23 +724,144 @@ struct GriddedHist
         , GRIDY(gridy)
     {}
 
+    // output length for a given code range
+    int length(int histSize) const
+    {
+        int lut[256];
+        return GRIDX * GRIDY * hist_lut(uniform, histSize, lut);
+    }
+
+    //
+    // each row of codes gets binned right after it was fetched.
+    //   no per-cell allocations, and just one float conversion at the end.
+    //   (if histo already has the right size and type, it gets written in place)
+    //
+    template <typename Rows>
+    void binned(const Rows &rows, int histSize, Mat &histo) const
+    {
+        Size siz = rows.size();
+        int lut[256];
+        int nbins = hist_lut(uniform, histSize, lut);
+        int sw = siz.width/GRIDX;
+        int sh = siz.height/GRIDY;
+
+        // cell offset per column, cells are ordered column-major
+        AutoBuffer<int> _off(siz.width+1);
+        int *off = _off;
+        for (int c=0; c<GRIDX*sw; c++)
+            off[c] = (c/sw) * GRIDY * nbins;
+
+        Mat_<int> counts(1, GRIDX*GRIDY*nbins, 0);
+        AutoBuffer<uchar> _buf(siz.width+1);
+        uchar *buf = _buf;
+        for (int r=0; r<GRIDY*sh; r++)
+        {
+            const uchar *codes = rows(r, buf);
+            int *h = counts[0] + (r/sh) * nbins;
+            for (int c=0; c<GRIDX*sw; c++)
+                h[off[c] + lut[codes[c]]] ++;
+        }
+        counts.convertTo(histo, CV_32F);
+        normalize(histo, histo);
+    }
+
     void hist(const Mat &feature, Mat &histo, int histSize=256) const
     {
-        histo.release();
-        int sw = feature.cols/GRIDX;
-        int sh = feature.rows/GRIDY;
-        for (int i=0; i<GRIDX; i++)
+        binned(CodeRows(feature), histSize, histo);
+    }
+
+    //
+    // fused version, without ever materializing the code image.
+    //
+    void hist(const LbpKernel &kernel, const Mat &I, Mat &histo) const
+    {
+        binned(KernelRows(kernel, I), kernel.histSize(), histo);
+    }
+};
+
+
+//
+// integral histogram on a lattice of cell boundaries.
+//   every pixel gets counted once (into the lattice cell it falls into),
+//   after integrate(), the histogram of any rectangle on the lattice
+//   costs 4 lookups per bin, no matter how large it is, or how many
+//   other (overlapping) rectangles get queried.
+//
+struct IntegralHist
+{
+    int nbins;
+    vector<int> xs, ys;     // lattice lines, sorted
+    vector<int> xid, yid;   // pixel coord -> index of the lattice line there (or -1)
+    vector<int> xoff, ycell;// pixel coord -> lattice cell (x premultiplied by nbins)
+    Mat_<int> sums;         // sums(a, b*nbins+k) : count of bin k in [0,xs[b]) x [0,ys[a])
+
+    IntegralHist(int nbins, const vector<int> &xlines, const vector<int> &ylines, Size siz)
+        : nbins(nbins)
+    {
+        lattice(xlines, siz.width,  xs, xid, xoff);
+        lattice(ylines, siz.height, ys, yid, ycell);
+        for (size_t c=0; c<xoff.size(); c++)
+            xoff[c] = (xoff[c] + 1) * nbins;
+        sums = Mat_<int>(int(ys.size()), int(xs.size())*nbins, 0);
+    }
+
+    static void lattice(vector<int> lines, int n, vector<int> &pos, vector<int> &id, vector<int> &cell)
+    {
+        lines.push_back(0);
+        std::sort(lines.begin(), lines.end());
+        lines.erase(std::unique(lines.begin(), lines.end()), lines.end());
+        pos = lines;
+        id.assign(n+1, -1);
+        for (size_t i=0; i<pos.size(); i++)
+            id[pos[i]] = int(i);
+        cell.resize(pos.back());
+        for (int c=0, k=0; c<pos.back(); c++)
         {
-            for (int j=0; j<GRIDY; j++)
-            {
-                Mat patch(feature, Range(j*sh,(j+1)*sh), Range(i*sw,(i+1)*sw));
-                if (uniform && histSize==256)
-                    hist_patch_uniform(patch, histo);
-                else
-                    hist_patch(patch, histo, histSize);
-            }
+            while (c >= pos[k+1]) k++;
+            cell[c] = k;
         }
-        normalize(histo.reshape(1,1),histo);
+    }
+
+    // rows at or below this one do not take part
+    int rows() const { return ys.back(); }
+
+    // count one row of codes (before integrate())
+    void add(int r, const uchar *codes, const int *lut)
+    {
+        if (r >= rows())
+            return;
+        int *s = sums[ycell[r] + 1];
+        for (int c=0; c<int(xoff.size()); c++)
+            s[xoff[c] + lut[codes[c]]] ++;
+    }
+
+    void integrate()
+    {
+        int nx = int(xs.size());
+        for (int a=1; a<sums.rows; a++)
+        {
+            int *s = sums[a];
+            for (int j=2*nbins; j<nx*nbins; j++)
+                s[j] += s[j-nbins];
+        }
+        for (int a=2; a<sums.rows; a++)
+        {
+            int *s = sums[a];
+            const int *p = sums[a-1];
+            for (int j=0; j<nx*nbins; j++)
+                s[j] += p[j];
+        }
+    }
+
+    // histogram of [x0,x1) x [y0,y1), all on lattice lines
+    void rect(int x0, int y0, int x1, int y1, float *h) const
+    {
+        CV_DbgAssert(xid[x0]>=0 && xid[x1]>=0 && yid[y0]>=0 && yid[y1]>=0);
+        int b0 = xid[x0] * nbins, b1 = xid[x1] * nbins;
+        const int *s0 = sums[yid[y0]];
+        const int *s1 = sums[yid[y1]];
+        for (int k=0; k<nbins; k++)
+            h[k] = float(s1[b1+k] - s1[b0+k] - s0[b1+k] + s0[b0+k]);
     }
 };
 
@@ -517,69 +870,253 @@ struct GriddedHist
 // overlapped pyramid of histogram patches
 //  (not resizing the feature/image)
 //
+//  the code image gets scanned only once, either counting each pixel into
+//  one cell per level, or, for large images, into a single integral histogram
+//  shared by all levels, see useIntegral().
+//
 struct PyramidGrid
 {
     bool uniform;
 
     PyramidGrid(bool uniform=false): uniform(uniform) {}
 
-    void hist_level(const Mat &feature, Mat &histo, int GRIDX, int GRIDY, int histSize=256) const
+    static int nlevels() { return 4; }
+    static int level(int i) { static const int levels[] = {5,6,7,8}; return levels[i]; }
+
+    void lattice(Size siz, vector<int> &xl, vector<int> &yl) const
     {
-        int sw = feature.cols/GRIDX;
-        int sh = feature.rows/GRIDY;
-        for (int i=0; i<GRIDX; i++)
+        for (int l=0; l<nlevels(); l++)
         {
-            for (int j=0; j<GRIDY; j++)
+            int G = level(l);
+            for (int i=0; i<=G; i++)
             {
-                Mat patch(feature, Range(j*sh,(j+1)*sh), Range(i*sw,(i+1)*sw));
-                if (uniform && histSize==256)
-                    hist_patch_uniform(patch, histo);
-                else
-                    hist_patch(patch, histo, histSize);
+                xl.push_back(i*(siz.width/G));
+                yl.push_back(i*(siz.height/G));
             }
         }
     }
 
-    void hist(const Mat &feature, Mat &histo, int histSize=256) const
+    // output length for a given code range
+    int length(int histSize) const
     {
-        histo.release();
-        int levels[] = {5,6,7,8};
-        for (int i=0; i<4; i++)
+        int lut[256];
+        int total = 0;
+        for (int l=0; l<nlevels(); l++)
+            total += level(l) * level(l);
+        return total * hist_lut(uniform, histSize, lut);
+    }
+
+    static int distinct(vector<int> v)
+    {
+        v.push_back(0);
+        std::sort(v.begin(), v.end());
+        return int(std::unique(v.begin(), v.end()) - v.begin());
+    }
+
+    //
+    // the integral histogram costs about (lattice cells * bins) to integrate
+    //   and read back, the direct count costs one increment per pixel and level.
+    //   measured (4 levels, single thread):
+    //                    direct   integral
+    //     110x110,  59b    95us     116us
+    //     250x250,  59b   437us     139us
+    //     110x110, 256b   106us     351us
+    //     250x250, 256b   362us     553us
+    //     500x500, 256b  1489us     777us
+    //   so face crops stay on the direct path.
+    //
+    static bool useIntegral(Size siz, int nbins, const vector<int> &xl, const vector<int> &yl)
+    {
+        return double(siz.area()) > double(distinct(xl)) * distinct(yl) * nbins;
+    }
+
+    // one increment per pixel and level
+    template <typename Rows>
+    void direct(const Rows &rows, const int *lut, int nbins, float *histo) const
+    {
+        Size siz = rows.size();
+        int total = 0, maxr = 0, sh[4];
+        AutoBuffer<int> _off(4*siz.width+1);
+        int *off = _off;
+        for (int l=0; l<nlevels(); l++)
+        {
+            int G = level(l);
+            int sw = siz.width/G;
+            sh[l] = siz.height/G;
+            for (int c=0; c<G*sw; c++)
+                off[l*siz.width + c] = total + (c/sw) * G * nbins;
+            total += G*G*nbins;
+            maxr = std::max(maxr, G*sh[l]);
+        }
+
+        Mat_<int> counts(1, total, 0);
+        AutoBuffer<uchar> _buf(siz.width+1);
+        uchar *buf = _buf;
+        for (int r=0; r<maxr; r++)
+        {
+            const uchar *codes = rows(r, buf);
+            for (int l=0; l<nlevels(); l++)
+            {
+                int G = level(l);
+                if (r >= G*sh[l])
+                    continue;
+                int *h = counts[0] + (r/sh[l]) * nbins;
+                const int *o = off + l*siz.width;
+                int n = G*(siz.width/G);
+                for (int c=0; c<n; c++)
+                    h[o[c] + lut[codes[c]]] ++;
+            }
+        }
+        for (int i=0; i<total; i++)
+            histo[i] = float(counts(i));
+    }
+
+    //
+    // count all rows once, then read back each cell of each level.
+    //   (if histo already has the right size and type, it gets written in place)
+    //
+    template <typename Rows>
+    void binned(const Rows &rows, int histSize, Mat &histo) const
+    {
+        Size siz = rows.size();
+        int lut[256];
+        int nbins = hist_lut(uniform, histSize, lut);
+
+        vector<int> xl, yl;
+        lattice(siz, xl, yl);
+        histo.create(1, length(histSize), CV_32F);
+        if (! useIntegral(siz, nbins, xl, yl))
         {
-            hist_level(feature,histo,levels[i],levels[i],histSize);
+            direct(rows, lut, nbins, histo.ptr<float>());
+            normalize(histo, histo);
+            return;
         }
-        normalize(histo.reshape(1,1),histo);
+
+        IntegralHist ih(nbins, xl, yl, siz);
+        AutoBuffer<uchar> _buf(siz.width+1);
+        uchar *buf = _buf;
+        for (int r=0; r<ih.rows(); r++)
+            ih.add(r, rows(r, buf), lut);
+        ih.integrate();
+
+        float *h = histo.ptr<float>();
+        for (int l=0; l<nlevels(); l++)
+        {
+            int G = level(l);
+            int sw = siz.width/G;
+            int sh = siz.height/G;
+            for (int i=0; i<G; i++)
+            {
+                for (int j=0; j<G; j++)
+                {
+                    ih.rect(i*sw, j*sh, (i+1)*sw, (j+1)*sh, h);
+                    h += nbins;
+                }
+            }
+        }
+        normalize(histo, histo);
+    }
+
+    void hist(const Mat &feature, Mat &histo, int histSize=256) const
+    {
+        binned(CodeRows(feature), histSize, histo);
+    }
+
+    //
+    // fused version, see GriddedHist.
+    //
+    void hist(const LbpKernel &kernel, const Mat &I, Mat &histo) const
+    {
+        binned(KernelRows(kernel, I), kernel.histSize(), histo);
+    }
+};
+
+
+
+
+
+//
+//
+// layered base for lbph,
+//  * calc features on the whole image,
+//  * calculate the hist on a set of rectangles
+//    (which could come from a grid, or a Rects, or a keypoint based model).
+//
+template <typename Feature, typename Grid>
+struct GenericExtractor : public TextureFeature::Extractor
+{
+    Feature ext;
+    Grid grid;
+
+    GenericExtractor(const Feature &ext, const Grid &grid)
+        : ext(ext)
+        , grid(grid)
+    {}
+
+    // TextureFeature::Extractor
+    virtual int extract(const Mat &img, Mat &features) const
+    {
+        Mat fI;
+        int histSize = ext(img, fI);
+        grid.hist(fI, features, histSize);
+        return features.total() * features.elemSize();
     }
 };
 
 
+//
+// fused mode for the lbp family: codes get binned row by row,
+//   without ever materializing the code image.
+//   (Feature has to supply an LbpKernel)
+//
+template <typename Feature, typename Grid>
+struct FusedExtractor : public GenericExtractor<Feature,Grid>
+{
+    FusedExtractor(const Feature &ext, const Grid &grid)
+        : GenericExtractor<Feature,Grid>(ext, grid)
+    {}
 
+    // TextureFeature::Extractor
+    virtual int extract(const Mat &img, Mat &features) const
+    {
+        this->grid.hist(this->ext.kernel(), img, features);
+        return features.total() * features.elemSize();
+    }
+};
 
 
 //
+// row source for the grids: quantized orientations, straight from the GradEngine.
+//
+struct GradRows
+{
+    const FeatureGrad &grad;
+    GradEngine *ge;
+    float *ang;
+
+    GradRows(const FeatureGrad &grad, GradEngine *ge, float *ang) : grad(grad), ge(ge), ang(ang) {}
+
+    Size size() const { return ge->src.size(); }
+    const uchar *operator()(int r, uchar *buf) const { grad.row(*ge, r, ang, buf); return buf; }
+};
+
 //
-// layered base for lbph,
-//  * calc features on the whole image,
-//  * calculate the hist on a set of rectangles
-//    (which could come from a grid, or a Rects, or a keypoint based model).
+// fused mode for FeatureGrad, orientations get binned right after they were computed.
 //
-template <typename Feature, typename Grid>
-struct GenericExtractor : public TextureFeature::Extractor
+template <typename Grid>
+struct GradExtractor : public GenericExtractor<FeatureGrad,Grid>
 {
-    Feature ext;
-    Grid grid;
-
-    GenericExtractor(const Feature &ext, const Grid &grid)
-        : ext(ext)
-        , grid(grid)
+    GradExtractor(const FeatureGrad &ext, const Grid &grid)
+        : GenericExtractor<FeatureGrad,Grid>(ext, grid)
     {}
 
     // TextureFeature::Extractor
     virtual int extract(const Mat &img, Mat &features) const
     {
-        Mat fI;
-        int histSize = ext(img, fI);
-        grid.hist(fI, features, histSize);
+        GradEngine ge(img);
+        AutoBuffer<float> _ang(img.cols+1);
+        float *ang = _ang;
+        this->grid.binned(GradRows(this->ext, &ge, ang), this->ext.nsec+1, features);
         return features.total() * features.elemSize();
     }
 };
@@ -589,34 +1126,70 @@ struct GenericExtractor : public TextureFeature::Extractor
 // instead of adding more bits, concatenate several histograms,
 // cslbp + dialbp + sqlbp = 3*16 bins = 12288 feature-bytes.
 //
+// six lbp operators in a row:
+//   all code planes get computed in a single pass over the image
+//   (their neighbourhoods overlap, so the rows are still in cache),
+//   then each plane gets binned on its own thread,
+//   straight into its slice of the (preallocated) output row.
+//
 template <typename Grid>
 struct CombinedExtractor : public TextureFeature::Extractor
 {
     Grid grid;
+    vector<LbpKernel> kernels;
 
     CombinedExtractor(const Grid &grid)
         : grid(grid)
-    {}
-
-    template <class Extract>
-    void extract(const Mat &img, Mat &features, int r) const
     {
-        Extract ext(r);
-        Mat f,fI;
-        int histSize = ext(img, f);
-        grid.hist(f, fI, histSize);
-        features.push_back(fI.reshape(1,1));
+        kernels.push_back(FeatureCsLbp(2).kernel());
+        kernels.push_back(FeatureCsLbp(4).kernel());
+        kernels.push_back(FeatureFPLbp(2).kernel());
+        kernels.push_back(FeatureFPLbp(4).kernel());
+        kernels.push_back(FeatureDiamondLbp(3).kernel());
+        kernels.push_back(FeatureSquareLbp(4).kernel());
     }
+
+    struct ParallelHist : public ParallelLoopBody
+    {
+        const CombinedExtractor &comb;
+        const vector<Mat> &planes;
+        const vector<int> &offsets;
+        Mat &features;
+
+        ParallelHist(const CombinedExtractor &comb, const vector<Mat> &planes, const vector<int> &offsets, Mat &features)
+            : comb(comb), planes(planes), offsets(offsets), features(features)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int k=range.start; k<range.end; k++)
+            {
+                Mat slice = features.colRange(offsets[k], offsets[k+1]);
+                comb.grid.hist(planes[k], slice, comb.kernels[k].histSize());
+            }
+        }
+    };
+
     // TextureFeature::Extractor
-    virtual int extract(const Mat &img, Mat &features) const
+    virtual int extract(const Mat &I, Mat &features) const
     {
-        extract<FeatureCsLbp>(img,features,2);
-        extract<FeatureCsLbp>(img,features,4);
-        extract<FeatureFPLbp>(img,features,2);
-        extract<FeatureFPLbp>(img,features,4);
-        extract<FeatureDiamondLbp>(img,features,3);
-        extract<FeatureSquareLbp>(img,features,4);
-        features = features.reshape(1,1);
+        Mat_<uchar> img(I);
+        int n = int(kernels.size());
+        vector<Mat> planes(n);
+        vector<int> offsets(n+1, 0);
+        for (int k=0; k<n; k++)
+        {
+            planes[k].create(img.size(), CV_8U);
+            offsets[k+1] = offsets[k] + grid.length(kernels[k].histSize());
+        }
+        for (int r=0; r<img.rows; r++)
+        {
+            for (int k=0; k<n; k++)
+                kernels[k].row(img, r, planes[k].ptr(r));
+        }
+
+        features.create(1, offsets[n], CV_32F);
+        parallel_for_(Range(0, n), ParallelHist(*this, planes, offsets, features));
         return features.total() * features.elemSize();
     }
 };
@@ -637,26 +1210,38 @@ struct GradMagExtractor : public TextureFeature::Extractor
     // TextureFeature::Extractor
     virtual int extract(const Mat &I, Mat &features) const
     {
-        Mat fgrad, fmag;
-        Mat s1, s2, s3(I.size(), CV_32F), s4(I.size(), CV_32F);
-        Sobel(I, s1, CV_32F, 1, 0);
-        Sobel(I, s2, CV_32F, 0, 1);
-
-        hal::fastAtan2(s1.ptr<float>(0), s2.ptr<float>(0), s3.ptr<float>(0), I.total(), true);
-        fgrad = s3 / (360/nbins);
-        fgrad.convertTo(fgrad,CV_8U);
-        Mat fg;
-        grid.hist(fgrad,fg,nbins+1);
-        features.push_back(fg.reshape(1,1));
-
-        hal::magnitude(s1.ptr<float>(0), s2.ptr<float>(0), s4.ptr<float>(0), I.total());
-        normalize(s4,fmag);
-        fmag.convertTo(fmag,CV_8U,nbins);
-        Mat fm;
-        grid.hist(fmag,fm,nbins+1);
-        features.push_back(fm.reshape(1,1));
+        // pass 1: orientation codes, raw magnitude and its l2 norm
+        GradEngine ge(I);
+        AutoBuffer<float> _ang(I.cols+1);
+        float *ang = _ang;
+        FeatureGrad grad(nbins);
+        Mat_<uchar> fgrad(I.size());
+        Mat_<float> mag(I.size());
+        double sumsq = 0;
+        for (int r=0; r<I.rows; r++)
+        {
+            ge.row(r, ang, mag[r]);
+            float s = grad.step();
+            uchar *g = fgrad[r];
+            const float *m = mag[r];
+            for (int c=0; c<I.cols; c++)
+            {
+                g[c] = saturate_cast<uchar>(ang[c] / s);
+                sumsq += m[c] * m[c];
+            }
+        }
 
-        features = features.reshape(1,1);
+        // pass 2: normalized magnitude, quantized to nbins
+        Mat fmag;
+        double norm = std::sqrt(sumsq);
+        mag.convertTo(fmag, CV_8U, norm > DBL_EPSILON ? nbins/norm : 0);
+
+        int len = grid.length(nbins+1);
+        features.create(1, 2*len, CV_32F);
+        Mat fg = features.colRange(0, len);
+        Mat fm = features.colRange(len, 2*len);
+        grid.hist(fgrad, fg, nbins+1);
+        grid.hist(fmag, fm, nbins+1);
         return features.total() * features.elemSize();
     }
 };
@@ -669,65 +1254,256 @@ struct ExtractorGradBin : public TextureFeature::Extractor
     int nsec,nrad,grid;
     ExtractorGradBin(int nsec=8, int nrad=2, int grid=18) : nsec(nsec), nrad(nrad), grid(grid) {}
 
-    virtual int extract(const Mat &I, Mat &features) const
-    {
-        Mat s1, s2, s3(I.size(), CV_32F), s4(I.size(), CV_32F), s5;
-        Sobel(I, s1, CV_32F, 1, 0);
-        Sobel(I, s2, CV_32F, 0, 1);
-        hal::fastAtan2(s1.ptr<float>(0), s2.ptr<float>(0), s3.ptr<float>(0), I.total(), true);
-        s3 /= (360/nsec);
+    int length() const { return nsec*nrad*grid*grid; }
 
-        hal::magnitude(s1.ptr<float>(0), s2.ptr<float>(0), s4.ptr<float>(0), I.total());
-        normalize(s4, s4, nrad, 0, NORM_MINMAX);
+    // accumulate the histogram of I into h (length() floats)
+    void hist(const Mat &I, float *h) const
+    {
+        // pass 1: orientation sectors, raw magnitude and its range
+        GradEngine ge(I);
+        AutoBuffer<float> _ang(I.cols+1);
+        float *ang = _ang;
+        Mat_<uchar> sec(I.size());
+        Mat_<float> mag(I.size());
+        float step = float(360/nsec);
+        float mmin = FLT_MAX, mmax = 0;
+        for (int r=0; r<I.rows; r++)
+        {
+            ge.row(r, ang, mag[r]);
+            uchar *g = sec[r];
+            const float *m = mag[r];
+            for (int c=0; c<I.cols; c++)
+            {
+                g[c] = uchar(std::min(int(ang[c] / step), nsec-1));
+                mmin = std::min(mmin, m[c]);
+                mmax = std::max(mmax, m[c]);
+            }
+        }
 
-        int sx = I.cols/(grid-2);
-        int sy = I.rows/(grid-2);
+        // pass 2: magnitude rings (minmax scaled to [0,nrad)), binned per cell
+        double range = double(mmax) - mmin;
+        float scale = range > DBL_EPSILON ? float(nrad / range) : 0.0f;
+        int sx = std::max(I.cols/(grid-2), 1);
+        int sy = std::max(I.rows/(grid-2), 1);
         int nbins = nsec*nrad;
-        features = Mat(1,nbins*grid*grid,CV_32F,Scalar(0));
-        for (int i=0; i<I.rows; i++)
+        AutoBuffer<int> _xoff(I.cols+1);
+        int *xoff = _xoff;
+        for (int c=0; c<I.cols; c++)
+            xoff[c] = std::min(c/sx, grid-1) * nbins;
+        for (int r=0; r<I.rows; r++)
         {
-            int oy = i/sy;
-            for (int j=0; j<I.cols; j++)
+            float *hr = h + std::min(r/sy, grid-1) * grid * nbins;
+            const uchar *g = sec[r];
+            const float *m = mag[r];
+            for (int c=0; c<I.cols; c++)
             {
-                int ox = j/sx;
-                int off = nbins*(oy*grid + ox);
-                int g = (int)s3.at<float>(i,j);
-                int m = (int)s4.at<float>(i,j);
-                features.at<float>(off + g + m*nsec) ++;
+                int k = std::min(int((m[c] - mmin) * scale), nrad-1);
+                hr[xoff[c] + g[c] + k*nsec] += 1.0f;
             }
         }
+    }
+
+    virtual int extract(const Mat &I, Mat &features) const
+    {
+        features = Mat::zeros(1, length(), CV_32F);
+        hist(I, features.ptr<float>());
         return features.total() * features.elemSize();
     }
 };
 
 
+//
+// gabor filter bank, all kernels get built once, at construction.
+//   each of them picks its own way of filtering:
+//     SEPARABLE: the svd of the kernel says, rank 1 or 2 is enough (2 or 4 1d passes)
+//     SPECTRAL : large kernels get multiplied in the dft domain,
+//                all of them share one forward transform of the (border extended) image
+//     DIRECT   : small kernels just run through filter2D
+//   all results are the same as filter2D would give (correlation, reflect101 border).
+//
+struct GaborBank
+{
+    enum Mode { DIRECT, SEPARABLE, SPECTRAL };
+
+    struct Filter
+    {
+        Mode mode;
+        Mat kernel;             // CV_32F
+        vector<Mat> kx, ky;     // rank-r factors (SEPARABLE)
+    };
+    vector<Filter> filters;
+    int bx, by;                 // common border for SPECTRAL
+
+    // kernel spectra, cached for the last dft size
+    mutable Mutex mtx;
+    mutable Size specSize;
+    mutable vector<Mat> spectra;
+
+    GaborBank() : bx(0), by(0) {}
+
+    void add(Size ksize, double sigma, double theta, double lambda, double gamma, double psi)
+    {
+        Filter f;
+        Mat K = getGaborKernel(ksize, sigma, theta, lambda, gamma, psi, CV_64F);
+        K.convertTo(f.kernel, CV_32F);
+
+        SVD svd(K);
+        double total = sum(svd.w.mul(svd.w))[0];
+        double resid = total;
+        int rank = 0;
+        for (int r=0; r<2 && r<svd.w.rows; r++)
+        {
+            double w = svd.w.at<double>(r);
+            resid -= w*w;
+            if (resid <= 1e-6 * total && 2*(r+1)*(K.rows+K.cols) < K.rows*K.cols)
+            {
+                rank = r+1;
+                break;
+            }
+        }
+
+        if (rank > 0)
+        {
+            f.mode = SEPARABLE;
+            for (int r=0; r<rank; r++)
+            {
+                double w = std::sqrt(svd.w.at<double>(r));
+                Mat x, y;
+                Mat(svd.vt.row(r) * w).convertTo(x, CV_32F);
+                Mat(svd.u.col(r) * w).convertTo(y, CV_32F);
+                f.kx.push_back(x);
+                f.ky.push_back(y);
+            }
+        }
+        else if (K.cols >= 11 || K.rows >= 11)
+        {
+            f.mode = SPECTRAL;
+            bx = std::max(bx, K.cols/2);
+            by = std::max(by, K.rows/2);
+        }
+        else
+        {
+            f.mode = DIRECT;
+        }
+        filters.push_back(f);
+
+        AutoLock lock(mtx);
+        specSize = Size();
+    }
+
+    // spectrum of filter i, placed so it lines up with the common border
+    Mat spectrum(int i, Size dsz) const
+    {
+        AutoLock lock(mtx);
+        if (dsz != specSize)
+        {
+            spectra.assign(filters.size(), Mat());
+            specSize = dsz;
+        }
+        if (spectra[i].empty())
+        {
+            const Mat &k = filters[i].kernel;
+            int ox = bx - k.cols/2;
+            int oy = by - k.rows/2;
+            Mat K = Mat::zeros(dsz, CV_32F);
+            k.copyTo(K(Rect(ox, oy, k.cols, k.rows)));
+            dft(K, spectra[i], 0, oy + k.rows);
+        }
+        return spectra[i];
+    }
+
+    // forward transform of the border extended image
+    void forward(const Mat &src, Mat &F) const
+    {
+        Mat padded;
+        copyMakeBorder(src, padded, by, by, bx, bx, BORDER_REFLECT_101);
+        Size dsz(getOptimalDFTSize(padded.cols), getOptimalDFTSize(padded.rows));
+        Mat P = Mat::zeros(dsz, CV_32F);
+        padded.copyTo(P(Rect(0, 0, padded.cols, padded.rows)));
+        dft(P, F, 0, padded.rows);
+    }
+
+    // one CV_32F response per filter, src has to be CV_32F
+    void apply(const Mat &src, vector<Mat> &dst) const
+    {
+        dst.resize(filters.size());
+        Mat F;
+        for (size_t i=0; i<filters.size(); i++)
+        {
+            const Filter &f = filters[i];
+            switch (f.mode)
+            {
+                case SEPARABLE:
+                {
+                    sepFilter2D(src, dst[i], CV_32F, f.kx[0], f.ky[0]);
+                    for (size_t r=1; r<f.kx.size(); r++)
+                    {
+                        Mat t;
+                        sepFilter2D(src, t, CV_32F, f.kx[r], f.ky[r]);
+                        dst[i] += t;
+                    }
+                    break;
+                }
+                case SPECTRAL:
+                {
+                    if (F.empty())
+                        forward(src, F);
+                    Mat prod, full;
+                    mulSpectrums(F, spectrum(int(i), F.size()), prod, 0, true);
+                    dft(prod, full, DFT_INVERSE | DFT_SCALE | DFT_REAL_OUTPUT, src.rows);
+                    full(Rect(0, 0, src.cols, src.rows)).copyTo(dst[i]);
+                    break;
+                }
+                default:
+                    filter2D(src, dst[i], CV_32F, f.kernel);
+                    break;
+            }
+        }
+    }
+};
+
+
 struct ExtractorGaborGradBin : public ExtractorGradBin
 {
-    Size kernel_size;
+    GaborBank bank;
 
     ExtractorGaborGradBin(int nsec=8, int nrad=2, int grid=12, int kernel_siz=9)
         : ExtractorGradBin(nsec, nrad, grid)
-        , kernel_size(kernel_siz, kernel_siz)
-    {}
-
-    void gabor(const Mat &src_f, Mat &features,double sigma, double theta, double lambda, double gamma, double psi) const
     {
-        Mat dest,dest8u,his;
-        cv::filter2D(src_f, dest, CV_32F, getGaborKernel(kernel_size, sigma,theta, lambda, gamma, psi, CV_64F));
-        //dest.convertTo(dest8u, CV_8U);
-        ExtractorGradBin::extract(dest, his);
-        features.push_back(his.reshape(1, 1));
+        Size kernel_size(kernel_siz, kernel_siz);
+        bank.add(kernel_size, 8,4,90,15,0);
+        bank.add(kernel_size, 8,4,45,30,1);
+        bank.add(kernel_size, 8,4,45,45,0);
+        bank.add(kernel_size, 8,4,90,60,1);
     }
 
+    struct ParallelHist : public ParallelLoopBody
+    {
+        const ExtractorGradBin &gb;
+        const vector<Mat> &responses;
+        float *h;
+
+        ParallelHist(const ExtractorGradBin &gb, const vector<Mat> &responses, float *h)
+            : gb(gb), responses(responses), h(h)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int i=range.start; i<range.end; i++)
+                gb.hist(responses[i], h + i*gb.length());
+        }
+    };
+
     virtual int extract(const Mat &img, Mat &features) const
     {
         Mat src_f;
         img.convertTo(src_f, CV_32F, 1.0/255.0);
-        gabor(src_f, features, 8,4,90,15,0);
-        gabor(src_f, features, 8,4,45,30,1);
-        gabor(src_f, features, 8,4,45,45,0);
-        gabor(src_f, features, 8,4,90,60,1);
-        features = features.reshape(1,1);
+        vector<Mat> responses;
+        bank.apply(src_f, responses);
+
+        int n = int(responses.size());
+        features = Mat::zeros(1, n*length(), CV_32F);
+        parallel_for_(Range(0, n), ParallelHist(*this, responses, features.ptr<float>()));
         return features.total() * features.elemSize();
     }
 };
@@ -798,116 +1574,354 @@ struct Patcher : public TextureFeature::Extractor
 //    and Its Application to Face Recognition"
 //    Bor-Chun Chen, Chu-Song Chen, Winston Hsu
 //
-struct HighDimLbp : public TextureFeature::Extractor
+// shared engine for the high-dim lbp extractors below:
+//   the code pyramid gets built once per image, patches are integer aligned views
+//   into it (clamped at the border, like getRectSubPix does), and all histograms
+//   go straight into one preallocated block, in parallel across landmarks.
+//
+struct HighDimLbpEngine
 {
+    enum { NSCALES=5, NOFF=16, GR=10 }; // 10 used in paper
+
     FeatureFPLbp lbp;
     Ptr<Landmarks> land;
-    HighDimLbp() : land(createLandmarks()) {}
-    virtual int extract(const Mat &img, Mat &features) const
-    {
-        int gr=10; // 10 used in paper
-        vector<Point> kp;
-        land->extract(img,kp);
 
-        Mat histo;
-        float scale[] = {0.75f, 1.06f, 1.5f, 2.2f, 3.0f}; // http://bcsiriuschen.github.io/High-Dimensional-LBP/
-        float offsets_16[] = {
+    HighDimLbpEngine() : land(createLandmarks()) {}
+
+    int histSize() const { return lbp.kernel().histSize(); }
+
+    static float scale(int i)
+    {
+        static const float s[] = {0.75f, 1.06f, 1.5f, 2.2f, 3.0f}; // http://bcsiriuschen.github.io/High-Dimensional-LBP/
+        return s[i];
+    }
+    static const float *offset(int o)
+    {
+        static const float offsets_16[] = {
             -1.5f,-1.5f, -0.5f,-1.5f, 0.5f,-1.5f, 1.5f,-1.5f,
             -1.5f,-0.5f, -0.5f,-0.5f, 0.5f,-0.5f, 1.5f,-0.5f,
             -1.5f, 0.5f, -0.5f, 0.5f, 0.5f, 0.5f, 1.5f, 0.5f,
             -1.5f, 1.5f, -0.5f, 1.5f, 0.5f, 1.5f, 1.5f, 1.5f
         };
-        int noff = 16;
-        float *off = offsets_16;
-        for (int i=0; i<5; i++)
+        return offsets_16 + o*2;
+    }
+
+    struct ParallelPatches : public ParallelLoopBody
+    {
+        const Mat *codes;
+        const vector<Point> &kp;
+        bool byLandmark;
+        Mat &block;
+
+        ParallelPatches(const Mat *codes, const vector<Point> &kp, bool byLandmark, Mat &block)
+            : codes(codes), kp(kp), byLandmark(byLandmark), block(block)
+        {}
+
+        static void patch(const Mat_<uchar> &f, int x0, int y0, float *h)
         {
-            float s = scale[i];
-            Mat f1,f2,imgs;
-            resize(img,imgs,Size(),s,s);
-            int histSize = lbp(imgs,f1);
+            int xi[GR];
+            for (int c=0; c<GR; c++)
+                xi[c] = std::min(std::max(x0+c, 0), f.cols-1);
+            for (int r=0; r<GR; r++)
+            {
+                const uchar *p = f[std::min(std::max(y0+r, 0), f.rows-1)];
+                for (int c=0; c<GR; c++)
+                    h[p[xi[c]]] += 1.0f;
+            }
+        }
 
-            for (size_t k=0; k<kp.size(); k++)
+        virtual void operator()(const Range &range) const
+        {
+            int nkp = int(kp.size());
+            for (int k=range.start; k<range.end; k++)
             {
-                Point2f pt(kp[k]);
-                for (int o=0; o<noff; o++)
+                for (int i=0; i<NSCALES; i++)
                 {
-                    Mat patch;
-                    getRectSubPix(f1, Size(gr,gr), Point2f(pt.x*s + off[o*2]*gr, pt.y*s + off[o*2+1]*gr), patch);
-                    hist_patch(patch, histo, histSize);
+                    Mat_<uchar> f(codes[i]);
+                    float s = scale(i);
+                    for (int o=0; o<NOFF; o++)
+                    {
+                        int row = byLandmark ? (k*NSCALES + i)*NOFF + o : (i*nkp + k)*NOFF + o;
+                        float cx = kp[k].x*s + offset(o)[0]*GR;
+                        float cy = kp[k].y*s + offset(o)[1]*GR;
+                        patch(f, cvRound(cx - (GR-1)*0.5f), cvRound(cy - (GR-1)*0.5f), block.ptr<float>(row));
+                    }
                 }
             }
         }
-        normalize(histo.reshape(1,1), features);
+    };
+
+    //
+    // one row of histSize() bins per (scale,landmark,offset) patch,
+    //   ordered by scale first, or by landmark first (byLandmark).
+    //   returns the landmark count.
+    //
+    int extract(const Mat &img, Mat &block, bool byLandmark) const
+    {
+        vector<Point> kp;
+        land->extract(img,kp);
+
+        Mat codes[NSCALES];
+        for (int i=0; i<NSCALES; i++)
+        {
+            Mat imgs;
+            resize(img, imgs, Size(), scale(i), scale(i));
+            lbp(imgs, codes[i]);
+        }
+
+        int nkp = int(kp.size());
+        block = Mat::zeros(nkp*NSCALES*NOFF, histSize(), CV_32F);
+        parallel_for_(Range(0, nkp), ParallelPatches(codes, kp, byLandmark, block));
+        return nkp;
+    }
+};
+
+
+struct HighDimLbp : public TextureFeature::Extractor
+{
+    HighDimLbpEngine hd;
+
+    virtual int extract(const Mat &img, Mat &features) const
+    {
+        Mat block;
+        hd.extract(img, block, false);
+        normalize(block.reshape(1,1), features);
         return features.total() * features.elemSize();
     }
 };
 
+//
+// all 20 eigenbases get stacked into one float block (loaded once),
+//   with the mean projection (E*m) folded into a bias row,
+//   so a whole batch of faces is projected with one gemm per landmark.
+//   the optional int8 basis (one scale per eigenvector) cuts the memory traffic by 4,
+//   the fp16 one by 2 (CV_16U halfs, see half.h), both get projected against directly,
+//   without a float copy.
+//
 struct HighDimLbpPCA : public TextureFeature::Extractor
 {
-    Ptr<Landmarks> land;
-    FeatureFPLbp lbp;
-    //FeatureLbp lbp;
-    PCA pca[20];
-
-    HighDimLbpPCA()
-        : land(createLandmarks())
+    enum { NLAND=20 };
+    enum Basis { F32, Q8, F16 };
+
+    HighDimLbpEngine hd;
+    Mat basis;              // (sum of eigen dims) x (landmark histogram length), CV_32F
+    Mat_<schar> qbasis;     // same, int8 quantized (if quantized, basis is empty)
+    Mat_<float> qscale;     // per-row scale for qbasis
+    Mat_<ushort> hbasis;    // same, fp16 (if used, basis is empty)
+    Mat bias;               // 1 x (sum of eigen dims), E*m
+    int offs[NLAND+1];      // first basis row per landmark
+
+    HighDimLbpPCA(int precision=F32)
     {
         FileStorage fs("data/fplbp_pca.xml.gz",FileStorage::READ);
         CV_Assert(fs.isOpened());
         FileNode pnodes = fs["hdlbp"];
+        vector<Mat> b;
         int i=0;
+        offs[0] = 0;
         for (FileNodeIterator it=pnodes.begin(); it!=pnodes.end(); ++it)
         {
-            pca[i++].read(*it);
+            CV_Assert(i<NLAND);
+            PCA pca;
+            pca.read(*it);
+            Mat E, m, bk;
+            pca.eigenvectors.convertTo(E, CV_32F);
+            pca.mean.reshape(1,1).convertTo(m, CV_32F);
+            gemm(m, E, 1, noArray(), 0, bk, GEMM_2_T);
+            basis.push_back(E);
+            b.push_back(bk);
+            offs[i+1] = offs[i] + E.rows;
+            i++;
         }
         fs.release();
+        CV_Assert(i==NLAND);
+        hconcat(b, bias);
+
+        if (precision == F16)
+        {
+            hbasis.create(basis.rows, basis.cols);
+            for (int r=0; r<basis.rows; r++)
+            {
+                const float *e = basis.ptr<float>(r);
+                for (int c=0; c<basis.cols; c++)
+                    hbasis(r,c) = quant::toHalf(e[c]);
+            }
+            basis.release();
+        }
+        if (precision == Q8)
+        {
+            qbasis.create(basis.rows, basis.cols);
+            qscale.create(basis.rows, 1);
+            for (int r=0; r<basis.rows; r++)
+            {
+                const float *e = basis.ptr<float>(r);
+                float m = 0;
+                for (int c=0; c<basis.cols; c++)
+                    m = std::max(m, std::abs(e[c]));
+                float sc = m>0 ? m/127.0f : 1.0f;
+                qscale(r) = sc;
+                for (int c=0; c<basis.cols; c++)
+                    qbasis(r,c) = saturate_cast<schar>(e[c] / sc);
+            }
+            basis.release();
+        }
     }
 
-    virtual int extract(const Mat &img, Mat &features) const
+    // sum(x[c] * q[c])
+    static float dot_q8(const float *x, const schar *q, int n)
     {
-        int gr=10; // 10 used in paper
-        vector<Point> kp;
-        land->extract(img,kp);
-        CV_Assert(kp.size()==20);
-        Mat histo;
-        float scale[] = {0.75f, 1.06f, 1.5f, 2.2f, 3.0f}; // http://bcsiriuschen.github.io/High-Dimensional-LBP/
-        float offsets_16[] = {
-            -1.5f,-1.5f, -0.5f,-1.5f, 0.5f,-1.5f, 1.5f,-1.5f,
-            -1.5f,-0.5f, -0.5f,-0.5f, 0.5f,-0.5f, 1.5f,-0.5f,
-            -1.5f, 0.5f, -0.5f, 0.5f, 0.5f, 0.5f, 1.5f, 0.5f,
-            -1.5f, 1.5f, -0.5f, 1.5f, 0.5f, 1.5f, 1.5f, 1.5f
-        };
-        int noff = 16;
-        float *off = offsets_16;
-        Mat h[20];
-        for (int i=0; i<5; i++)
+        int c = 0;
+        float d = 0;
+#ifdef HAVE_SSE
+        __m128 acc = _mm_setzero_ps();
+        for (; c<=n-4; c+=4)
+        {
+            int w;
+            memcpy(&w, q+c, 4);
+            __m128i v = _mm_cvtsi32_si128(w);
+            v = _mm_unpacklo_epi8(v, v);
+            v = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 24);
+            acc = _mm_add_ps(acc, _mm_mul_ps(_mm_loadu_ps(x+c), _mm_cvtepi32_ps(v)));
+        }
+        float t[4];
+        _mm_storeu_ps(t, acc);
+        d = t[0] + t[1] + t[2] + t[3];
+#endif
+        for (; c<n; c++)
+            d += x[c] * q[c];
+        return d;
+    }
+
+    // y = x * E(k)^T, the basis row stays in cache while all faces go by
+    void projectQ8(const Mat &x, int k, Mat &y) const
+    {
+        int r0 = offs[k], r1 = offs[k+1];
+        y.create(x.rows, r1 - r0, CV_32F);
+        for (int r=r0; r<r1; r++)
+        {
+            const schar *q = qbasis.ptr<schar>(r);
+            float sc = qscale(r);
+            for (int i=0; i<x.rows; i++)
+                y.at<float>(i, r - r0) = sc * dot_q8(x.ptr<float>(i), q, x.cols);
+        }
+    }
+
+    // same, fp16 basis rows
+    void projectF16(const Mat &x, int k, Mat &y) const
+    {
+        int r0 = offs[k], r1 = offs[k+1];
+        y.create(x.rows, r1 - r0, CV_32F);
+        for (int r=r0; r<r1; r++)
+        {
+            const ushort *h = hbasis.ptr<ushort>(r);
+            for (int i=0; i<x.rows; i++)
+                y.at<float>(i, r - r0) = quant::dot(x.ptr<float>(i), h, x.cols);
+        }
+    }
+
+    // landmark histograms of one face, each normalized on its own
+    void histos(const Mat &img, Mat &x) const
+    {
+        Mat block;
+        int nkp = hd.extract(img, block, true);
+        CV_Assert(nkp==NLAND);
+        Mat h = block.reshape(1, NLAND);
+        for (int k=0; k<NLAND; k++)
         {
-            float s = scale[i];
-            Mat f1,f2,imgs;
-            resize(img,imgs,Size(),s,s);
-            int histSize = lbp(imgs,f1);
+            Mat hk = h.row(k);
+            normalize(hk,hk);
+        }
+        h.reshape(1,1).copyTo(x);
+    }
+
+    struct ParallelHistos : public ParallelLoopBody
+    {
+        const HighDimLbpPCA &hp;
+        const vector<Mat> &images;
+        Mat &X;
+
+        ParallelHistos(const HighDimLbpPCA &hp, const vector<Mat> &images, Mat &X)
+            : hp(hp), images(images), X(X)
+        {}
+
+        virtual void operator()(const Range &range) const
+        {
+            for (int i=range.start; i<range.end; i++)
+            {
+                Mat x = X.row(i);
+                hp.histos(images[i], x);
+            }
+        }
+    };
+
+    struct ParallelProject : public ParallelLoopBody
+    {
+        const HighDimLbpPCA &hp;
+        const Mat &X;
+        Mat &Y;
+
+        ParallelProject(const HighDimLbpPCA &hp, const Mat &X, Mat &Y)
+            : hp(hp), X(X), Y(Y)
+        {}
 
-            for (size_t k=0; k<kp.size(); k++)
+        virtual void operator()(const Range &range) const
+        {
+            int n = X.cols / NLAND;
+            for (int k=range.start; k<range.end; k++)
             {
-                Point2f pt(kp[k]);
-                for (int o=0; o<noff; o++)
+                Mat y;
+                if (! hp.qbasis.empty())
+                    hp.projectQ8(X.colRange(k*n, (k+1)*n), k, y);
+                else if (! hp.hbasis.empty())
+                    hp.projectF16(X.colRange(k*n, (k+1)*n), k, y);
+                else
+                    gemm(X.colRange(k*n, (k+1)*n), hp.basis.rowRange(hp.offs[k], hp.offs[k+1]), 1, noArray(), 0, y, GEMM_2_T);
+                const float *b = hp.bias.ptr<float>() + hp.offs[k];
+                for (int i=0; i<y.rows; i++)
                 {
-                    Mat patch;
-                    getRectSubPix(f1, Size(gr,gr), Point2f(pt.x*s + off[o*2]*gr, pt.y*s + off[o*2+1]*gr), patch);
-                    hist_patch(patch, h[k], histSize);
-                    //hist_patch_uniform(patch, h[k], histSize);
+                    const float *a = y.ptr<float>(i);
+                    float *d = Y.ptr<float>(i) + hp.offs[k];
+                    for (int j=0; j<y.cols; j++)
+                        d[j] = a[j] - b[j];
                 }
             }
         }
-        for (size_t k=0; k<kp.size(); k++)
+    };
+
+    // one row of landmark histograms per face in, one row of projections out
+    void project(const Mat &X, Mat &Y) const
+    {
+        Y.create(X.rows, offs[NLAND], CV_32F);
+        parallel_for_(Range(0, NLAND), ParallelProject(*this, X, Y));
+    }
+
+    virtual int extract(const Mat &img, Mat &features) const
+    {
+        Mat x, y;
+        histos(img, x);
+        project(x, y);
+        normalize(y, features);
+        return features.total() * features.elemSize();
+    }
+
+    virtual int extractBatch(const vector<Mat> &images, Mat &rows) const
+    {
+        if (images.empty())
+            return 0;
+
+        Mat x;
+        histos(images[0], x);
+        Mat X(int(images.size()), x.cols, CV_32F);
+        x.copyTo(X.row(0));
+        parallel_for_(Range(1, X.rows), ParallelHistos(*this, images, X));
+
+        project(X, rows);
+        for (int i=0; i<rows.rows; i++)
         {
-            Mat hx = h[k].reshape(1,1);
-            normalize(hx,hx);
-            Mat hy = pca[k].project(hx);
-            histo.push_back(hy);
+            Mat r = rows.row(i);
+            normalize(r, r);
         }
-        normalize(histo.reshape(1,1), features);
-        return features.total() * features.elemSize();
+        return rows.cols * rows.elemSize();
     }
 };
 
@@ -1002,16 +2016,15 @@ struct HighDimGrad : public TextureFeature::Extractor
         land->extract(img, pt);
         CV_Assert(pt.size() == 20);
 
-        Mat histo;
+        int len = grad.length();
+        features = Mat::zeros(1, int(pt.size())*len, CV_32F);
+        float *h = features.ptr<float>();
+        Mat patch;
         for (size_t k=0; k<pt.size(); k++)
         {
-            Mat h;
-            Mat patch;
             getRectSubPix(img, Size(32,32), pt[k], patch);
-            grad.extract(patch, h);
-            histo.push_back(h.reshape(1,1));
+            grad.hist(patch, h + k*len);
         }
-        features = histo.reshape(1,1);
         return features.total() * features.elemSize();
     }
 };
@@ -1028,33 +2041,6 @@ struct ExtractorCDIKP : public TextureFeature::Extractor
 
     ExtractorCDIKP() : land(createLandmarks()) {}
 
-    template<class T>
-    void fast_had(int ndim, int lev, T *in, T *out) const
-    {
-        int h = lev/2;
-        for (int j=0; j<ndim/lev; j++)
-        {
-            for(int i=0; i<h; i++)
-            {
-                out[i]   = in[i] + in[i+h];
-                out[i+h] = in[i] - in[i+h];
-            }
-            out += lev;
-            in  += lev;
-        }
-    }
-    Mat project(Mat &in) const
-    {
-        const int keep = 10;
-        Mat h = in.clone().reshape(1,1);
-        Mat wh(1, h.total(), h.type());
-        for (int lev=in.total(); lev>2; lev/=2)
-        {
-            fast_had(in.total(), lev, h.ptr<float>(), wh.ptr<float>());
-            if (lev>4) cv::swap(h,wh);
-        }
-        return wh(Rect(0,0,keep,1));
-    }
     virtual int extract(const Mat &img, Mat &features) const
     {
         Mat fI;
@@ -1064,17 +2050,22 @@ struct ExtractorCDIKP : public TextureFeature::Extractor
         Sobel(fI,dy,CV_32F,0,1);
         const int ps = 16;
         const float step = 3;
+        const int keep = 10;
+
+        // all patches first, then one batched (pruned) transform
+        Mat patches;
         for (float i=ps/4; i<img.rows-3*ps/4; i+=step)
         {
             for (float j=ps/4; j<img.cols-3*ps/4; j+=step)
             {
                 Mat patch;
                 cv::getRectSubPix(dx,Size(ps,ps),Point2f(j,i),patch);
-                features.push_back(project(patch));
+                patches.push_back(patch.reshape(1,1));
                 cv::getRectSubPix(dy,Size(ps,ps),Point2f(j,i),patch);
-                features.push_back(project(patch));
+                patches.push_back(patch.reshape(1,1));
             }
         }
+        fwhtRows(patches, features, keep);
         features = features.reshape(1,1);
         return features.total() * features.elemSize();
     }
@@ -1196,6 +2187,34 @@ struct ExtractorLatch2 : public TextureFeature::Extractor
 };
 
 
+//
+// default batch extraction, one image per row of a preallocated output
+//
+struct ParallelExtract : public ParallelLoopBody
+{
+    const TextureFeature::Extractor &ext;
+    const vector<Mat> &images;
+    Mat &rows;
+
+    ParallelExtract(const TextureFeature::Extractor &ext, const vector<Mat> &images, Mat &rows)
+        : ext(ext)
+        , images(images)
+        , rows(rows)
+    {}
+
+    virtual void operator()(const Range &range) const
+    {
+        for (int i=range.start; i<range.end; i++)
+        {
+            Mat f;
+            ext.extract(images[i], f);
+            CV_Assert(int(f.total()) == rows.cols && f.type() == rows.type());
+            f.reshape(1,1).copyTo(rows.row(i));
+        }
+    }
+};
+
+
 //struct ExtractorDaisy : public TextureFeature::Extractor
 //{
 //    Ptr<xfeatures2d::DAISY> daisy;
@@ -1230,30 +2249,48 @@ namespace TextureFeature
 {
 using namespace TextureFeatureImpl;
 
+int Extractor::extractBatch(const std::vector<Mat> &images, Mat &rows) const
+{
+    if (images.empty())
+    {
+        rows.release();
+        return 0;
+    }
+    // the first image determines size and type of the output rows
+    Mat f;
+    extract(images[0], f);
+    f = f.reshape(1,1);
+    rows.create(int(images.size()), f.cols, f.type());
+    f.copyTo(rows.row(0));
+
+    parallel_for_(Range(1, int(images.size())), ParallelExtract(*this, images, rows));
+    return rows.cols * int(rows.elemSize());
+}
+
 cv::Ptr<Extractor> createExtractor(int extract)
 {
     switch(int(extract))
     {
         case EXT_Pixels:   return makePtr< ExtractorPixels >(); break;
         case EXT_Ltp:      return makePtr< GenericExtractor<FeatureLTP,GriddedHist> >(FeatureLTP(), GriddedHist()); break;
-        case EXT_Lbp:      return makePtr< GenericExtractor<FeatureLbp,GriddedHist> >(FeatureLbp(), GriddedHist()); break;
-        case EXT_LBP_P:    return makePtr< GenericExtractor<FeatureLbp,PyramidGrid> >(FeatureLbp(), PyramidGrid()); break;
-        case EXT_LBPU:     return makePtr< GenericExtractor<FeatureLbp,GriddedHist> >(FeatureLbp(), GriddedHist(true)); break;
-        case EXT_LBPU_P:   return makePtr< GenericExtractor<FeatureLbp,PyramidGrid> >(FeatureLbp(), PyramidGrid(true)); break;
+        case EXT_Lbp:      return makePtr< FusedExtractor<FeatureLbp,GriddedHist> >(FeatureLbp(), GriddedHist()); break;
+        case EXT_LBP_P:    return makePtr< FusedExtractor<FeatureLbp,PyramidGrid> >(FeatureLbp(), PyramidGrid()); break;
+        case EXT_LBPU:     return makePtr< FusedExtractor<FeatureLbp,GriddedHist> >(FeatureLbp(), GriddedHist(true)); break;
+        case EXT_LBPU_P:   return makePtr< FusedExtractor<FeatureLbp,PyramidGrid> >(FeatureLbp(), PyramidGrid(true)); break;
         case EXT_LQP:      return makePtr< GenericExtractor<LQPDisk,GriddedHist> >(LQPDisk(), GriddedHist()); break;
-        case EXT_TPLbp:    return makePtr< GenericExtractor<FeatureTPLbp,GriddedHist> >(FeatureTPLbp(), GriddedHist()); break;
-        case EXT_TPLBP_P:  return makePtr< GenericExtractor<FeatureTPLbp,PyramidGrid> >(FeatureTPLbp(), PyramidGrid()); break;
-        case EXT_FPLbp:    return makePtr< GenericExtractor<FeatureFPLbp,GriddedHist> >(FeatureFPLbp(), GriddedHist()); break;
-        case EXT_FPLBP_P:  return makePtr< GenericExtractor<FeatureFPLbp,PyramidGrid> >(FeatureFPLbp(), PyramidGrid()); break;
-        case EXT_MTS:      return makePtr< GenericExtractor<FeatureMTS,GriddedHist> >(FeatureMTS(), GriddedHist()); break;
-        case EXT_MTS_P:    return makePtr< GenericExtractor<FeatureMTS,PyramidGrid> >(FeatureMTS(), PyramidGrid()); break;
-        case EXT_BGC1:     return makePtr< GenericExtractor<FeatureBGC1,GriddedHist> >(FeatureBGC1(), GriddedHist()); break;
-        case EXT_BGC1_P:   return makePtr< GenericExtractor<FeatureBGC1,PyramidGrid> >(FeatureBGC1(), PyramidGrid()); break;
+        case EXT_TPLbp:    return makePtr< FusedExtractor<FeatureTPLbp,GriddedHist> >(FeatureTPLbp(), GriddedHist()); break;
+        case EXT_TPLBP_P:  return makePtr< FusedExtractor<FeatureTPLbp,PyramidGrid> >(FeatureTPLbp(), PyramidGrid()); break;
+        case EXT_FPLbp:    return makePtr< FusedExtractor<FeatureFPLbp,GriddedHist> >(FeatureFPLbp(), GriddedHist()); break;
+        case EXT_FPLBP_P:  return makePtr< FusedExtractor<FeatureFPLbp,PyramidGrid> >(FeatureFPLbp(), PyramidGrid()); break;
+        case EXT_MTS:      return makePtr< FusedExtractor<FeatureMTS,GriddedHist> >(FeatureMTS(), GriddedHist()); break;
+        case EXT_MTS_P:    return makePtr< FusedExtractor<FeatureMTS,PyramidGrid> >(FeatureMTS(), PyramidGrid()); break;
+        case EXT_BGC1:     return makePtr< FusedExtractor<FeatureBGC1,GriddedHist> >(FeatureBGC1(), GriddedHist()); break;
+        case EXT_BGC1_P:   return makePtr< FusedExtractor<FeatureBGC1,PyramidGrid> >(FeatureBGC1(), PyramidGrid()); break;
         case EXT_COMB:     return makePtr< CombinedExtractor<GriddedHist> >(GriddedHist()); break;
         case EXT_COMB_P:   return makePtr< CombinedExtractor<PyramidGrid> >(PyramidGrid()); break;
         //case EXT_Sift:     return makePtr< ExtractorSIFTGrid >(32); break;
-        case EXT_Grad:     return makePtr< GenericExtractor<FeatureGrad,GriddedHist> >(FeatureGrad(),GriddedHist());  break;
-        case EXT_Grad_P:   return makePtr< GenericExtractor<FeatureGrad,PyramidGrid> >(FeatureGrad(),PyramidGrid()); break;
+        case EXT_Grad:     return makePtr< GradExtractor<GriddedHist> >(FeatureGrad(),GriddedHist());  break;
+        case EXT_Grad_P:   return makePtr< GradExtractor<PyramidGrid> >(FeatureGrad(),PyramidGrid()); break;
         case EXT_GradMag:  return makePtr< GradMagExtractor<GriddedHist> >(GriddedHist()); break;
         case EXT_GradMag_P:return makePtr< GradMagExtractor<PyramidGrid> >(PyramidGrid()); break;
         case EXT_GradBin:  return makePtr< ExtractorGradBin >(); break;
@@ -1261,6 +2298,8 @@ cv::Ptr<Extractor> createExtractor(int extract)
         case EXT_HDGRAD:   return makePtr< HighDimGrad >();  break;
         case EXT_HDLBP:    return makePtr< HighDimLbp >();  break;
         case EXT_HDLBP_PCA:return makePtr< HighDimLbpPCA >();  break;
+        case EXT_HDLBP_PCA8:return makePtr< HighDimLbpPCA >(int(HighDimLbpPCA::Q8));  break;
+        case EXT_HDLBP_PCA16:return makePtr< HighDimLbpPCA >(int(HighDimLbpPCA::F16));  break;
         //case EXT_PCASIFT:  return makePtr< HighDimPCASift >();  break;
         case EXT_PNET:     return makePtr< ExtractorPNet >("data/pnet.xml");  break;
         case EXT_CDIKP:    return makePtr< ExtractorCDIKP >();  break;
@@ -1,9 +1,13 @@
 #include <opencv2/imgproc.hpp>
+#include <opencv2/core/utility.hpp>
+#include <opencv2/hal.hpp>
 using namespace cv;
 
 #include "texturefeature.h"
+#include "fwht.h"
 
 #include <iostream>
+#include <map>
 using namespace std;
 
 using namespace TextureFeature;
@@ -20,95 +24,302 @@ struct FilterWalshHadamard : public Filter
 
     FilterWalshHadamard(int k=0) : keep(k) {}
 
-    template<class T>
-    void fast_had(int ndim, int lev, T *in, T *out) const
+    virtual int filter(const Mat &src, Mat &dest) const
     {
-        int h = lev/2;
-        for (int j=0; j<ndim/lev; j++)
-        {
-            for(int i=0; i<h; i++)
-            {
-                out[i]   = in[i] + in[i+h];
-                out[i+h] = in[i] - in[i+h];
-            }
-            out += lev;
-            in  += lev;
-        }
+        fwhtRows(src.reshape(1,1), dest, keep);
+        return 0;
     }
 
-    virtual int filter(const Mat &src, Mat &dest) const
+    virtual int filterBatch(const Mat &src, Mat &dest) const
     {
-        Mat h; src.convertTo(h,CV_32F);
-        Mat h2(h.size(), h.type());
-        for (int lev=src.total(); lev>2; lev/=2)
-        {
-            fast_had(src.total(), lev, h.ptr<float>(), h2.ptr<float>());
-            if (lev>4) cv::swap(h,h2);
-        }
-        if (keep>0)
-            dest = h2(Rect(0,0,std::min(keep,h2.cols-1),1));
-        else
-            dest = h2;
+        fwhtRows(src, dest, keep);
         return 0;
     }
 };
 
 
 
+//
+// forward dft, truncated to the first 'keep' (ccs packed) values,
+// then the inverse transform of those.
+//   (dft instead of dct solves pow2 issue)
+//   batches go through dft() as a whole, DFT_ROWS.
+//
+// the whole thing is linear, so for very few coefficients, it collapses into
+// a single (N x keep) basis, cached per input length, and one gemm.
+// a row of that costs about 0.65ns * N * keep, the two dft's about
+// 0.8..1.5ns * N * log2(N) (measured, 24000 and 96000 floats):
+//                      keep 8    16      24      32      fft
+//     N=24000           142us   247us   408us   613us   272us
+//     N=96000           777us   914us  1528us  2217us  2450us
+// so the basis is used up to keep = 1.25 * log2(N), (20 for 96000).
+// the shipped DCT1..DCT24 filters keep far more, and stay on the dft path,
+// which reuses its (per thread) scratch buffers across calls.
+//
 struct FilterDct : public Filter
 {
     int keep;
 
+    struct Scratch { Mat h, h2; };
+    mutable TLSData<Scratch> scratch;
+    mutable Mutex mtx;
+    mutable map<int, Mat> plans; // input length -> basis, CV_32F (N x k)
+
     FilterDct(int k=0) : keep(k) {}
 
-    virtual int filter(const Mat &src, Mat &dest) const
+    int coefficients(int n) const
     {
-        Mat h; src.convertTo(h, CV_32F);
-        Mat h2(h.size(), h.type());
+        return keep>0 ? std::max(1, std::min(keep, n-1)) : n;
+    }
+
+    bool direct(int n) const
+    {
+        return keep > 0 && n > 1 && 4 * coefficients(n) <= 5 * std::log(double(n)) / std::log(2.0);
+    }
 
-        dft(h, h2, DFT_ROWS); // dft instead of dct solves pow2 issue
+    //
+    // row t of the basis: the inverse transform of the first k (ccs packed)
+    //   forward coefficients of the unit vector e_t.
+    //
+    const Mat &basis(int n) const
+    {
+        AutoLock lock(mtx);
+        Mat &b = plans[n];
+        if (! b.empty())
+            return b;
+        int k = coefficients(n);
+        Mat f(n, k, CV_64F);
+        for (int t=0; t<n; t++)
+        {
+            double *r = f.ptr<double>(t);
+            r[0] = 1;
+            for (int m=1; 2*m-1<k; m++)
+            {
+                double a = 2 * CV_PI * double((int64(m) * t) % n) / n;
+                r[2*m-1] = std::cos(a);
+                if (2*m < k)
+                    r[2*m] = -std::sin(a);
+            }
+        }
+        dft(f, f, DFT_INVERSE | DFT_SCALE | DFT_ROWS);
+        f.convertTo(b, CV_32F);
+        return b;
+    }
 
-        Mat h3 = (keep>0) ?
-                 h2(Rect(0, 0, std::min(keep, h2.cols-1), 1)) :
-                 h2;
+    // all rows of h (CV_32F) at once
+    void transform(const Mat &h, Mat &dest) const
+    {
+        int n = h.cols;
+        if (direct(n))
+        {
+            gemm(h, basis(n), 1, noArray(), 0, dest);
+            return;
+        }
+        Scratch &s = scratch.getRef();
+        dft(h, s.h2, DFT_ROWS);
+        dft(s.h2.colRange(0, coefficients(n)), dest, DCT_INVERSE | DFT_SCALE | DFT_ROWS);
+    }
 
-        dft(h3, dest, DCT_INVERSE | DFT_SCALE | DFT_ROWS);
+    Mat input(const Mat &src) const
+    {
+        if (src.type() == CV_32F)
+            return src;
+        Mat &h = scratch.getRef().h;
+        src.convertTo(h, CV_32F);
+        return h;
+    }
+
+    virtual int filter(const Mat &src, Mat &dest) const
+    {
+        transform(input(src.reshape(1,1)), dest);
+        return 0;
+    }
+
+    virtual int filterBatch(const Mat &src, Mat &dest) const
+    {
+        transform(input(src), dest);
         return 0;
     }
 };
 
 
+//
+// random projection to K dims, without a stored matrix:
+//   each row of the (N x K) projection gets generated on the fly, from a local rng,
+//   seeded with (seed,row). so concurrent filter() calls are safe,
+//   and the batched path sees exactly the same matrix.
+//
+//   SPARSE     : "Very Sparse Random Projections", Li, Hastie, Church, s = sqrt(N)
+//   ACHLIOPTAS : "Database-friendly random projections", s = 3
+//                (entries are +-sqrt(s/K) with probability 1/2s each, else 0)
+//   SRHT       : subsampled randomized hadamard transform,
+//                random signs, fwht, then K of the coefficients.
+//
 struct FilterRandomProjection : public Filter
 {
+    enum Mode { SPARSE, ACHLIOPTAS, SRHT };
+
     int K;
+    int mode;
+    uint64 seed;
 
-    FilterRandomProjection(int k) : K(k) {}
+    FilterRandomProjection(int k, int mode=SPARSE, uint64 seed=37183927)
+        : K(k), mode(mode), seed(seed)
+    {}
 
-    const Mat & setup(int N) const
+    // probability of a nonzero entry (1/s)
+    double density(int N) const
     {
-        static Mat proj; // else it can't be const ;(
-        if (proj.rows==N && proj.cols==K)
-            return proj;
+        return (mode==ACHLIOPTAS) ? 1.0/3 : 1.0/std::sqrt(double(std::max(N,1)));
+    }
 
-        proj = Mat(N, K, CV_32F);
+    //
+    // nonzeros of projection row i, as +-(col+1).
+    //   the gaps between them are geometric, so only those get drawn.
+    //
+    int nonzeros(int i, double p, int *nz) const
+    {
+        RNG rng(seed * CV_BIG_UINT(0x9E3779B97F4A7C15) + uint64(i+1) * CV_BIG_UINT(0xBF58476D1CE4E5B9));
+        double lq = std::log(1.0 - std::min(p, 0.999999));
+        int n = 0;
+        for (int c=-1; ; )
+        {
+            double g = std::log(1.0 - rng.uniform(0.0, 1.0)) / lq;
+            if (g >= K)
+                break;
+            c += 1 + int(g);
+            if (c >= K)
+                break;
+            nz[n++] = (rng.next() & 1) ? (c+1) : -(c+1);
+        }
+        return n;
+    }
 
-        theRNG().state = 37183927;
-        randn(proj, Scalar(0.5), Scalar(0.5));
-        //randu(proj, Scalar(0), Scalar(1));
+    // random signs for the N inputs, and min(K,P) distinct picks out of P coefficients
+    void srht(int N, int P, vector<float> &signs, vector<int> &pick) const
+    {
+        RNG rng(seed);
+        signs.resize(N);
+        for (int i=0; i<N; i++)
+            signs[i] = (rng.next() & 1) ? 1.0f : -1.0f;
+
+        vector<int> perm(P);
+        for (int i=0; i<P; i++)
+            perm[i] = i;
+        int k = std::min(K, P);
+        for (int i=0; i<k; i++)
+            std::swap(perm[i], perm[i + rng.uniform(0, P-i)]);
+        pick.assign(perm.begin(), perm.begin() + k);
+    }
 
-        for (int i=0; i<K; i++)
+    void filterSrht(const Mat &s, Mat &dest) const
+    {
+        int N = s.cols, P = fwhtLength(N);
+        vector<float> signs;
+        vector<int> pick;
+        srht(N, P, signs, pick);
+
+        Mat x(s.rows, N, CV_32F);
+        for (int r=0; r<s.rows; r++)
+        {
+            const float *a = s.ptr<float>(r);
+            float *b = x.ptr<float>(r);
+            for (int i=0; i<N; i++)
+                b[i] = a[i] * signs[i];
+        }
+        Mat f;
+        fwhtRows(x, f);
+
+        float sc = float(1.0 / std::sqrt(double(pick.size())));
+        Mat y(s.rows, int(pick.size()), CV_32F);
+        for (int r=0; r<s.rows; r++)
         {
-            normalize(proj.col(i), proj.col(i));
+            const float *a = f.ptr<float>(r);
+            float *b = y.ptr<float>(r);
+            for (size_t j=0; j<pick.size(); j++)
+                b[j] = a[pick[j]] * sc;
         }
-        return proj;
+        dest = y;
     }
 
     virtual int filter(const Mat &src, Mat &dest) const
     {
-        const Mat &proj = setup(src.cols);
+        Mat s; src.reshape(1,1).convertTo(s, CV_32F);
+        if (mode == SRHT)
+        {
+            filterSrht(s, dest);
+            return 0;
+        }
 
+        // sparse: only the rows hit by nonzero inputs get generated
+        int N = s.cols;
+        double p = density(N);
+        float sc = float(std::sqrt(1.0 / (p * K)));
+        Mat_<float> y(1, K, 0.0f);
+        float *py = y[0];
+        AutoBuffer<int> _nz(K+1);
+        int *nz = _nz;
+        const float *x = s.ptr<float>();
+        for (int i=0; i<N; i++)
+        {
+            if (x[i] == 0)
+                continue;
+            float v = x[i] * sc;
+            int n = nonzeros(i, p, nz);
+            for (int j=0; j<n; j++)
+            {
+                if (nz[j] > 0) py[nz[j]-1] += v;
+                else           py[-nz[j]-1] -= v;
+            }
+        }
+        dest = y;
+        return 0;
+    }
+
+    //
+    // batched: the projection gets generated in blocks of rows,
+    //   each block is applied to all inputs with a gemm.
+    //
+    virtual int filterBatch(const Mat &src, Mat &dest) const
+    {
+        if (src.empty())
+        {
+            dest.release();
+            return 0;
+        }
         Mat s; src.convertTo(s, CV_32F);
-        dest = s * proj;
+        if (mode == SRHT)
+        {
+            filterSrht(s, dest);
+            return 0;
+        }
+
+        const int B = 64;
+        int N = s.cols;
+        double p = density(N);
+        float sc = float(std::sqrt(1.0 / (p * K)));
+        Mat y = Mat::zeros(s.rows, K, CV_32F);
+        Mat block(B, K, CV_32F), t;
+        AutoBuffer<int> _nz(K+1);
+        int *nz = _nz;
+        for (int i0=0; i0<N; i0+=B)
+        {
+            int i1 = std::min(i0+B, N);
+            block = Scalar(0);
+            for (int i=i0; i<i1; i++)
+            {
+                float *b = block.ptr<float>(i-i0);
+                int n = nonzeros(i, p, nz);
+                for (int j=0; j<n; j++)
+                {
+                    if (nz[j] > 0) b[nz[j]-1] = sc;
+                    else           b[-nz[j]-1] = -sc;
+                }
+            }
+            gemm(s.colRange(i0, i1), block.rowRange(0, i1-i0), 1, noArray(), 0, t);
+            y += t;
+        }
+        dest = y;
         return 0;
     }
 };
@@ -170,6 +381,90 @@ struct FilterNormalize : public Filter
 
 
 
+//
+// explicit feature map for additive homogeneous kernels,
+//   so a linear svm on the output approximates the chi2 / intersection kernel svm.
+//
+//   Efficient Additive Kernels via Explicit Feature Maps
+//     A. Vedaldi, A. Zisserman
+//
+//   each bin x>0 maps to 2n+1 values:
+//     sqrt(x L k(0)),  sqrt(2 x L k(jL)) * cos(j L log(x)),  sqrt(2 x L k(jL)) * sin(j L log(x)),  j=1..n
+//   with k() the kernel signature:  chi2: sech(pi l),  intersection: 2/pi / (1+4 l^2)
+//   (hellinger has a trivial map, that's FIL_SQRT)
+//
+struct FilterHomogeneousKernelMap : public Filter
+{
+    enum Kernel { CHI2, INTERSECT };
+
+    int n;
+    double L;
+    std::vector<float> coef; // sqrt(L k(0)), sqrt(2 L k(jL))
+
+    FilterHomogeneousKernelMap(int kernel=CHI2, int order=1)
+        : n(order)
+    {
+        // period of the sampled signature, as in vlfeat (uniform window)
+        double period = (kernel == CHI2) ? 5.86*std::sqrt(double(n)) + 3.65
+                                         : 2.38*std::log(n + 0.8) + 5.6;
+        L = 2 * CV_PI / period;
+        coef.resize(n+1);
+        for (int j=0; j<=n; j++)
+        {
+            double l = j * L;
+            double k = (kernel == CHI2) ? 1.0 / std::cosh(CV_PI * l)
+                                        : 2.0 / CV_PI / (1 + 4 * l * l);
+            coef[j] = float(std::sqrt((j ? 2 : 1) * L * k));
+        }
+    }
+
+    void mapRow(const float *x, float *lx, float *out, int cols) const
+    {
+        const int w = 2*n + 1;
+        for (int i=0; i<cols; i++)
+            lx[i] = std::max(x[i], 1e-30f);
+        hal::log(lx, lx, cols);
+        for (int i=0; i<cols; i++)
+        {
+            float *o = out + i*w;
+            if (x[i] <= 0)
+            {
+                for (int j=0; j<w; j++)
+                    o[j] = 0;
+                continue;
+            }
+            float sx = std::sqrt(x[i]);
+            o[0] = coef[0] * sx;
+            for (int j=1; j<=n; j++)
+            {
+                float a = float(j * L) * lx[i];
+                float c = coef[j] * sx;
+                o[2*j-1] = c * std::cos(a);
+                o[2*j]   = c * std::sin(a);
+            }
+        }
+    }
+
+    virtual int filter(const Mat &src, Mat &dest) const
+    {
+        return filterBatch(src.reshape(1,1), dest);
+    }
+
+    virtual int filterBatch(const Mat &src, Mat &dest) const
+    {
+        Mat x;
+        src.convertTo(x, CV_32F);
+        dest.create(x.rows, x.cols * (2*n+1), CV_32F);
+        AutoBuffer<float> _lx(x.cols);
+        float *lx = _lx;
+        for (int r=0; r<x.rows; r++)
+            mapRow(x.ptr<float>(r), lx, dest.ptr<float>(r), x.cols);
+        return 0;
+    }
+};
+
+
+
 } // TextureFeatureImpl
 
 
@@ -177,6 +472,22 @@ namespace TextureFeature
 {
 using namespace TextureFeatureImpl;
 
+int Filter::filterBatch(const Mat &src, Mat &dest) const
+{
+    Mat out;
+    for (int i=0; i<src.rows; i++)
+    {
+        Mat f;
+        filter(src.row(i), f);
+        f = f.reshape(1,1);
+        if (out.empty())
+            out.create(src.rows, f.cols, f.type());
+        f.copyTo(out.row(i));
+    }
+    dest = out;
+    return 0;
+}
+
 
 Ptr<Filter> createFilter(int filt)
 {
@@ -191,6 +502,8 @@ Ptr<Filter> createFilter(int filt)
         case FIL_WHAD4:    return makePtr<FilterWalshHadamard>(4000); break;
         case FIL_WHAD8:    return makePtr<FilterWalshHadamard>(8000); break;
         case FIL_RP:       return makePtr<FilterRandomProjection>(8000); break;
+        case FIL_RP_ACH:   return makePtr<FilterRandomProjection>(8000, FilterRandomProjection::ACHLIOPTAS); break;
+        case FIL_SRHT:     return makePtr<FilterRandomProjection>(8000, FilterRandomProjection::SRHT); break;
         case FIL_DCT1:     return makePtr<FilterDct>(1000); break;
         case FIL_DCT2:     return makePtr<FilterDct>(2000); break;
         case FIL_DCT4:     return makePtr<FilterDct>(4000); break;
@@ -199,6 +512,8 @@ Ptr<Filter> createFilter(int filt)
         case FIL_DCT12:    return makePtr<FilterDct>(12000); break;
         case FIL_DCT16:    return makePtr<FilterDct>(16000); break;
         case FIL_DCT24:    return makePtr<FilterDct>(24000); break;
+        case FIL_HKM_CHI2: return makePtr<FilterHomogeneousKernelMap>(FilterHomogeneousKernelMap::CHI2); break;
+        case FIL_HKM_INT:  return makePtr<FilterHomogeneousKernelMap>(FilterHomogeneousKernelMap::INTERSECT); break;
 //        default: cerr << "Filter " << filt << " is not yet supported." << endl; exit(-1);
     }
     return Ptr<Filter>();
@@ -107,6 +107,10 @@ class MyFace
     Mat features;
     int nimg;
 
+    // preprocessed training images, waiting for batch extraction
+    vector<Mat> pending;
+    vector<int> pendingLabels;
+
 public:
 
     MyFace(int extract=0, int filt=0, int clsfy=0, int preproc=0, int crop=0, const String &train="dev",int skip=1, bool lab=false)
@@ -131,24 +135,44 @@ public:
         return feat1.reshape(1,1);
     }
 
-    virtual int addTraining(const Mat & img, int label)
+    void flush()
     {
-        Mat feat = extract(img);
+        if (pending.empty())
+            return;
+
+        Mat rows;
+        ext->extractBatch(pending, rows);
+        rows.convertTo(rows, CV_32F);
         if (! fil.empty())
         {
-            fil->filter(feat,feat);
+            fil->filterBatch(rows, rows);
         }
-        if ( features.empty() )
+        for (int i=0; i<rows.rows; i++)
         {
-            features = Mat(nimg, feat.total(), feat.type());
+            Mat feat = rows.row(i);
+            if ( features.empty() )
+            {
+                features = Mat(nimg, feat.total(), feat.type());
+            }
+            feat.copyTo(features.row(labels.rows));
+            labels.push_back(pendingLabels[i]);
         }
-        feat.copyTo(features.row(labels.rows));
-        labels.push_back(label);
-        cerr << feat.cols << " i_" << labels.rows << "\r";
-        return labels.rows;
+        cerr << features.cols << " i_" << labels.rows << "\r";
+        pending.clear();
+        pendingLabels.clear();
+    }
+
+    virtual int addTraining(const Mat & img, int label)
+    {
+        pending.push_back(pre.process(img));
+        pendingLabels.push_back(label);
+        if (pending.size() >= 256)
+            flush();
+        return labels.rows + int(pending.size());
     }
     virtual bool train()
     {
+        flush();
         //cerr << "\n." << features.cols << " ";
         //cerr << "start training." << " ";
         int ok = 0;
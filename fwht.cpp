@@ -0,0 +1,194 @@
+#include "fwht.h"
+#include "simd.h"
+
+#include <algorithm>
+
+using namespace cv;
+
+
+int fwhtLength(int n)
+{
+    int p = 1;
+    while (p < n)
+        p *= 2;
+    return p;
+}
+
+
+//
+// one butterfly stage on two halves of size h:
+//   a[i],b[i] -> a[i]+b[i], a[i]-b[i]
+//
+#ifdef HAVE_SSE
+TARGET_AVX2 static void butterfly_avx2(float *a, float *b, int h)
+{
+    for (int i=0; i<h; i+=8)
+    {
+        __m256 x = _mm256_loadu_ps(a+i);
+        __m256 y = _mm256_loadu_ps(b+i);
+        _mm256_storeu_ps(a+i, _mm256_add_ps(x, y));
+        _mm256_storeu_ps(b+i, _mm256_sub_ps(x, y));
+    }
+}
+
+static void butterfly_sse(float *a, float *b, int h)
+{
+    for (int i=0; i<h; i+=4)
+    {
+        __m128 x = _mm_loadu_ps(a+i);
+        __m128 y = _mm_loadu_ps(b+i);
+        _mm_storeu_ps(a+i, _mm_add_ps(x, y));
+        _mm_storeu_ps(b+i, _mm_sub_ps(x, y));
+    }
+}
+#endif
+
+static void butterfly(float *a, float *b, int h)
+{
+#ifdef HAVE_SSE
+    if (h >= 8 && haveAVX2())
+        return butterfly_avx2(a, b, h);
+    if (h >= 4)
+        return butterfly_sse(a, b, h);
+#endif
+    for (int i=0; i<h; i++)
+    {
+        float x = a[i], y = b[i];
+        a[i] = x + y;
+        b[i] = x - y;
+    }
+}
+
+//
+// only the sums of a butterfly stage: a[i] += b[i]
+//
+static void fold(float *a, const float *b, int h)
+{
+    int i = 0;
+#ifdef HAVE_SSE
+    for (; i<=h-4; i+=4)
+        _mm_storeu_ps(a+i, _mm_add_ps(_mm_loadu_ps(a+i), _mm_loadu_ps(b+i)));
+#endif
+    for (; i<h; i++)
+        a[i] += b[i];
+}
+
+//
+// the last two stages (h=2, h=1) on blocks of 4, all in one register:
+//   [a b c d] -> [a+c b+d a-c b-d] -> [(a+c)+(b+d) (a+c)-(b+d) (a-c)+(b-d) (a-c)-(b-d)]
+//
+static void quads(float *x, int n)
+{
+    int j = 0;
+#ifdef HAVE_SSE
+    const __m128 s2 = _mm_set_ps(-1.0f, -1.0f, 1.0f, 1.0f);
+    const __m128 s1 = _mm_set_ps(-1.0f, 1.0f, -1.0f, 1.0f);
+    for (; j<n; j+=4)
+    {
+        __m128 v = _mm_loadu_ps(x+j);
+        v = _mm_add_ps(_mm_movelh_ps(v, v), _mm_mul_ps(_mm_movehl_ps(v, v), s2));
+        __m128 e = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2,2,0,0));
+        __m128 o = _mm_shuffle_ps(v, v, _MM_SHUFFLE(3,3,1,1));
+        _mm_storeu_ps(x+j, _mm_add_ps(e, _mm_mul_ps(o, s1)));
+    }
+#endif
+    for (; j<n; j+=4)
+    {
+        float a = x[j], b = x[j+1], c = x[j+2], d = x[j+3];
+        float p = a+c, q = b+d, r = a-c, s = b-d;
+        x[j]   = p+q;
+        x[j+1] = p-q;
+        x[j+2] = r+s;
+        x[j+3] = r-s;
+    }
+}
+
+
+void fwht(float *x, int n)
+{
+    CV_Assert(n > 0 && (n & (n-1)) == 0);
+    if (n == 1)
+        return;
+    if (n == 2)
+    {
+        float a = x[0], b = x[1];
+        x[0] = a + b;
+        x[1] = a - b;
+        return;
+    }
+    // the stages commute, so the wide ones go first, and the last two are done in registers
+    for (int h=n/2; h>=4; h/=2)
+    {
+        for (int j=0; j<n; j+=2*h)
+            butterfly(x+j, x+j+h, h);
+    }
+    quads(x, n);
+}
+
+
+//
+// H(n) = [ H(h)  H(h) ]
+//        [ H(h) -H(h) ]
+//  so the top half of the output only depends on the sums of the input halves,
+//  and anything below 'keep' never has to be computed.
+//
+void fwhtPruned(float *x, int n, int keep)
+{
+    if (keep <= 0)
+        keep = n;
+    while (keep < n)
+    {
+        int h = n/2;
+        if (keep <= h)
+        {
+            fold(x, x+h, h);
+        }
+        else
+        {
+            butterfly(x, x+h, h);
+            fwht(x, h);
+            x += h;
+            keep -= h;
+        }
+        n = h;
+    }
+    fwht(x, n);
+}
+
+
+struct ParallelFwht : public ParallelLoopBody
+{
+    const Mat &src;
+    Mat &dst;
+    int n;
+
+    ParallelFwht(const Mat &src, Mat &dst, int n)
+        : src(src), dst(dst), n(n)
+    {}
+
+    virtual void operator()(const Range &range) const
+    {
+        AutoBuffer<float> _buf(n);
+        float *buf = _buf;
+        for (int r=range.start; r<range.end; r++)
+        {
+            const float *s = src.ptr<float>(r);
+            std::copy(s, s + src.cols, buf);
+            std::fill(buf + src.cols, buf + n, 0.0f);
+            fwhtPruned(buf, n, dst.cols);
+            std::copy(buf, buf + dst.cols, dst.ptr<float>(r));
+        }
+    }
+};
+
+
+void fwhtRows(const Mat &src, Mat &dst, int keep)
+{
+    Mat s;
+    src.convertTo(s, CV_32F);
+    int n = fwhtLength(s.cols);
+    int k = (keep > 0) ? std::min(keep, n) : n;
+    Mat out(s.rows, k, CV_32F);
+    parallel_for_(Range(0, s.rows), ParallelFwht(s, out, n));
+    dst = out;
+}
@@ -0,0 +1,26 @@
+#ifndef __Fwht_onboard__
+#define __Fwht_onboard__
+
+//
+// fast walsh-hadamard transform, in place, unnormalized, natural (hadamard) order.
+//   used by the WHAD filters and the CDIKP extractor.
+//
+#include "opencv2/core.hpp"
+
+
+// next power of 2 >= n
+int fwhtLength(int n);
+
+// full transform of x, n has to be a power of 2
+void fwht(float *x, int n);
+
+// same, but only the leading keep outputs are valid afterwards
+// (the other branches of the butterfly tree get skipped)
+void fwhtPruned(float *x, int n, int keep);
+
+// batched mode: each row of src gets zero padded to fwhtLength(src.cols), transformed,
+// and the leading keep coefficients (all, if keep<=0) go to dst, as CV_32F.
+void fwhtRows(const cv::Mat &src, cv::Mat &dst, int keep=0);
+
+
+#endif // __Fwht_onboard__
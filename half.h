@@ -0,0 +1,91 @@
+#ifndef __Half_onboard__
+#define __Half_onboard__
+
+//
+// fp16 storage for float galleries and weights.
+//   opencv 3.0 has no half float mat type, so the halfs live in CV_16U mats,
+//   and get converted here: bitwise in plain c++, or with vcvtph2ps,
+//   if the cpu has f16c (see simd.h).
+//
+#include "opencv2/core.hpp"
+#include "simd.h"
+
+namespace quant
+{
+
+inline ushort toHalf(float f) // round to nearest even
+{
+    Cv32suf in;
+    in.f = f;
+    unsigned sign = (in.u >> 16) & 0x8000;
+    unsigned m = in.u & 0x7fffff;
+    int ex = int((in.u >> 23) & 0xff);
+    if (ex == 0xff) // inf, nan
+        return ushort(sign | 0x7c00 | (m ? 0x200 : 0));
+    int e = ex - 127 + 15;
+    if (e >= 31)
+        return ushort(sign | 0x7c00);
+    if (e <= 0) // subnormal
+    {
+        if (e < -10)
+            return ushort(sign);
+        m |= 0x800000;
+        int shift = 14 - e;
+        unsigned h = m >> shift, rem = m & ((1u << shift) - 1), half = 1u << (shift - 1);
+        if (rem > half || (rem == half && (h & 1)))
+            h++;
+        return ushort(sign | h);
+    }
+    unsigned h = (unsigned(e) << 10) | (m >> 13), rem = m & 0x1fff;
+    if (rem > 0x1000 || (rem == 0x1000 && (h & 1)))
+        h++; // a carry into the exponent is still the right answer
+    return ushort(sign | h);
+}
+
+inline float fromHalf(ushort h)
+{
+    unsigned sign = unsigned(h & 0x8000) << 16, e = (h >> 10) & 0x1f, m = h & 0x3ff;
+    Cv32suf out;
+    if (e == 0)
+    {
+        out.f = float(m) * (1.0f / 16777216.0f);
+        out.u |= sign;
+        return out.f;
+    }
+    out.u = sign | ((e == 31) ? (0x7f800000 | (m << 13)) : (((e + 112) << 23) | (m << 13)));
+    return out.f;
+}
+
+#ifdef HAVE_SSE
+TARGET_AVX2_F16C inline float dot_f16_avx2(const float *q, const ushort *g, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i<=n-8; i+=8)
+        acc = _mm256_add_ps(acc, _mm256_mul_ps(_mm256_loadu_ps(q+i), _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(g+i)))));
+    __m128 v = _mm_add_ps(_mm256_castps256_ps128(acc), _mm256_extractf128_ps(acc, 1));
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    float d = _mm_cvtss_f32(v);
+    for (; i<n; i++)
+        d += q[i] * fromHalf(g[i]);
+    return d;
+}
+#endif
+
+// sum(q[i] * g[i]), g in fp16
+inline float dot(const float *q, const ushort *g, int n)
+{
+#ifdef HAVE_SSE
+    if (haveAVX2() && haveF16C())
+        return dot_f16_avx2(q, g, n);
+#endif
+    float d = 0;
+    for (int i=0; i<n; i++)
+        d += q[i] * fromHalf(g[i]);
+    return d;
+}
+
+} // namespace quant
+
+#endif // __Half_onboard__
@@ -0,0 +1,324 @@
+#include "modelfile.h"
+#include "texturefeature.h"
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+ #include <fstream>
+#else
+ #include <sys/mman.h>
+ #include <sys/stat.h>
+ #include <fcntl.h>
+ #include <unistd.h>
+#endif
+
+using namespace cv;
+
+namespace TextureFeature
+{
+
+namespace
+{
+enum { ALIGN=64, NAMELEN=64 };
+
+const char MAGIC[8] = { 'T','F','M','O','D','E','L','\0' };
+const unsigned ORDER = 0x01020304;
+
+struct Header // 64 bytes
+{
+    char     magic[8];
+    unsigned version;
+    unsigned order;     // ORDER, as written by a little endian machine
+    int      extractor, filter, classifier;
+    unsigned count;     // toc entries
+    uint64   toc;       // file offset of the toc
+    char     pad[24];
+};
+
+struct TocEntry // 96 bytes
+{
+    char   name[NAMELEN];
+    int    type, rows, cols, pad;
+    uint64 offset;      // file offset of the first row
+    uint64 step;        // bytes per row
+};
+
+bool littleEndian()
+{
+    unsigned v = 1;
+    return *(const uchar*)&v == 1;
+}
+
+size_t aligned(size_t n)
+{
+    return (n + ALIGN - 1) & ~size_t(ALIGN - 1);
+}
+} // namespace
+
+
+//
+// the mapped (or, on windows, read) file
+//
+struct ModelFile::Mapping
+{
+    uchar *data;
+    size_t size;
+
+    Mapping() : data(0), size(0) {}
+
+    bool open(const String &fn)
+    {
+#ifdef _WIN32
+        std::ifstream in(fn.c_str(), std::ios::binary | std::ios::ate);
+        if (! in)
+            return false;
+        size = size_t(in.tellg());
+        data = new uchar[size];
+        in.seekg(0);
+        in.read((char*)data, size);
+        return bool(in);
+#else
+        int fd = ::open(fn.c_str(), O_RDONLY);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size < off_t(sizeof(Header)))
+        {
+            ::close(fd);
+            return false;
+        }
+        size = size_t(st.st_size);
+        void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            return false;
+        data = (uchar*)p;
+        return true;
+#endif
+    }
+
+    ~Mapping()
+    {
+        if (! data)
+            return;
+#ifdef _WIN32
+        delete [] data;
+#else
+        munmap(data, size);
+#endif
+    }
+};
+
+
+//
+// owns nothing but a reference to the mapping.
+//   Mats from get() carry one of these in their UMatData,
+//   so the pages get unmapped with the last Mat referring to them.
+//
+struct MappedAllocator : public MatAllocator
+{
+    UMatData *allocate(int, const int *, int, void *, size_t *, int, UMatUsageFlags) const
+    {
+        return 0; // never used for allocation
+    }
+
+    bool allocate(UMatData *, int, UMatUsageFlags) const
+    {
+        return false;
+    }
+
+    void deallocate(UMatData *u) const
+    {
+        if (u && u->refcount == 0 && u->urefcount == 0)
+        {
+            delete (Ptr<ModelFile::Mapping>*)u->userdata;
+            delete u;
+        }
+    }
+
+    static MappedAllocator *instance()
+    {
+        static MappedAllocator alloc;
+        return &alloc;
+    }
+};
+
+static Mat wrap(const Ptr<ModelFile::Mapping> &mapping, const TocEntry &e)
+{
+    Mat m(e.rows, e.cols, e.type, mapping->data + e.offset, size_t(e.step));
+    UMatData *u = new UMatData(MappedAllocator::instance());
+    u->data = u->origdata = m.data;
+    u->size = size_t(e.step) * e.rows;
+    u->refcount = 1;
+    u->userdata = new Ptr<ModelFile::Mapping>(mapping);
+    m.u = u;
+    return m;
+}
+
+
+
+ModelFile::ModelFile(int ext, int fil, int cls)
+    : extractor(ext), filter(fil), classifier(cls)
+{}
+
+const ModelFile::Entry *ModelFile::find(const String &name) const
+{
+    for (size_t i=0; i<entries.size(); i++)
+        if (entries[i].name == name)
+            return &entries[i];
+    return 0;
+}
+
+void ModelFile::put(const String &name, const Mat &m)
+{
+    CV_Assert(name.size() < NAMELEN && m.dims <= 2);
+    Entry e;
+    e.name = name;
+    e.mat = m;
+    entries.push_back(e);
+}
+
+void ModelFile::put(const String &name, int v)
+{
+    put(name, Mat(Mat_<int>(1,1) << v));
+}
+
+void ModelFile::put(const String &name, const String &s)
+{
+    put(name, Mat(1, int(s.size()), CV_8U, (void*)s.c_str()).clone());
+}
+
+bool ModelFile::write(const String &fn) const
+{
+    CV_Assert(littleEndian()); // the format is little endian only
+
+    FILE *f = fopen(fn.c_str(), "wb");
+    if (! f)
+        return false;
+
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.order = ORDER;
+    h.extractor = extractor;
+    h.filter = filter;
+    h.classifier = classifier;
+    h.count = unsigned(entries.size());
+    fwrite(&h, sizeof(h), 1, f); // placeholder, the toc offset is not known yet
+
+    static const char zeros[ALIGN] = {0};
+    size_t pos = sizeof(h);
+    std::vector<TocEntry> toc(entries.size());
+    for (size_t i=0; i<entries.size(); i++)
+    {
+        const Mat &m = entries[i].mat;
+        TocEntry &e = toc[i];
+        memset(&e, 0, sizeof(e));
+        strncpy(e.name, entries[i].name.c_str(), NAMELEN-1);
+        e.type = m.type();
+        e.rows = m.rows;
+        e.cols = m.cols;
+        e.step = m.cols * m.elemSize();
+
+        size_t start = aligned(pos);
+        fwrite(zeros, 1, start - pos, f);
+        e.offset = start;
+        for (int r=0; r<m.rows; r++)
+            fwrite(m.ptr(r), 1, size_t(e.step), f);
+        pos = start + size_t(e.step) * m.rows;
+    }
+
+    size_t start = aligned(pos);
+    fwrite(zeros, 1, start - pos, f);
+    if (! toc.empty())
+        fwrite(&toc[0], sizeof(TocEntry), toc.size(), f);
+    h.toc = start;
+
+    fseek(f, 0, SEEK_SET);
+    fwrite(&h, sizeof(h), 1, f);
+    bool ok = ! ferror(f);
+    fclose(f);
+    return ok;
+}
+
+bool ModelFile::open(const String &fn)
+{
+    entries.clear();
+    mapping = makePtr<Mapping>();
+    if (! mapping->open(fn))
+        return false;
+
+    const Header &h = *(const Header*)mapping->data;
+    if (memcmp(h.magic, MAGIC, sizeof(MAGIC)) != 0 || h.order != ORDER || h.version > VERSION)
+        return false;
+    if (h.toc + uint64(h.count) * sizeof(TocEntry) > mapping->size)
+        return false;
+
+    extractor = h.extractor;
+    filter = h.filter;
+    classifier = h.classifier;
+
+    const TocEntry *toc = (const TocEntry*)(mapping->data + h.toc);
+    for (unsigned i=0; i<h.count; i++)
+    {
+        const TocEntry &t = toc[i];
+        if (t.offset + t.step * t.rows > mapping->size)
+            return false;
+        Entry e;
+        e.name = String(t.name, strnlen(t.name, NAMELEN));
+        if (t.rows > 0 && t.cols > 0)
+            e.mat = wrap(mapping, t);
+        entries.push_back(e);
+    }
+    return true;
+}
+
+bool ModelFile::has(const String &name) const
+{
+    return find(name) != 0;
+}
+
+Mat ModelFile::get(const String &name) const
+{
+    const Entry *e = find(name);
+    return e ? e->mat : Mat();
+}
+
+int ModelFile::getInt(const String &name, int def) const
+{
+    Mat m = get(name);
+    return m.empty() ? def : m.at<int>(0);
+}
+
+String ModelFile::getString(const String &name) const
+{
+    Mat m = get(name);
+    return m.empty() ? String() : String((const char*)m.ptr(), m.total());
+}
+
+
+
+//
+// default binary io for the Serialize interface:
+//   embed the FileStorage version as text, for models that have no (large) matrices to map.
+//
+bool Serialize::write(ModelFile &mf) const
+{
+    FileStorage fs(".yml", FileStorage::WRITE + FileStorage::MEMORY);
+    bool ok = save(fs);
+    mf.put("storage", fs.releaseAndGetString());
+    return ok;
+}
+
+bool Serialize::read(const ModelFile &mf)
+{
+    String s = mf.getString("storage");
+    if (s.empty())
+        return false;
+    FileStorage fs(s, FileStorage::READ + FileStorage::MEMORY);
+    return load(fs);
+}
+
+} // namespace TextureFeature
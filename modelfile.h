@@ -0,0 +1,58 @@
+#ifndef __ModelFile_onboard__
+#define __ModelFile_onboard__
+
+//
+// versioned binary model container.
+//
+//   a fixed header (magic, version, byte order, and the extractor/filter/classifier enums
+//   of the pipeline), 64 byte aligned little endian blobs, and a table of contents at the end.
+//
+//   open() mmaps the file, and get() wraps Mat headers around the mapped pages,
+//   no parsing, no copy. the mapping stays alive as long as any of those Mats does.
+//   (pages are mapped private, writing to them won't touch the file)
+//
+#include "opencv2/core.hpp"
+#include <vector>
+
+namespace TextureFeature
+{
+
+struct ModelFile
+{
+    enum { VERSION=1 };
+
+    int extractor, filter, classifier; // pipeline enums, -1 if unknown
+
+    ModelFile(int ext=-1, int fil=-1, int cls=-1);
+
+    // write side: collect named blobs, then write them out.
+    //  (mats are referenced, not copied, until write())
+    void put(const cv::String &name, const cv::Mat &m);
+    void put(const cv::String &name, int v);
+    void put(const cv::String &name, const cv::String &s);
+    bool write(const cv::String &fn) const;
+
+    // read side
+    bool open(const cv::String &fn);
+    bool has(const cv::String &name) const;
+    cv::Mat get(const cv::String &name) const; // empty if missing
+    int getInt(const cv::String &name, int def=0) const;
+    cv::String getString(const cv::String &name) const;
+
+    struct Mapping;
+
+private:
+    struct Entry
+    {
+        cv::String name;
+        cv::Mat mat;
+    };
+    std::vector<Entry> entries;
+    cv::Ptr<Mapping> mapping;
+
+    const Entry *find(const cv::String &name) const;
+};
+
+} // namespace TextureFeature
+
+#endif // __ModelFile_onboard__
@@ -20,6 +20,7 @@ using namespace std;
 using namespace cv;
 
 #include "texturefeature.h"
+#include "modelfile.h"
 #include "preprocessor.h"
 
 #ifdef _WIN32
@@ -58,6 +59,12 @@ class FaceRec
     Ptr<TextureFeature::Classifier> classifier;
 
     map<int,String> persons;
+    int ext, red, cls; // the pipeline, for the binary model header
+
+    static bool binary(const String &fn)
+    {
+        return fn.size() > 4 && fn.substr(fn.size()-4) == ".tfm";
+    }
 
 public:
     FaceRec(int ext, int red, int cls)
@@ -65,6 +72,7 @@ public:
         , extractor(TextureFeature::createExtractor(ext))
         , filter(TextureFeature::createFilter(red))
         , classifier(TextureFeature::createClassifier(cls))
+        , ext(ext), red(red), cls(cls)
     {}
 
     int train(const String &imgdir)
@@ -72,7 +80,7 @@ public:
         string last_n("");
         int label(-1);
 
-        Mat features;
+        vector<Mat> images;
         Mat labels;
 
         vector<String> vec;
@@ -97,17 +105,42 @@ public:
 
             // process img & add to trainset:
             Mat img=imread(vec[i],0);
-
-            Mat feature;
-            extractor->extract(pre.process(img), feature);
-            if (!filter.empty())
-                filter->filter(feature.reshape(1,1), feature);
-            features.push_back(feature);
+            images.push_back(pre.process(img));
             labels.push_back(label);
         }
+
+        Mat features;
+        extractor->extractBatch(images, features);
+        if (!filter.empty())
+            filter->filterBatch(features, features);
         return classifier->train(features, labels);
     }
 
+    //
+    // add a single person: only the new images get processed,
+    //  the classifier gets updated instead of retrained.
+    //
+    int enrol(const String &name, const vector<Mat> &faces)
+    {
+        int label = int(persons.size());
+        map<int,String>::iterator it = persons.begin();
+        for ( ; it != persons.end(); ++it )
+            if (it->second == name)
+                label = it->first;
+        persons[label] = name;
+
+        vector<Mat> images;
+        for (size_t i=0; i<faces.size(); i++)
+            images.push_back(pre.process(faces[i]));
+        Mat labels(int(images.size()), 1, CV_32S, Scalar(label));
+
+        Mat features;
+        extractor->extractBatch(images, features);
+        if (!filter.empty())
+            filter->filterBatch(features, features);
+        return classifier->update(features, labels);
+    }
+
     String predict(const Mat & img)
     {
         Size sz(FIXED_FACE,FIXED_FACE);
@@ -133,8 +166,14 @@ public:
         return format("%s : %2.3f", persons[id].c_str(), conf);
     }
 
+    //
+    // *.tfm files go through the binary (mmap'ed) container,
+    // anything else through FileStorage.
+    //
     bool load(const String &fn)
     {
+        if (binary(fn))
+            return loadBinary(fn);
         FileStorage fs(fn, FileStorage::READ);
         if (! fs.isOpened())
             return false;
@@ -153,6 +192,8 @@ public:
     }
     bool save(const String &fn)
     {
+        if (binary(fn))
+            return saveBinary(fn);
         FileStorage fs(fn, FileStorage::WRITE);
         if (! fs.isOpened())
             return false;
@@ -167,6 +208,49 @@ public:
         fs.release();
         return ok;
     }
+
+    bool loadBinary(const String &fn)
+    {
+        TextureFeature::ModelFile mf;
+        if (! mf.open(fn))
+            return false;
+        if (mf.extractor != ext || mf.filter != red || mf.classifier != cls)
+        {
+            cerr << fn << " : model was made with a different pipeline (" << mf.extractor << " " << mf.filter << " " << mf.classifier << ")" << endl;
+            return false;
+        }
+        bool ok = classifier->read(mf);
+
+        // ids, and '\n' separated names
+        Mat ids = mf.get("person_ids");
+        String names = mf.getString("person_names");
+        size_t p = 0;
+        for (size_t i=0; i<ids.total(); i++)
+        {
+            size_t q = names.find('\n', p);
+            persons[ids.at<int>(int(i))] = names.substr(p, q-p);
+            p = q + 1;
+        }
+        return ok;
+    }
+
+    bool saveBinary(const String &fn)
+    {
+        TextureFeature::ModelFile mf(ext, red, cls);
+        bool ok = classifier->write(mf);
+
+        Mat ids;
+        String names;
+        map<int,String>::iterator it = persons.begin();
+        for ( ; it != persons.end(); ++it )
+        {
+            ids.push_back(it->first);
+            names += it->second + "\n";
+        }
+        mf.put("person_ids", ids);
+        mf.put("person_names", names);
+        return ok && mf.write(fn);
+    }
 };
 
 int main(int argc, const char *argv[])
@@ -214,7 +298,7 @@ int main(int argc, const char *argv[])
     int n = reco.train(imgpath);
     cerr << n << endl;
 
-    String save_model = "face.yml.gz";
+    String save_model = "face.tfm"; // or "face.yml.gz", for a text model
     // alternatively, load a serialized model.
     //reco.load(save_model);
 
@@ -302,7 +386,7 @@ int main(int argc, const char *argv[])
                     {
                         imwrite(format("%s/%6d.png", path.c_str(), theRNG().next()), images[i]);
                     }
-                    reco.train(imgpath);
+                    reco.enrol(n, images);
                 }
             }
             state = NEUTRAL;
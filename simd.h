@@ -0,0 +1,90 @@
+#ifndef __Simd_onboard__
+#define __Simd_onboard__
+
+//
+// runtime cpu dispatch for the handwritten simd paths.
+//
+//   sse2 code gets compiled in with -DHAVE_SSE (see CmakeLists.txt),
+//   wider paths are compiled with a per-function target attribute,
+//   and only get called, if the cpu we're running on supports them.
+//
+#include "opencv2/core/utility.hpp"
+
+#ifdef HAVE_SSE
+ #include <emmintrin.h>
+ #include <immintrin.h>
+ #if defined(__GNUC__)
+  #define TARGET_AVX2 __attribute__((target("avx2")))
+  #define TARGET_POPCNT __attribute__((target("popcnt")))
+  #define TARGET_AVX2_F16C __attribute__((target("avx2,f16c")))
+  #define TARGET_AVX512 __attribute__((target("avx512f")))
+ #else
+  #define TARGET_AVX2
+  #define TARGET_POPCNT
+  #define TARGET_AVX2_F16C
+  #define TARGET_AVX512
+ #endif
+#endif
+
+#if defined(HAVE_SSE) && defined(__GNUC__) && ! defined(CV_CPU_FP16)
+ #include <cpuid.h>
+#endif
+
+
+inline bool haveAVX2()
+{
+#ifdef HAVE_SSE
+    static const bool avx2 = cv::checkHardwareSupport(CV_CPU_AVX2);
+    return avx2;
+#else
+    return false;
+#endif
+}
+
+inline bool haveAVX512()
+{
+#if defined(HAVE_SSE) && defined(CV_CPU_AVX_512F)
+    static const bool avx512 = cv::checkHardwareSupport(CV_CPU_AVX_512F);
+    return avx512;
+#else
+    return false;
+#endif
+}
+
+//
+// half float conversions (vcvtph2ps), a separate cpuid bit from avx2.
+//   older opencv can't tell, so ask the cpu directly there.
+//
+inline bool haveF16C()
+{
+#if defined(HAVE_SSE) && defined(CV_CPU_FP16)
+    static const bool f16c = cv::checkHardwareSupport(CV_CPU_FP16);
+    return f16c;
+#elif defined(HAVE_SSE) && defined(__GNUC__)
+    struct Cpu
+    {
+        static bool f16c()
+        {
+            unsigned a, b, c, d;
+            return __get_cpuid(1, &a, &b, &c, &d) && (c & bit_F16C);
+        }
+    };
+    static const bool f16c = Cpu::f16c();
+    return f16c;
+#else
+    return false;
+#endif
+}
+
+inline bool havePOPCNT()
+{
+#ifdef HAVE_SSE
+    static const bool popcnt = cv::checkHardwareSupport(CV_CPU_POPCNT);
+    return popcnt;
+#else
+    return false;
+#endif
+}
+
+
+#endif // __Simd_onboard__
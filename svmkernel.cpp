@@ -2,88 +2,268 @@
 //#define HAVE_SSE
 
 #include <opencv2/ml.hpp>
+#include <opencv2/hal.hpp>
 using namespace cv;
 
 #include "texturefeature.h"
+#include "simd.h"
+
+#include <list>
 
 using namespace TextureFeature;
 
 namespace TextureFeatureImpl
 {
 
-struct CustomKernel : public ml::SVM::Kernel
+//
+// kernel rows, precomputed or cached, for the custom svm kernels.
+//
+//   the solver asks for the kernel of one training row against all the others,
+//   over and over. for small problems the whole gram matrix gets computed once,
+//   for larger ones, rows go into an lru cache.
+//   the hellinger sqrt is applied once to the training set (and once per query)
+//   by the classifier, see customKernelInput(), so the kernel itself only sees
+//   transformed samples, and all l2 based kernels are a single pass per row.
+//
+//   a cache is only valid for one, unchanged sample set, and the kernel can't
+//   tell that from the buffer (the multiclass svm reuses the same one for each
+//   pair of classes), so the classifier says so explicitly, see customKernelTrain()
+//   and customKernelReady(). other sample sets get computed row by row.
+//
+struct KernelCache
 {
-    int K;
-    CustomKernel(int k) : K(k) {}
+    enum { GRAM_BYTES=256<<20, ROW_BYTES=256<<20 };
 
-#ifdef HAVE_SSE
-    inline float res(const __m128 & s)
+    const float *vecs;          // the sample set this was built for
+    int N, D;
+    Mat gram;                   // all rows, if they fit into GRAM_BYTES
+    Mat rows;                   // else, the lru cached ones:
+    std::vector<int> slot;      //   sample -> row in rows, or -1
+    std::vector<int> owner;     //   row -> sample
+    std::list<int> lru;         //   rows, most recently used first
+    std::vector< std::list<int>::iterator > where;
+
+    KernelCache() : vecs(0), N(0), D(0) {}
+
+    KernelCache(int vcount, int var_count, const float *v) : vecs(v), N(vcount), D(var_count) {}
+
+    bool matches(int vcount, int var_count, const float *v) const
     {
-        union { __m128 m; float f[4]; } x;
-        x.m = s;
-        return (x.f[0] + x.f[1] + x.f[2] + x.f[3]);
+        return vecs == v && N == vcount && D == var_count;
     }
+};
+
+
+//
+// width agnostic reductions sum(op(a[i],b[i])), with runtime dispatch
+//   (avx512, avx2, sse2, scalar). tails get masked (zero filled) instead of
+//   falling back to scalar code, zeros are neutral for all the ops here.
+//
+namespace kern
+{
+struct OpDot
+{
+    static float scalar(float a, float b) { return a*b; }
+#ifdef HAVE_SSE
+    static __m128 sse(__m128 a, __m128 b) { return _mm_mul_ps(a, b); }
+    TARGET_AVX2 static __m256 avx(__m256 a, __m256 b) { return _mm256_mul_ps(a, b); }
+    TARGET_AVX512 static __m512 avx512(__m512 a, __m512 b) { return _mm512_mul_ps(a, b); }
 #endif
+};
+struct OpL2
+{
+    static float scalar(float a, float b) { float d = a - b; return d*d; }
+#ifdef HAVE_SSE
+    static __m128 sse(__m128 a, __m128 b) { __m128 d = _mm_sub_ps(a, b); return _mm_mul_ps(d, d); }
+    TARGET_AVX2 static __m256 avx(__m256 a, __m256 b) { __m256 d = _mm256_sub_ps(a, b); return _mm256_mul_ps(d, d); }
+    TARGET_AVX512 static __m512 avx512(__m512 a, __m512 b) { __m512 d = _mm512_sub_ps(a, b); return _mm512_mul_ps(d, d); }
+#endif
+};
+// (a - sqrt(b))^2, b untransformed (hellinger models saved before customKernelInput())
+struct OpHel
+{
+    static float scalar(float a, float b) { float d = a - std::sqrt(b); return d*d; }
+#ifdef HAVE_SSE
+    static __m128 sse(__m128 a, __m128 b) { __m128 d = _mm_sub_ps(a, _mm_sqrt_ps(b)); return _mm_mul_ps(d, d); }
+    TARGET_AVX2 static __m256 avx(__m256 a, __m256 b) { __m256 d = _mm256_sub_ps(a, _mm256_sqrt_ps(b)); return _mm256_mul_ps(d, d); }
+    TARGET_AVX512 static __m512 avx512(__m512 a, __m512 b) { __m512 d = _mm512_sub_ps(a, _mm512_sqrt_ps(b)); return _mm512_mul_ps(d, d); }
+#endif
+};
+struct OpMin
+{
+    static float scalar(float a, float b) { return std::min(a, b); }
+#ifdef HAVE_SSE
+    static __m128 sse(__m128 a, __m128 b) { return _mm_min_ps(a, b); }
+    TARGET_AVX2 static __m256 avx(__m256 a, __m256 b) { return _mm256_min_ps(a, b); }
+    TARGET_AVX512 static __m512 avx512(__m512 a, __m512 b) { return _mm512_min_ps(a, b); }
+#endif
+};
+// sqrt((a[i]+a[i+1]) * (b[i]+b[i+1])), on (a,a+1) and (b,b+1) pairs, see lowpass()
+struct OpLow
+{
+    static float scalar(float a0, float a1, float b0, float b1) { return std::sqrt((a0+a1) * (b0+b1)); }
+#ifdef HAVE_SSE
+    static __m128 sse(__m128 a0, __m128 a1, __m128 b0, __m128 b1) { return _mm_sqrt_ps(_mm_mul_ps(_mm_add_ps(a0, a1), _mm_add_ps(b0, b1))); }
+    TARGET_AVX2 static __m256 avx(__m256 a0, __m256 a1, __m256 b0, __m256 b1) { return _mm256_sqrt_ps(_mm256_mul_ps(_mm256_add_ps(a0, a1), _mm256_add_ps(b0, b1))); }
+    TARGET_AVX512 static __m512 avx512(__m512 a0, __m512 a1, __m512 b0, __m512 b1) { return _mm512_sqrt_ps(_mm512_mul_ps(_mm512_add_ps(a0, a1), _mm512_add_ps(b0, b1))); }
+#endif
+};
 
+#ifdef HAVE_SSE
+static inline float hsum(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+TARGET_AVX2 static inline float hsum(__m256 v)
+{
+    return hsum(_mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1)));
+}
+TARGET_AVX512 static inline float hsum(__m512 v)
+{
+    __m256 lo = _mm512_castps512_ps256(v);
+    __m256 hi = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+    __m256 s = _mm256_add_ps(lo, hi);
+    return hsum(_mm_add_ps(_mm256_castps256_ps128(s), _mm256_extractf128_ps(s, 1)));
+}
 
-    float l2sqr(int var_count, int j, const float *vecs, const float *another)
-    {
+// first n lanes of p, zeros for the rest
+static inline __m128 load_sse(const float *p, int n)
+{
+    if (n >= 4)
+        return _mm_loadu_ps(p);
+    float t[4] = {0,0,0,0};
+    memcpy(t, p, n*sizeof(float));
+    return _mm_loadu_ps(t);
+}
+TARGET_AVX2 static inline __m256 load_avx(const float *p, int n)
+{
+    __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(n), _mm256_setr_epi32(0,1,2,3,4,5,6,7));
+    return _mm256_maskload_ps(p, mask);
+}
+TARGET_AVX512 static inline __m512 load_avx512(const float *p, int n)
+{
+    return _mm512_maskz_loadu_ps(__mmask16(n >= 16 ? 0xffff : (1u << n) - 1), p);
+}
+
+template <class Op>
+static float sum_sse(const float *a, const float *b, int n)
+{
+    __m128 acc = _mm_setzero_ps();
+    for (int i=0; i<n; i+=4)
+        acc = _mm_add_ps(acc, Op::sse(load_sse(a+i, n-i), load_sse(b+i, n-i)));
+    return hsum(acc);
+}
+template <class Op>
+TARGET_AVX2 static float sum_avx2(const float *a, const float *b, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    int i = 0;
+    for (; i<=n-8; i+=8)
+        acc = _mm256_add_ps(acc, Op::avx(_mm256_loadu_ps(a+i), _mm256_loadu_ps(b+i)));
+    if (i < n)
+        acc = _mm256_add_ps(acc, Op::avx(load_avx(a+i, n-i), load_avx(b+i, n-i)));
+    return hsum(acc);
+}
+template <class Op>
+TARGET_AVX512 static float sum_avx512(const float *a, const float *b, int n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    int i = 0;
+    for (; i<=n-16; i+=16)
+        acc = _mm512_add_ps(acc, Op::avx512(_mm512_loadu_ps(a+i), _mm512_loadu_ps(b+i)));
+    if (i < n)
+        acc = _mm512_add_ps(acc, Op::avx512(load_avx512(a+i, n-i), load_avx512(b+i, n-i)));
+    return hsum(acc);
+}
+
+// n terms, reading n+1 elements of a and b
+static float low_sse(const float *a, const float *b, int n)
+{
+    __m128 acc = _mm_setzero_ps();
+    for (int i=0; i<n; i+=4)
+        acc = _mm_add_ps(acc, OpLow::sse(load_sse(a+i, n-i), load_sse(a+i+1, n-i), load_sse(b+i, n-i), load_sse(b+i+1, n-i)));
+    return hsum(acc);
+}
+TARGET_AVX2 static float low_avx2(const float *a, const float *b, int n)
+{
+    __m256 acc = _mm256_setzero_ps();
+    for (int i=0; i<n; i+=8)
+        acc = _mm256_add_ps(acc, OpLow::avx(load_avx(a+i, n-i), load_avx(a+i+1, n-i), load_avx(b+i, n-i), load_avx(b+i+1, n-i)));
+    return hsum(acc);
+}
+TARGET_AVX512 static float low_avx512(const float *a, const float *b, int n)
+{
+    __m512 acc = _mm512_setzero_ps();
+    for (int i=0; i<n; i+=16)
+        acc = _mm512_add_ps(acc, OpLow::avx512(load_avx512(a+i, n-i), load_avx512(a+i+1, n-i), load_avx512(b+i, n-i), load_avx512(b+i+1, n-i)));
+    return hsum(acc);
+}
+#endif
+
+template <class Op>
+static float sum(const float *a, const float *b, int n)
+{
 #ifdef HAVE_SSE
-        if (var_count % 4 == 0)
-        {
-            __m128 c,d, s = _mm_set_ps1(0);
-            __m128* ptr_a = (__m128*)another;
-            __m128* ptr_b = (__m128*)(&vecs[j*var_count]);
-            for(int k=0; k<var_count; k+=4, ptr_a++, ptr_b++)
-            {
-                c = _mm_sub_ps(*ptr_a, *ptr_b);
-                d = _mm_mul_ps(c, c);
-                s = _mm_add_ps(s, d);
-            }
-            return res(s);
-        } // else fall back to sw
+    if (haveAVX512())
+        return sum_avx512<Op>(a, b, n);
+    if (haveAVX2())
+        return sum_avx2<Op>(a, b, n);
+    return sum_sse<Op>(a, b, n);
+#else
+    float s = 0;
+    for (int i=0; i<n; i++)
+        s += Op::scalar(a[i], b[i]);
+    return s;
 #endif
-        float s = 0;
-        float a,b,c;
-        const float* sample = &vecs[j*var_count];
-        for(int k=0; k<var_count; k++)
-        {
-            a = sample[k];  b = another[k];
-            c = (a-b);
-            s += c*c;
-        }
-        return s;
-    }
+}
 
-    float min(int var_count, int j, const float *vecs, const float *another)
-    {
+// sum(sqrt((a[i]+a[i+1]) * (b[i]+b[i+1]))), for i in [0,n-1)
+static float lowpass(const float *a, const float *b, int n)
+{
+    if (n < 2)
+        return 0;
 #ifdef HAVE_SSE
-        if (var_count % 4 == 0)
-        { 
-            __m128 c,   s = _mm_set_ps1(0);
-            __m128* ptr_a = (__m128*)another;
-            __m128* ptr_b = (__m128*)(&vecs[j*var_count]);
-            for(int k=0; k<var_count; k+=4, ptr_a++, ptr_b++)
-            {
-                c = _mm_min_ps(*ptr_a, *ptr_b);
-                s = _mm_add_ps(s, c);
-            }
-            return res(s);
-        }
+    if (haveAVX512())
+        return low_avx512(a, b, n-1);
+    if (haveAVX2())
+        return low_avx2(a, b, n-1);
+    return low_sse(a, b, n-1);
+#else
+    float s = 0;
+    for (int i=0; i<n-1; i++)
+        s += OpLow::scalar(a[i], a[i+1], b[i], b[i+1]);
+    return s;
 #endif
-        float s = 0;
-        float a,b,c;
-        const float* sample = &vecs[j*var_count];
-        for(int k=0; k<var_count; k++)
-        {
-            a = sample[k];  b = another[k];
-            c = std::min(a,b);
-            s += c*c;
-        }
-        return s;
+}
+} // namespace kern
+
+
+struct CustomKernel : public ml::SVM::Kernel
+{
+    int K;
+    Mutex mtx;
+    KernelCache cache;      // training rows, guarded by mtx
+    bool cacheTraining;     // the training buffer stays the same for the whole train() call
+    bool rawInput;          // hellinger, on samples that did not go through customKernelInput()
+
+    enum { TILE=4096 }; // floats of the query, that stay in cache while all rows go by
+
+    CustomKernel(int k) : K(k), cacheTraining(false), rawInput(false) {}
+
+    float l2sqr(int var_count, int j, const float *vecs, const float *another) const
+    {
+        return kern::sum<kern::OpL2>(another, &vecs[j*var_count], var_count);
     }
 
-    void calc_intersect(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    // histogram intersection
+    float min(int var_count, int j, const float *vecs, const float *another) const
+    {
+        return kern::sum<kern::OpMin>(another, &vecs[j*var_count], var_count);
+    }
+
+    void calc_intersect(int vcount, int var_count, const float* vecs, const float* another, float* results) const
     {
         for(int j=0; j<vcount; j++)
         {
@@ -91,169 +271,259 @@ struct CustomKernel : public ml::SVM::Kernel
         }
     }
 
-    void calc_hellinger(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    void calc_lowpass(int vcount, int var_count, const float* vecs, const float* another, float* results) const
     {
-        CV_Assert (var_count<64000);
-        //float z[64000]; // there *must* be a better idea than this.
-        cv::AutoBuffer<float> buf(var_count);
-        float *z = buf;
-#ifdef HAVE_SSE
-        if (var_count%4 == 0)
-        {
-            __m128* ptr_out= (__m128*)z;
-            __m128* ptr_in = (__m128*)another;
-            // cache sqrt(another[k])        
-            for(int k=0; k<var_count; k+=4, ptr_in++, ptr_out++)
-            {
-                *ptr_out = _mm_sqrt_ps(*ptr_in);
-            }
-            for(int j=0; j<vcount; j++)
-            {
-                __m128 a,b,c,s = _mm_set_ps1(0);
-                __m128* ptr_a = (__m128*)(&vecs[j*var_count]);
-                __m128* ptr_b = (__m128*)z;
-                for(int k=0; k<var_count; k+=4, ptr_a++, ptr_b++)
-                {
-                    a = _mm_sqrt_ps(*ptr_a);
-                    b = _mm_sub_ps(a, *ptr_b);
-                    c = _mm_mul_ps(b, b);
-                    s = _mm_add_ps(s, c);
-                }
-                results[j] = -res(s);
-            }
-            return;
-        }
-#endif       
-        for(int k=0; k<var_count; k+=4)
-        {
-            z[k]   = sqrt(another[k]);
-            z[k+1] = sqrt(another[k+1]);
-            z[k+2] = sqrt(another[k+2]);
-            z[k+3] = sqrt(another[k+3]);
-        }
-
         for(int j=0; j<vcount; j++)
         {
-            double a,b, s = 0;
-            const float* sample = &vecs[j*var_count];
-            for(int k=0; k<var_count; k+=4)
-            {
-                a = sqrt(sample[k]);     b = z[k];    s += (a - b) * (a - b);
-                a = sqrt(sample[k+1]);   b = z[k+1];  s += (a - b) * (a - b);
-                a = sqrt(sample[k+2]);   b = z[k+2];  s += (a - b) * (a - b);
-                a = sqrt(sample[k+3]);   b = z[k+3];  s += (a - b) * (a - b);
-            }
-            results[j] = (float)(-s);
+            results[j] = kern::lowpass(&vecs[j*var_count], another, var_count);
         }
     }
-
-    // assumes, you did the sqrt before on the input data !    
-    void calc_hellinger_sqrt(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    // http://crsouza.blogspot.de/2010/03/kernel-functions-for-machine-learning.html
+    // special case for d=2, so it cancels the sqrt
+    void calc_rational_quadratic(int vcount, int var_count, const float* vecs, const float* another, float* results)
     {
+        const static float C=10.0f;
         for(int j=0; j<vcount; j++)
         {
             float z = l2sqr(var_count,j,vecs,another);
-            results[j] = -(z);
+            results[j] = 1.0f - z / (z+C);
         }
     }
 
-    void calc_lowpass(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    void calc_inv_multiquad(int vcount, int var_count, const float* vecs, const float* another, float* results)
     {
+        float C2 = 100;
         for(int j=0; j<vcount; j++)
         {
-            double s = 0;
-            double a1,a2,b1,b2;
-            const float* sample = &vecs[j*var_count];
-            for(int k=0; k<var_count-1; k++)
-            {
-                a1 = sample[k];    a2 = sample[k+1];
-                b1 = another[k];   b2 = another[k+1];
-                s += sqrt((a1+a2) * (b1+b2));
-            }
-            results[j] = (float)(s);
+            float z = l2sqr(var_count,j,vecs,another);
+            results[j] = 1.0f/sqrt(z+C2);
         }
     }
-    void calc_log(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    void calc_laplacian(int vcount, int var_count, const float* vecs, const float* another, float* results)
     {
+        float sigma = 3;
         for(int j=0; j<vcount; j++)
         {
             float z = l2sqr(var_count,j,vecs,another);
-            results[j] = float(-log(z+1));
+            results[j] = exp(-sqrt(z) / sigma);
         }
     }
+
+    //
+    // the l2 based kernels, as a function of the squared distance
+    //   (of the sqrt'ed samples, for hellinger)
+    //
+    bool l2based() const
+    {
+        return K==-1 || K==-2 || K==-7 || K==-8 || K==-9;
+    }
+
     //
     // KMOD-A New Support Vector Machine Kernel With Moderate Decreasing for
     //  Pattern Recognition. Application to Digit Image Recognition.
     //    N.E. Ayat  M. Cheriet  L. Remaki C.Y. Suen
-    // 
+    //
     //  (4) KMOD(x,y) = K *(exp(gamma / ((||x-y||^2) + (sigma^2))) - 1)
     //
-    void calc_kmod(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    // z holds n squared distances on the way in, kernel values on the way out.
+    //  (exp and log are the vectorized ones from hal)
+    //
+    void finish(float *z, int n) const
     {
-        const float K  = 1.0f;  // normalization constant
-        const float s2 = 15.0f; // kernelsize squared
-        const float ga = 0.7f;  // decrease speed
-
-        for(int j=0; j<vcount; j++)
+        switch(K)
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = K * (exp(ga/(z+s2))-1);
+        case -1: // hellinger
+        case -2: // hellinger, on sqrt'ed input data
+            for (int j=0; j<n; j++)
+                z[j] = -z[j];
+            break;
+        case -7:
+            for (int j=0; j<n; j++)
+                z[j] += 1;
+            hal::log(z, z, n);
+            for (int j=0; j<n; j++)
+                z[j] = -z[j];
+            break;
+        case -8:
+        {
+            const float K  = 1.0f;  // normalization constant
+            const float s2 = 15.0f; // kernelsize squared
+            const float ga = 0.7f;  // decrease speed
+            for (int j=0; j<n; j++)
+                z[j] = ga / (z[j]+s2);
+            hal::exp(z, z, n);
+            for (int j=0; j<n; j++)
+                z[j] = K * (z[j]-1);
+            break;
+        }
+        case -9:
+        {
+            float sigma2 = 3*3;
+            for (int j=0; j<n; j++)
+                z[j] = 1.0f / (1.0f+(z[j]/sigma2));
+            break;
+        }
         }
     }
-    // http://crsouza.blogspot.de/2010/03/kernel-functions-for-machine-learning.html
-    // special case for d=2, so it cancels the sqrt
-    void calc_rational_quadratic(int vcount, int var_count, const float* vecs, const float* another, float* results)
+
+    // one sample against all, the non-l2 kernels
+    void calc_direct(int vcount, int var_count, const float* vecs, const float* another, float* results) const
     {
-        const static float C=10.0f;
-        for(int j=0; j<vcount; j++)
+        switch(K)
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = 1.0f - z / (z+C);
+        //case -2: calc_correl(vcount, var_count, vecs, another, results); break;
+        //case -3: calc_cosine(vcount, var_count, vecs, another, results); break;
+        //case -4: calc_bhattacharyya(vcount, var_count, vecs, another, results); break;
+        case -5: calc_intersect(vcount, var_count, vecs, another, results); break;
+        case -6: calc_lowpass(vcount, var_count, vecs, another, results); break;
         }
     }
 
-    void calc_inv_multiquad(int vcount, int var_count, const float* vecs, const float* another, float* results)
+    //
+    // q against all samples, squared differences in one blocked pass:
+    //  a tile of q stays in cache, while all the rows go by.
+    //
+    template <class Op>
+    void calc_l2(int vcount, int var_count, const float *vecs, const float *q, float *results) const
     {
-        float C2 = 100;
-        for(int j=0; j<vcount; j++)
+        for (int j=0; j<vcount; j++)
+            results[j] = 0;
+        for (int d0=0; d0<var_count; d0+=TILE)
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = 1.0f/sqrt(z+C2);
+            int n = std::min(int(TILE), var_count-d0);
+            for (int j=0; j<vcount; j++)
+                results[j] += kern::sum<Op>(q + d0, vecs + size_t(j)*var_count + d0, n);
         }
+        finish(results, vcount);
     }
-    void calc_laplacian(int vcount, int var_count, const float* vecs, const float* another, float* results)
+
+    // one sample against all, any kernel
+    void calc_row(int vcount, int var_count, const float* vecs, const float* another, float* results) const
     {
-        float sigma = 3;
-        for(int j=0; j<vcount; j++)
+        if (! l2based())
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = exp(-sqrt(z) / sigma);
+            calc_direct(vcount, var_count, vecs, another, results);
+            return;
+        }
+        if (K == -1 && rawInput)
+        {
+            cv::AutoBuffer<float> buf(var_count);
+            float *q = buf;
+            for (int k=0; k<var_count; k++)
+                q[k] = std::sqrt(another[k]);
+            calc_l2<kern::OpHel>(vcount, var_count, vecs, q, results);
+            return;
         }
+        calc_l2<kern::OpL2>(vcount, var_count, vecs, another, results);
     }
-    void calc_cauchy(int vcount, int var_count, const float* vecs, const float* another, float* results)
+
+    struct ParallelGram : public ParallelLoopBody
     {
-        float sigma2 = 3*3;
-        for(int j=0; j<vcount; j++)
+        const CustomKernel &ck;
+        const float *vecs;
+        Mat &gram;
+
+        ParallelGram(const CustomKernel &ck, const float *vecs, Mat &gram) : ck(ck), vecs(vecs), gram(gram) {}
+
+        virtual void operator()(const Range &range) const
         {
-            float z = l2sqr(var_count,j,vecs,another);
-            results[j] = 1.0f / (1.0f+(z/sigma2));
+            int N = gram.rows, D = ck.cache.D;
+            for (int i=range.start; i<range.end; i++)
+                ck.calc_row(N, D, vecs, vecs + size_t(i)*D, gram.ptr<float>(i));
+        }
+    };
+
+    // row i of the kernel matrix, from the gram matrix or the lru cache
+    void cachedRow(int i, const float *vecs, float *results)
+    {
+        KernelCache &c = cache;
+        int N = c.N;
+        if (c.gram.empty() && c.rows.empty() && size_t(N)*N*sizeof(float) <= size_t(KernelCache::GRAM_BYTES))
+        {
+            c.gram.create(N, N, CV_32F);
+            parallel_for_(Range(0, N), ParallelGram(*this, vecs, c.gram));
+        }
+        if (! c.gram.empty())
+        {
+            memcpy(results, c.gram.ptr<float>(i), N*sizeof(float));
+            return;
+        }
+        if (c.rows.empty())
+        {
+            int cap = std::max(2, int(KernelCache::ROW_BYTES / (size_t(N)*sizeof(float))));
+            c.rows.create(std::min(cap, N), N, CV_32F);
+            c.slot.assign(N, -1);
+            c.owner.assign(c.rows.rows, -1);
+            c.where.resize(c.rows.rows);
+        }
+        int s = c.slot[i];
+        if (s >= 0)
+        {
+            c.lru.splice(c.lru.begin(), c.lru, c.where[s]);
+        }
+        else
+        {
+            if (int(c.lru.size()) < c.rows.rows)
+            {
+                s = int(c.lru.size());
+                c.lru.push_front(s);
+                c.where[s] = c.lru.begin();
+            }
+            else // evict the least recently used one
+            {
+                s = c.lru.back();
+                c.lru.splice(c.lru.begin(), c.lru, c.where[s]);
+                c.slot[c.owner[s]] = -1;
+            }
+            c.owner[s] = i;
+            c.slot[i] = s;
+            calc_row(N, c.D, vecs, vecs + size_t(i)*c.D, c.rows.ptr<float>(s));
         }
+        memcpy(results, c.rows.ptr<float>(s), N*sizeof(float));
     }
+
+    // a train() call starts. stable: the sample buffer stays the same for the whole call
+    void beginTraining(bool stable)
+    {
+        AutoLock lock(mtx);
+        cache = KernelCache();
+        cacheTraining = stable;
+        rawInput = false;
+    }
+
+    // training or loading is done
+    void ready(bool raw)
+    {
+        AutoLock lock(mtx);
+        cache = KernelCache();
+        cacheTraining = false;
+        rawInput = raw;
+    }
+
+    // hellinger: sqrt once per sample, here instead of per kernel evaluation
+    Mat input(const Mat &samples) const
+    {
+        if (K != -1 || rawInput)
+            return samples;
+        Mat r;
+        cv::sqrt(samples, r);
+        return r;
+    }
+
     void calc(int vcount, int var_count, const float* vecs, const float* another, float* results)
     {
-        switch(K)
+        // training: one of the samples against all others
+        ptrdiff_t off = another - vecs;
+        if (cacheTraining && off >= 0 && off < ptrdiff_t(vcount)*var_count && off % var_count == 0)
         {
-        case -1: calc_hellinger(vcount, var_count, vecs, another, results); break;
-        case -2: calc_hellinger_sqrt(vcount, var_count, vecs, another, results); break;
-        //case -2: calc_correl(vcount, var_count, vecs, another, results); break;
-        //case -3: calc_cosine(vcount, var_count, vecs, another, results); break;
-        //case -4: calc_bhattacharyya(vcount, var_count, vecs, another, results); break;
-        case -5: calc_intersect(vcount, var_count, vecs, another, results); break;
-        case -6: calc_lowpass(vcount, var_count, vecs, another, results); break;
-        case -7: calc_log(vcount, var_count, vecs, another, results); break;
-        case -8: calc_kmod(vcount, var_count, vecs, another, results); break;
-        case -9: calc_cauchy(vcount, var_count, vecs, another, results); break;
+            AutoLock lock(mtx);
+            if (! cache.matches(vcount, var_count, vecs))
+                cache = KernelCache(vcount, var_count, vecs);
+            cachedRow(int(off / var_count), vecs, results);
+            return;
         }
+        // multiclass training, or prediction: computed directly, lock free
+        calc_row(vcount, var_count, vecs, another, results);
     }
     int getType(void) const
     {
@@ -265,6 +535,31 @@ struct CustomKernel : public ml::SVM::Kernel
     }
 };
 
+// the svm is about to train. stable: the sample buffer stays the same for the
+//  whole call (2 classes), so kernel rows can get cached across solver calls.
+void customKernelTrain(const Ptr<ml::SVM::Kernel> &k, bool stable)
+{
+    Ptr<CustomKernel> ck = k.dynamicCast<CustomKernel>();
+    if (! ck.empty())
+        ck->beginTraining(stable);
+}
+
+// training or loading is done. raw: the support vectors did not go through
+//  customKernelInput() (hellinger models saved before it), the kernel takes the sqrt itself.
+void customKernelReady(const Ptr<ml::SVM::Kernel> &k, bool raw)
+{
+    Ptr<CustomKernel> ck = k.dynamicCast<CustomKernel>();
+    if (! ck.empty())
+        ck->ready(raw);
+}
+
+// the per sample transform of the kernel, for training data and queries alike
+Mat customKernelInput(const Ptr<ml::SVM::Kernel> &k, const Mat &samples)
+{
+    Ptr<CustomKernel> ck = k.dynamicCast<CustomKernel>();
+    return ck.empty() ? samples : ck->input(samples);
+}
+
 Ptr<ml::SVM::Kernel> customKernel(int id)
 {
     return CustomKernel::create(id);
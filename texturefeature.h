@@ -15,23 +15,43 @@ namespace TextureFeature
     struct Extractor
     {
         virtual int extract(const Mat &img, Mat &features) const = 0;
+
+        // one feature row per image. the default runs extract() in parallel,
+        //  extractors may override this with a fused batch kernel.
+        virtual int extractBatch(const std::vector<Mat> &images, Mat &rows) const;
     };
 
     struct Filter
     {
         virtual int filter(const Mat &src, Mat &dest) const = 0;
+
+        // one output row per input row. the default calls filter() on each of them,
+        //  filters may override this with a batched kernel.
+        virtual int filterBatch(const Mat &src, Mat &dest) const;
     };
 
+    struct ModelFile; // binary container, see modelfile.h
+
     struct Serialize // io
     {
         virtual bool save(FileStorage &fs) const  { return false; }
         virtual bool load(const FileStorage &fs)  { return false; }
+
+        // binary, mmap'ed io. the defaults embed the FileStorage version,
+        //  models with large matrices override this to map them directly.
+        virtual bool write(ModelFile &mf) const;
+        virtual bool read(const ModelFile &mf);
     };
 
     struct Classifier : public Serialize // identification
     {
         virtual int predict(const Mat &test, Mat &result) const = 0;
         virtual int train(const Mat &features, const Mat &labels) = 0;
+
+        // one query per row. labels(CV_32S) and scores(CV_32F, distance or response,
+        //  0 if there is none) get one row per query. the default runs predict() in parallel,
+        //  classifiers may override this with a matrix level version.
+        virtual int predictBatch(const Mat &queries, Mat &labels, Mat &scores) const;
         virtual int update(const Mat &features, const Mat &labels) 
         {
             throw("not implemented!");
@@ -91,6 +111,8 @@ namespace TextureFeature
         EXT_LATCH2,
         //EXT_DAISY,
         EXT_PATCH,
+        EXT_HDLBP_PCA8,
+        EXT_HDLBP_PCA16,
         EXT_MAX
     };
     static const char *EXS[] = {
@@ -127,6 +149,8 @@ namespace TextureFeature
         "LATCH2",
         //"DAISY",
         "PATCH",
+        "HDLBP_PCA8",
+        "HDLBP_PCA16",
         0
     };
     enum FIL {
@@ -147,6 +171,10 @@ namespace TextureFeature
         FIL_DCT12,
         FIL_DCT16,
         FIL_DCT24,
+        FIL_RP_ACH,
+        FIL_SRHT,
+        FIL_HKM_CHI2, // explicit chi2 / intersection maps, use with SVM_LIN
+        FIL_HKM_INT,
         FIL_MAX
     };
     static const char *FILS[] = {
@@ -167,6 +195,10 @@ namespace TextureFeature
         "DCT12",
         "DCT16",
         "DCT24",
+        "RP_ACH",
+        "SRHT",
+        "HKM_CHI2",
+        "HKM_INT",
         0
     };
     enum CLA {
@@ -193,6 +225,16 @@ namespace TextureFeature
         CL_PCA_LDA,
         CL_MLP,
         CL_KNN,
+        CL_NORM_HAM,
+        CL_NORM_Q8,
+        CL_NORM_F16,
+        CL_MLP_F16,   // mlp, with fp16 / int8 inference weights
+        CL_MLP_Q8,
+        CL_NORM_Q8_RR, // int8 gallery scan, the best 8 get compared on the float rows
+        CL_KNN_EXACT,  // knn, linear index
+        CL_KNN_APPROX, // knn, kd-forest (float) or lsh (binary), 64 checks
+        CL_KNN_APPROX_HI, // same, 256 checks
+        CL_MLP_ES,     // mlp, early stopping on a 10% held out split
         //CL_MAHALANOBIS,
         CL_MAX
     };
@@ -220,6 +262,16 @@ namespace TextureFeature
         "PCA_LDA",
         "MLP",
         "KNN",
+        "NORM_HAM",
+        "NORM_Q8",
+        "NORM_F16",
+        "MLP_F16",
+        "MLP_Q8",
+        "NORM_Q8_RR",
+        "KNN_EXACT",
+        "KNN_APPROX",
+        "KNN_APPROX_HI",
+        "MLP_ES",
         //"MAHALANOBIS",
         0
     };